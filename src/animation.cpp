@@ -6,6 +6,7 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
+#include "parallel.h"
 
 #include <sys/stat.h>
 
@@ -40,12 +41,12 @@ void Skeleton::computeFinalBoneMatrices( std::vector<Matrix44>& bone_matrices, M
 	updateGlobalMatrices();
 
 	bone_matrices.resize(mesh->bones_info.size());
-	#pragma omp for  
-	for (int i = 0; i < mesh->bones_info.size(); ++i)
+	//usual skeletons fit in one chunk and run here
+	parallel_for(0, (int)mesh->bones_info.size(), ANIMATION_BONE_GRAIN, [&](int i)
 	{
 		BoneInfo& bone_info = mesh->bones_info[i];
 		bone_matrices[i] = mesh->bind_matrix * bone_info.bind_pose * getBoneMatrix( bone_info.name, false ); //use globals
-	}
+	});
 }
 
 void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 layer)
@@ -79,18 +80,16 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 	}
 
 	//blend bones locally
-	#pragma omp for  
-	for (int i = 0; i < result->num_bones; ++i)
+	parallel_for(0, result->num_bones, ANIMATION_BONE_GRAIN, [&](int i)
 	{
 		Skeleton::Bone& bone = result->bones[i];
 		Skeleton::Bone& boneA = a->bones[i];
 		Skeleton::Bone& boneB = b->bones[i];
 		if ( layer != 0xFF && !(bone.layer & layer) ) //not in the same layer
-			continue;
-		#pragma omp for  
+			return;
 		for (int j = 0; j < 16; ++j)
 			bone.model.m[j] = lerp( boneA.model.m[j], boneB.model.m[j], w);
-	}
+	});
 }
 
 void Skeleton::renderSkeleton(Camera* camera, Matrix44 model, Vector4 color, bool render_points)
@@ -198,16 +197,15 @@ void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 	Matrix44* k2 = keyframes + index2 * num_animated_bones;
 
 	//compute local bones
-	#pragma omp for  
-	for (int i = 0; i < num_animated_bones; ++i)
+	parallel_for(0, num_animated_bones, ANIMATION_BONE_GRAIN, [&](int i)
 	{
 		int bone_index = bones_map[i];
 		Skeleton::Bone& bone = skeleton.bones[bone_index];
 		if (layers != 0xFF && !(bone.layer & layers))
-			continue;
+			return;
 		for (int j = 0; j < 16; ++j)
 			bone.model.m[j] = lerp(k[i].m[j], k2[i].m[j], f);
-	}
+	});
 
 	skeleton.updateGlobalMatrices();
 }
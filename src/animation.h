@@ -10,6 +10,7 @@
 class Camera;
 
 #define ANIM_BIN_VERSION 3
+#define ANIMATION_BONE_GRAIN 64 //bones per job, smaller skeletons are not worth spreading
 
 //defined layers for every body
 enum BODY_LAYERS {
@@ -10,10 +10,15 @@
 #include "prefab.h"
 #include "gltf_loader.h"
 #include "renderer.h"
+#include "framecapture.h"
+#include "scenesnapshot.h"
+#include "parallel.h"
 
 #include <cmath>
 #include <string>
 #include <cstdio>
+#include <cstring>
+#include <thread>
 
 Application* Application::instance = nullptr;
 
@@ -23,11 +28,12 @@ GTR::Prefab* prefab = nullptr;
 GTR::Renderer* renderer = nullptr;
 GTR::BaseEntity* selected_entity = nullptr;
 FBO* fbo = nullptr;
+FrameCapture* frame_capture = nullptr;
 Texture* texture = nullptr;
 
 float cam_speed = 150;
 
-Application::Application(int window_width, int window_height, SDL_Window* window)
+Application::Application(int window_width, int window_height, SDL_Window* window, const char* scene_filename)
 {
 	this->window_width = window_width;
 	this->window_height = window_height;
@@ -38,6 +44,11 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	render_gui = true;
 
 	render_wireframe = false;
+	take_screenshot = false;
+	decoupled_update = true;
+	update_pending = false;
+	update_exit = false;
+	update_dt = 0;
 
 	fps = 0;
 	frame = 0;
@@ -66,7 +77,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	//prefab = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
 
 	scene = new GTR::Scene();
-	if (!scene->load("data/scene.json"))
+	if (!scene->load(scene_filename))
 		exit(1);
 
 	GTR::ReflectionProbeEntity* probe = new GTR::ReflectionProbeEntity();
@@ -78,9 +89,27 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 
 	//This class will be the one in charge of rendering all 
 	renderer = new GTR::Renderer(); //here so we have opengl ready in constructor
+	frame_capture = new FrameCapture();
+	snapshot = new GTR::SceneSnapshot();
 
 	//hide the cursor
-	SDL_ShowCursor(!mouse_locked); //hide or show the mouse
+	if (window)
+		SDL_ShowCursor(!mouse_locked); //hide or show the mouse
+}
+
+Application::~Application()
+{
+	//the update thread uses the scene, it has to end first
+	if (update_thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(update_mutex);
+			update_exit = true;
+			update_cond.notify_all();
+		}
+		update_thread.join();
+	}
+	delete snapshot;
 }
 
 //what to do when the image has to be draw
@@ -89,8 +118,13 @@ void Application::render(void)
 	//be sure no errors present in opengl before start
 	checkGLErrors();
 
+	//with the decoupled update the scene and camera may be changing, the copy made for this frame is drawn
+	bool use_snapshot = decoupled_update && snapshot->frame == frame;
+	GTR::Scene* frame_scene = use_snapshot ? &snapshot->scene : scene;
+	Camera* frame_camera = use_snapshot ? &snapshot->camera : camera;
+
 	//set the camera as default (used by some functions in the framework)
-	camera->enable();
+	frame_camera->enable();
 
 	//set default flags
 	glDisable(GL_BLEND);
@@ -106,7 +140,28 @@ void Application::render(void)
 	//Matrix44 model;
 	//renderer->renderPrefab( model, prefab, camera );
 
-	renderer->renderScene(scene, camera);
+	renderer->renderScene(frame_scene, frame_camera);
+
+	//the pixels are written to disk when they arrive, a frame or two later
+	if (take_screenshot)
+	{
+		static int num_screenshots = 0;
+		std::string filename = "screenshot_" + std::to_string(num_screenshots++) + ".tga";
+		int width = window_width;
+		int height = window_height;
+		renderer->readback.readScreen(0, 0, width, height, [filename, width, height](const void* data, int bytes) {
+			Image image;
+			image.resize(width, height, 4);
+			memcpy(image.data, data, bytes);
+			image.saveTGA(filename.c_str());
+			std::cout << " + Screenshot saved: " << filename << std::endl;
+		});
+		take_screenshot = false;
+	}
+
+	//sequence recording, F11 to start and stop
+	frame_capture->update();
+	frame_capture->capture(window_width, window_height);
 
 	//Draw the floor grid, helpful to have a reference point
 	if(render_debug)
@@ -118,46 +173,59 @@ void Application::render(void)
 	//the swap buffers is done in the main loop after this function
 }
 
+void Application::sampleInput()
+{
+	sUpdateInput& input = update_input;
+	memcpy(input.keys, Input::keystate, SDL_NUM_SCANCODES);
+	input.mouse_state = Input::mouse_state;
+	input.mouse_delta = Input::mouse_delta;
+	input.gizmo_using = false;
+	input.mouse_blocked = false;
+	#ifndef SKIP_IMGUI
+		input.gizmo_using = ImGuizmo::IsUsing();
+		input.mouse_blocked = ImGui::IsAnyWindowHovered() || ImGui::IsAnyItemHovered() || ImGui::IsAnyItemActive();
+	#endif
+}
+
+//it may run in the update thread, all the input comes from update_input
 void Application::update(double seconds_elapsed)
 {
+	const sUpdateInput& input = update_input;
 	float speed = seconds_elapsed * cam_speed; //the speed is defined by the seconds_elapsed so it goes constant
 	float orbit_speed = seconds_elapsed * 0.5;
 	
 	//async input to move the camera around
-	if (Input::isKeyPressed(SDL_SCANCODE_LSHIFT)) speed *= 10; //move faster with left shift
-	if (Input::isKeyPressed(SDL_SCANCODE_W) || Input::isKeyPressed(SDL_SCANCODE_UP)) camera->move(Vector3(0.0f, 0.0f, 1.0f) * speed);
-	if (Input::isKeyPressed(SDL_SCANCODE_S) || Input::isKeyPressed(SDL_SCANCODE_DOWN)) camera->move(Vector3(0.0f, 0.0f,-1.0f) * speed);
-	if (Input::isKeyPressed(SDL_SCANCODE_A) || Input::isKeyPressed(SDL_SCANCODE_LEFT)) camera->move(Vector3(1.0f, 0.0f, 0.0f) * speed);
-	if (Input::isKeyPressed(SDL_SCANCODE_D) || Input::isKeyPressed(SDL_SCANCODE_RIGHT)) camera->move(Vector3(-1.0f, 0.0f, 0.0f) * speed);
+	if (input.isKeyPressed(SDL_SCANCODE_LSHIFT)) speed *= 10; //move faster with left shift
+	if (input.isKeyPressed(SDL_SCANCODE_W) || input.isKeyPressed(SDL_SCANCODE_UP)) camera->move(Vector3(0.0f, 0.0f, 1.0f) * speed);
+	if (input.isKeyPressed(SDL_SCANCODE_S) || input.isKeyPressed(SDL_SCANCODE_DOWN)) camera->move(Vector3(0.0f, 0.0f,-1.0f) * speed);
+	if (input.isKeyPressed(SDL_SCANCODE_A) || input.isKeyPressed(SDL_SCANCODE_LEFT)) camera->move(Vector3(1.0f, 0.0f, 0.0f) * speed);
+	if (input.isKeyPressed(SDL_SCANCODE_D) || input.isKeyPressed(SDL_SCANCODE_RIGHT)) camera->move(Vector3(-1.0f, 0.0f, 0.0f) * speed);
 
 	//mouse input to rotate the cam
-	#ifndef SKIP_IMGUI
-	if (!ImGuizmo::IsUsing())
-	#endif
+	if (!input.gizmo_using)
 	{
-		if (mouse_locked || Input::mouse_state & SDL_BUTTON(SDL_BUTTON_RIGHT)) //move in first person view
+		if (mouse_locked || input.mouse_state & SDL_BUTTON(SDL_BUTTON_RIGHT)) //move in first person view
 		{
-			camera->rotate(-Input::mouse_delta.x * orbit_speed * 0.5, Vector3(0, 1, 0));
+			camera->rotate(-input.mouse_delta.x * orbit_speed * 0.5, Vector3(0, 1, 0));
 			Vector3 right = camera->getLocalVector(Vector3(1, 0, 0));
-			camera->rotate(-Input::mouse_delta.y * orbit_speed * 0.5, right);
+			camera->rotate(-input.mouse_delta.y * orbit_speed * 0.5, right);
 		}
 		else //orbit around center
 		{
-			bool mouse_blocked = false;
-			#ifndef SKIP_IMGUI
-						mouse_blocked = ImGui::IsAnyWindowHovered() || ImGui::IsAnyItemHovered() || ImGui::IsAnyItemActive();
-			#endif
-			if (Input::mouse_state & SDL_BUTTON(SDL_BUTTON_LEFT) && !mouse_blocked) //is left button pressed?
+			if (input.mouse_state & SDL_BUTTON(SDL_BUTTON_LEFT) && !input.mouse_blocked) //is left button pressed?
 			{
-				camera->orbit(-Input::mouse_delta.x * orbit_speed, Input::mouse_delta.y * orbit_speed);
+				camera->orbit(-input.mouse_delta.x * orbit_speed, input.mouse_delta.y * orbit_speed);
 			}
 		}
 	}
 	
 	//move up or down the camera using Q and E
-	if (Input::isKeyPressed(SDL_SCANCODE_Q)) camera->moveGlobal(Vector3(0.0f, -1.0f, 0.0f) * speed);
-	if (Input::isKeyPressed(SDL_SCANCODE_E)) camera->moveGlobal(Vector3(0.0f, 1.0f, 0.0f) * speed);
+	if (input.isKeyPressed(SDL_SCANCODE_Q)) camera->moveGlobal(Vector3(0.0f, -1.0f, 0.0f) * speed);
+	if (input.isKeyPressed(SDL_SCANCODE_E)) camera->moveGlobal(Vector3(0.0f, 1.0f, 0.0f) * speed);
+}
 
+void Application::updateCursor()
+{
 	//to navigate with the mouse fixed in the middle
 	SDL_ShowCursor(!mouse_locked);
 	#ifndef SKIP_IMGUI
@@ -170,6 +238,44 @@ void Application::update(double seconds_elapsed)
 	}
 }
 
+void Application::captureSnapshot()
+{
+	snapshot->capture(scene, camera, frame);
+}
+
+void Application::startUpdate(double dt)
+{
+	if (!update_thread.joinable())
+		update_thread = std::thread(&Application::updateLoop, this);
+	sampleInput();
+	std::lock_guard<std::mutex> lock(update_mutex);
+	update_dt = dt;
+	update_pending = true;
+	update_cond.notify_all();
+}
+
+void Application::finishUpdate()
+{
+	std::unique_lock<std::mutex> lock(update_mutex);
+	update_cond.wait(lock, [this] { return !update_pending; });
+}
+
+void Application::updateLoop()
+{
+	std::unique_lock<std::mutex> lock(update_mutex);
+	while (true)
+	{
+		update_cond.wait(lock, [this] { return update_pending || update_exit; });
+		if (update_exit)
+			return;
+		lock.unlock();
+		update(update_dt);
+		lock.lock();
+		update_pending = false;
+		update_cond.notify_all();
+	}
+}
+
 void Application::renderDebugGizmo()
 {
 	if (!selected_entity || !render_debug)
@@ -248,16 +354,64 @@ void Application::renderDebugGUI(void)
 	ImGui::Text(getGPUStats().c_str());					   // Display some text (you can use a format strings too)
 
 	ImGui::Checkbox("Wireframe", &render_wireframe);
+	ImGui::Checkbox("Update on its own thread (+1 frame)", &decoupled_update);
+	if (frame_capture->isRecording())
+		ImGui::Text("Recording: %d frames, %d written", frame_capture->frames_captured, frame_capture->frames_written);
 	ImGui::ColorEdit3("BG color", scene->background_color.v);
 	ImGui::ColorEdit3("Ambient Light", scene->ambient_light.v);
 
 	ImGui::SliderFloat("Air density", &scene->air_density, 0.000, 0.002);
+	ImGui::Checkbox("Froxel volumetrics", &renderer->volumetric_froxels);
 
 	ImGui::Combo("Pipeline", (int*)&renderer->pipeline, "FORWARD\0DEFERRED", 2);
 	ImGui::Combo("Light rendering", (int*)&renderer->light_render, "SINGLEPASS\0MULTIPASS", 2);
 
 	ImGui::Checkbox("Interpolated irradiance", &renderer->interpolated_irr);
+	ImGui::Checkbox("3D texture irradiance", &renderer->use_irr_volume);
+	ImGui::Checkbox("Probe SH on forward objects", &renderer->forward_probe_sh);
+	ImGui::Checkbox("Refresh reflections continuously", &renderer->reflection_probes.auto_refresh);
+	ImGui::SliderInt("Reflection steps per frame", &renderer->reflection_probes.steps_per_frame, 1, 6);
+	ImGui::Checkbox("Bake probes on CPU", &renderer->cpu_probe_bake);
+	if (renderer->cpu_probe_bake)
+		ImGui::SliderInt("Bake worker processes", &renderer->bake_workers, 0, 16);
+	if (ImGui::Button("Benchmark SH projection"))
+		benchmarkSH();
+	if (ImGui::Button("Benchmark parallel loops"))
+		benchmarkParallel(scene);
+	ImGui::Checkbox("Adaptive probes", &renderer->adaptive_probes);
+	if (renderer->adaptive_probes)
+		ImGui::SliderInt("Probe octree depth", &renderer->probe_max_depth, 1, 5);
+	ImGui::Checkbox("Half float probes", &renderer->irr_half_floats);
+	ImGui::Checkbox("Compress probes", &renderer->irr_compress);
+	if (selected_entity) {
+		ImGui::SliderFloat("Rebake radius", &renderer->rebake_radius, 10, 500);
+		if (ImGui::Button("Rebake probes near selected"))
+			renderer->rebakeProbesAround(scene, selected_entity->model.getTranslation(), renderer->rebake_radius);
+	}
 	ImGui::Checkbox("ssao+", &renderer->ssaoplus);
+	ImGui::Checkbox("Half res temporal ssao", &renderer->ssao_half_res);
+	ImGui::Checkbox("Compact formats", &renderer->compact_formats);
+	ImGui::Checkbox("Compare formats", &renderer->compare_formats);
+	ImGui::Checkbox("Record G-buffer on threads", &renderer->parallel_recording);
+	if (renderer->parallel_recording)
+		ImGui::SliderInt("Recording threads (0 all)", &renderer->record_threads, 0, 32);
+	ImGui::Checkbox("CPU rasterizer (deferred)", &renderer->cpu_raster);
+	if (renderer->cpu_raster && renderer->soft_rasterizer) {
+		GTR::SoftRasterizer* raster = renderer->soft_rasterizer;
+		ImGui::SliderInt("CPU raster threads (0 all)", &raster->num_threads, 0, 32);
+		ImGui::Text("%d tris, setup %.2f raster %.2f shade %.2f ms", raster->num_triangles, raster->setup_ms, raster->raster_ms, raster->shade_ms);
+	}
+	ImGui::Checkbox("TAA upscale", &renderer->taa_upscale);
+	if (renderer->taa_upscale)
+		ImGui::SliderFloat("TAA render scale", &renderer->taa_render_scale, 0.5, 1.0);
+	ImGui::Checkbox("Dynamic resolution", &renderer->dynamic_resolution);
+	if (renderer->dynamic_resolution) {
+		ImGui::SliderFloat("Target frame ms", &renderer->target_frame_ms, 4.0, 50.0);
+		ImGui::DragFloatRange2("Render scale range", &renderer->min_render_scale, &renderer->max_render_scale, 0.01f, 0.25f, 1.0f);
+		ImGui::Text("GPU %.2f ms, scale %.2f (%dx%d)", renderer->gpu_frame_ms, renderer->render_scale, renderer->render_width, renderer->render_height);
+	}
+	if (renderer->decals.size())
+		ImGui::Text("Decals: %d drawn, %d over the limit, %d without atlas cell", renderer->decals_drawn, renderer->decals_over_limit, renderer->decals_without_cell);
 	ImGui::Checkbox("Show Gbuffers", &renderer->show_gbuffers);
 	ImGui::Checkbox("Show ssao", &renderer->show_ssao);
 	ImGui::Checkbox("Show irradiance texture", &renderer->show_irr_texture);
@@ -268,6 +422,11 @@ void Application::renderDebugGUI(void)
 		ImGui::DragFloat("average lum", &renderer->average_lum, 0.01);
 		ImGui::DragFloat("lum white", &renderer->lum_white, 0.01);
 		ImGui::DragFloat("lum scale", &renderer->lum_scale, 0.01);
+		ImGui::Checkbox("Auto exposure", &renderer->auto_exposure);
+		if (renderer->auto_exposure) {
+			ImGui::SliderFloat("Exposure speed", &renderer->exposure_speed, 0.1, 10.0);
+			ImGui::DragFloatRange2("Exposure lum range", &renderer->min_exposure_lum, &renderer->max_exposure_lum, 0.01, 0.001, 100.0);
+		}
 		ImGui::Checkbox("Motion blur", &renderer->motion_blur);
 		ImGui::Checkbox("Chromatic + lens", &renderer->chr_lns);
 		ImGui::Checkbox("Antialiasing", &renderer->ffxa);
@@ -334,10 +493,19 @@ void Application::onKeyDown(SDL_KeyboardEvent event)
 		case SDLK_l: renderer->light_render = (renderer->light_render == GTR::Renderer::elightrender::MULTIPASS ? GTR::Renderer::elightrender::SINGLEPASS : GTR::Renderer::elightrender::MULTIPASS); break;
 		case SDLK_7: renderer->generateProbes(scene); break;
 		case SDLK_m: renderer->loadProbes(); break;
-		case SDLK_SPACE: renderer->updateReflectionProbes(scene); break;
+		case SDLK_SPACE: renderer->reflection_probes.refreshAll(); break;
 		case SDLK_i: renderer->show_irr_texture = !renderer->show_irr_texture; break;
 		case SDLK_F5: Shader::ReloadAll(); break;
+		case SDLK_F11:
+			if (frame_capture->isRecording())
+				frame_capture->stop();
+			else
+				frame_capture->start("frame");
+			break;
+		case SDLK_F12: take_screenshot = true; break;
 		case SDLK_F6:
+			renderer->reflection_probes.clear(); //a new entity could take the address of an old one
+			renderer->previous_models.clear();
 			scene->clear();
 			scene->load(scene->filename.c_str());
 			camera->lookAt(scene->main_camera.eye, scene->main_camera.center, Vector3(0, 1, 0));
@@ -8,8 +8,23 @@
 #include "includes.h"
 #include "camera.h"
 #include "utils.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 class Renderer;
+namespace GTR { class SceneSnapshot; }
+
+//what update() reads from SDL and ImGui, sampled in the main thread because neither is thread safe
+struct sUpdateInput {
+	Uint8 keys[SDL_NUM_SCANCODES];
+	int mouse_state;
+	Vector2 mouse_delta;
+	bool gizmo_using;
+	bool mouse_blocked; //over the gui
+
+	bool isKeyPressed(int key_code) const { return keys[key_code] != 0; }
+};
 
 class Application
 {
@@ -33,12 +48,23 @@ public:
 	//some vars
 	bool mouse_locked; //tells if the mouse is locked (blocked in the center and not visible)
 	bool render_wireframe; //in case we want to render everything in wireframe mode
+	bool take_screenshot; //saves the next frame, without the gui
+	bool decoupled_update; //update() runs on its own thread while the state of the previous one is rendered
+	GTR::SceneSnapshot* snapshot; //what render() draws when decoupled_update
 
-	Application( int window_width, int window_height, SDL_Window* window );
+	Application( int window_width, int window_height, SDL_Window* window, const char* scene_filename = "data/scene.json" ); //window is NULL when headless
+	~Application();
 
 	//main functions
 	void render( void );
+	void sampleInput(); //before update(), startUpdate() does it
 	void update( double dt );
+	void updateCursor(); //the SDL part of the update, always in the main thread
+
+	//decoupled update, the main loop captures, starts the next update and renders the capture meanwhile
+	void captureSnapshot();
+	void startUpdate(double dt);
+	void finishUpdate(); //waits for the update, the scene and camera can be touched again after it
 
 	void renderDebugGUI(void);
 	void renderDebugGizmo();
@@ -53,6 +79,15 @@ public:
 	void onGamepadButtonUp(SDL_JoyButtonEvent event);
 	void onResize(int width, int height);
 
+private:
+	std::thread update_thread;
+	std::mutex update_mutex;
+	std::condition_variable update_cond;
+	bool update_pending;
+	bool update_exit;
+	double update_dt;
+	sUpdateInput update_input;
+	void updateLoop();
 };
 
 
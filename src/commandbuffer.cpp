@@ -0,0 +1,101 @@
+#include "commandbuffer.h"
+#include "shader.h"
+#include "texture.h"
+#include "mesh.h"
+#include "utils.h"
+
+void CommandBuffer::clear()
+{
+	commands.clear();
+	arena.clear();
+	current_program = NULL;
+	cull_face = -1;
+	memset(bound_textures, 0, sizeof(bound_textures));
+}
+
+void CommandBuffer::setProgram(Shader* shader)
+{
+	if (shader == current_program)
+		return;
+	current_program = shader;
+	memset(bound_textures, 0, sizeof(bound_textures)); //the uniforms of the samplers belong to the program
+	sCommand cmd = { CMD_PROGRAM, 0, 0, 0, 0, shader };
+	commands.push_back(cmd);
+}
+
+void CommandBuffer::setCullFace(bool enabled)
+{
+	if (cull_face == (int)enabled)
+		return;
+	cull_face = enabled;
+	sCommand cmd = { CMD_CULL_FACE, 0, 0, 0, enabled, NULL };
+	commands.push_back(cmd);
+}
+
+void CommandBuffer::setTexture(int location, Texture* texture, int slot)
+{
+	assert(slot < 16);
+	if (location == -1 || bound_textures[slot] == texture->texture_id)
+		return;
+	bound_textures[slot] = texture->texture_id;
+	//the target does not fit in 16 bits, the few possible ones are stored as an index
+	unsigned short target_index = texture->texture_type == GL_TEXTURE_CUBE_MAP ? 1 : (texture->texture_type == GL_TEXTURE_3D ? 2 : 0);
+	sCommand cmd = { CMD_TEXTURE, (unsigned char)slot, target_index, location, (int)texture->texture_id, NULL };
+	commands.push_back(cmd);
+}
+
+void CommandBuffer::addValue(unsigned char type, int location, const float* values, int count)
+{
+	if (location == -1)
+		return;
+	sCommand cmd = { type, 0, 0, location, (int)arena.size(), NULL };
+	arena.insert(arena.end(), values, values + count);
+	commands.push_back(cmd);
+}
+
+void CommandBuffer::setUniform(int location, int value)
+{
+	if (location == -1)
+		return;
+	sCommand cmd = { CMD_UNIFORM_INT, 0, 0, location, value, NULL };
+	commands.push_back(cmd);
+}
+
+void CommandBuffer::setUniform(int location, float value) { addValue(CMD_UNIFORM_FLOAT, location, &value, 1); }
+void CommandBuffer::setUniform(int location, const Vector3& value) { addValue(CMD_UNIFORM_VEC3, location, value.v, 3); }
+void CommandBuffer::setUniform(int location, const Vector4& value) { addValue(CMD_UNIFORM_VEC4, location, value.v, 4); }
+void CommandBuffer::setUniform(int location, const Matrix44& value) { addValue(CMD_UNIFORM_MAT44, location, value.m, 16); }
+
+void CommandBuffer::draw(Mesh* mesh, unsigned int primitive)
+{
+	assert(current_program && "set the program before drawing");
+	sCommand cmd = { CMD_DRAW, 0, 0, 0, (int)primitive, mesh };
+	commands.push_back(cmd);
+}
+
+void CommandBuffer::execute()
+{
+	const GLenum targets[3] = { GL_TEXTURE_2D, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_3D };
+	for (int i = 0; i < commands.size(); ++i)
+	{
+		const sCommand& cmd = commands[i];
+		const float* values = cmd.type >= CMD_UNIFORM_FLOAT && cmd.type <= CMD_UNIFORM_MAT44 ? &arena[cmd.value] : NULL;
+		switch (cmd.type)
+		{
+		case CMD_PROGRAM: ((Shader*)cmd.object)->enable(); break;
+		case CMD_CULL_FACE: if (cmd.value) glEnable(GL_CULL_FACE); else glDisable(GL_CULL_FACE); break;
+		case CMD_TEXTURE:
+			glActiveTexture(GL_TEXTURE0 + cmd.slot);
+			glBindTexture(targets[cmd.target_index], cmd.value);
+			glUniform1i(cmd.location, cmd.slot);
+			break;
+		case CMD_UNIFORM_INT: glUniform1i(cmd.location, cmd.value); break;
+		case CMD_UNIFORM_FLOAT: glUniform1f(cmd.location, values[0]); break;
+		case CMD_UNIFORM_VEC3: glUniform3fv(cmd.location, 1, values); break;
+		case CMD_UNIFORM_VEC4: glUniform4fv(cmd.location, 1, values); break;
+		case CMD_UNIFORM_MAT44: glUniformMatrix4fv(cmd.location, 1, GL_FALSE, values); break;
+		case CMD_DRAW: ((Mesh*)cmd.object)->render(cmd.value); break;
+		}
+	}
+	checkGLErrors();
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include "includes.h"
+#include "framework.h"
+#include <vector>
+
+class Shader;
+class Texture;
+class Mesh;
+
+// Draws recorded as plain packets so they can be prepared on any thread and replayed later on the GL one.
+// Recording never touches GL or the shader tables: the uniform locations are resolved before (on the GL
+// thread) and the uniform values go to a float arena owned by the buffer. Redundant program, cull and
+// texture changes are dropped while recording.
+class CommandBuffer
+{
+public:
+	enum eCommandType {
+		CMD_PROGRAM,
+		CMD_CULL_FACE,
+		CMD_TEXTURE,
+		CMD_UNIFORM_INT,
+		CMD_UNIFORM_FLOAT,
+		CMD_UNIFORM_VEC3,
+		CMD_UNIFORM_VEC4,
+		CMD_UNIFORM_MAT44,
+		CMD_DRAW
+	};
+
+	struct sCommand {
+		unsigned char type;
+		unsigned char slot; //texture unit
+		unsigned short target_index; //texture target, see setTexture
+		int location; //uniform location or GL value
+		int value; //arena offset, texture id, int uniform or primitive
+		void* object; //Shader or Mesh
+	};
+
+	std::vector<sCommand> commands;
+	std::vector<float> arena;
+
+	void clear();
+	void setProgram(Shader* shader);
+	void setCullFace(bool enabled);
+	void setTexture(int location, Texture* texture, int slot);
+	void setUniform(int location, int value);
+	void setUniform(int location, float value);
+	void setUniform(int location, const Vector3& value);
+	void setUniform(int location, const Vector4& value);
+	void setUniform(int location, const Matrix44& value);
+	void draw(Mesh* mesh, unsigned int primitive = GL_TRIANGLES);
+
+	//GL thread only, the state changed by the commands is left as it is
+	void execute();
+
+private:
+	Shader* current_program = NULL;
+	int cull_face = -1;
+	GLuint bound_textures[16] = {};
+
+	void addValue(unsigned char type, int location, const float* values, int count);
+};
@@ -0,0 +1,216 @@
+#include "cubecapture.h"
+#include "renderer.h"
+#include "scene.h"
+#include "camera.h"
+#include "texture.h"
+#include "shader.h"
+#include "mesh.h"
+#include "material.h"
+#include "sphericalharmonics.h"
+#include "readback.h"
+#include <algorithm>
+
+GTR::CubeCapture::CubeCapture(int size, unsigned int type)
+{
+	this->size = size;
+	visible_calls = 0;
+
+	color = new Texture();
+	color->createCubemap(size, size, NULL, GL_RGBA, type, false); //RGB float formats are not always renderable
+	depth = new Texture();
+	depth->createCubemap(size, size, NULL, GL_DEPTH_COMPONENT, GL_FLOAT, false, GL_DEPTH_COMPONENT24);
+
+	//layered, gl_Layer selects the face
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, color->texture_id, 0);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth->texture_id, 0);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+		std::cout << "Error: capture framebuffer is not complete: " << status << std::endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glGenFramebuffers(1, &read_fbo);
+	glGenFramebuffers(1, &draw_fbo);
+}
+
+GTR::CubeCapture::~CubeCapture()
+{
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteFramebuffers(1, &read_fbo);
+	glDeleteFramebuffers(1, &draw_fbo);
+	delete color;
+	delete depth;
+}
+
+//closest point of the box to the center, inside the sphere means some face can see it
+static bool boxInSphere(const BoundingBox& box, const Vector3& center, float radius)
+{
+	float dist2 = 0;
+	for (int i = 0; i < 3; ++i) {
+		float d = std::max(fabsf(center.v[i] - box.center.v[i]) - box.halfsize.v[i], 0.0f);
+		dist2 += d * d;
+	}
+	return dist2 <= radius * radius;
+}
+
+void GTR::CubeCapture::render(Renderer* renderer, Scene* scene, Vector3 pos, float near_plane, float far_plane, int face_mask)
+{
+	Shader* shader = Shader::Get("capture");
+	Shader* sky_shader = Shader::Get("capture_sky");
+	if (!shader)
+		return;
+
+	Matrix44 face_vp[6];
+	Camera camera;
+	camera.setPerspective(90, 1, near_plane, far_plane);
+	for (int i = 0; i < 6; ++i) {
+		camera.lookAt(pos, pos + cubemapFaceNormals[i][2], cubemapFaceNormals[i][1]);
+		face_vp[i] = camera.viewprojection_matrix;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glPushAttrib(GL_VIEWPORT_BIT);
+	glViewport(0, 0, size, size);
+	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glDisable(GL_BLEND);
+
+	if (renderer->skybox && sky_shader)
+	{
+		Mesh* sphere = Mesh::Get("data/meshes/sphere.obj", false, false);
+		Matrix44 model;
+		model.setTranslation(pos.x, pos.y, pos.z);
+		model.scale(5, 5, 5);
+		glDisable(GL_CULL_FACE);
+		glDisable(GL_DEPTH_TEST);
+		sky_shader->enable();
+		sky_shader->setMatrix44Array("u_face_vp", face_vp, 6);
+		sky_shader->setUniform("u_face_mask", face_mask);
+		sky_shader->setUniform("u_model", model);
+		sky_shader->setUniform("u_camera_position", pos);
+		sky_shader->setUniform("u_texture", renderer->skybox, 0);
+		sphere->render(GL_TRIANGLES);
+		sky_shader->disable();
+		glEnable(GL_DEPTH_TEST);
+	}
+
+	shader->enable();
+	shader->setMatrix44Array("u_face_vp", face_vp, 6);
+	shader->setUniform("u_face_mask", face_mask);
+	shader->setUniform("u_ambient_light", scene->ambient_light);
+
+	//lights are the same for every object of the capture
+	int num_lights = std::min((int)renderer->lights.size(), MAX_CAPTURE_LIGHTS);
+	Vector3 light_position[MAX_CAPTURE_LIGHTS];
+	Vector3 light_color[MAX_CAPTURE_LIGHTS];
+	Vector3 light_front[MAX_CAPTURE_LIGHTS];
+	Vector3 light_cone[MAX_CAPTURE_LIGHTS];
+	Vector3 light_vector[MAX_CAPTURE_LIGHTS];
+	float light_max_distance[MAX_CAPTURE_LIGHTS];
+	int light_type[MAX_CAPTURE_LIGHTS];
+	for (int i = 0; i < num_lights; i++) {
+		LightEntity* light = renderer->lights[i];
+		light_position[i] = light->model * Vector3();
+		light_color[i] = light->color * light->intensity;
+		light_max_distance[i] = light->max_distance;
+		light_front[i] = light->model.rotateVector(Vector3(0, 0, -1));
+		light_cone[i] = Vector3(light->cone_angle, light->cone_exp, cos(light->cone_angle * DEG2RAD));
+		light_vector[i] = light->model * Vector3() - light->target;
+		if (light->light_type == GTR::eLightType::DIRECTIONAL) light_type[i] = 0;
+		else if (light->light_type == GTR::eLightType::SPOT) light_type[i] = 1;
+		else light_type[i] = 2;
+	}
+	shader->setUniform("u_num_lights", num_lights);
+	if (num_lights) {
+		shader->setUniform3Array("u_light_position", (float*)light_position, num_lights);
+		shader->setUniform3Array("u_light_color", (float*)light_color, num_lights);
+		shader->setUniform3Array("u_light_front", (float*)light_front, num_lights);
+		shader->setUniform3Array("u_light_cone", (float*)light_cone, num_lights);
+		shader->setUniform3Array("u_light_vector", (float*)light_vector, num_lights);
+		shader->setUniform1Array("u_light_max_distance", light_max_distance, num_lights);
+		shader->setUniform1Array("u_light_type", light_type, num_lights);
+	}
+
+	//culled once for the six faces, the geometry shader drops the triangles outside each face
+	visible_calls = 0;
+	for (int i = 0; i < renderer->render_calls.size(); ++i)
+	{
+		RenderCall& rc = renderer->render_calls[i];
+		if (!rc.mesh || !rc.material || !boxInSphere(rc.world_bounding, pos, far_plane))
+			continue;
+		visible_calls++;
+
+		Material* material = rc.material;
+		if (material->two_sided)
+			glDisable(GL_CULL_FACE);
+		else
+			glEnable(GL_CULL_FACE);
+		if (material->alpha_mode == GTR::eAlphaMode::BLEND) {
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		}
+		else
+			glDisable(GL_BLEND);
+
+		Texture* texture = material->color_texture.texture;
+		Texture* emissive = material->emissive_texture.texture;
+		shader->setUniform("u_model", rc.model);
+		shader->setUniform("u_color", material->color);
+		shader->setUniform("u_texture", texture ? texture : Texture::getWhiteTexture(), 0);
+		shader->setUniform("u_texture_emissive", emissive ? emissive : Texture::getWhiteTexture(), 1);
+		shader->setUniform("u_emissive_factor", material->emissive_factor);
+		shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+		rc.mesh->render(GL_TRIANGLES);
+	}
+	shader->disable();
+
+	glPopAttrib();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDisable(GL_BLEND);
+	glEnable(GL_CULL_FACE);
+	glEnable(GL_DEPTH_TEST);
+}
+
+void GTR::CubeCapture::copyTo(Texture* cubemap_array, int first_layer, int face_mask)
+{
+	int target_size = (int)cubemap_array->width;
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw_fbo);
+	for (int i = 0; i < 6; ++i)
+	{
+		if ((face_mask & (1 << i)) == 0)
+			continue;
+		glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, color->texture_id, 0);
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, cubemap_array->texture_id, 0, first_layer + i);
+		glBlitFramebuffer(0, 0, size, size, 0, 0, target_size, target_size, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+}
+
+void GTR::CubeCapture::read(FloatImage images[6])
+{
+	color->bind();
+	for (int i = 0; i < 6; ++i)
+	{
+		FloatImage& image = images[i];
+		if (!image.data || image.width != size || image.height != size || image.num_channels != 3)
+			image.resize(size, size, 3);
+		glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, GL_FLOAT, image.data);
+	}
+	color->unbind();
+}
+
+void GTR::CubeCapture::readAsync(ReadbackQueue* queue, FloatImage images[6])
+{
+	for (int i = 0; i < 6; ++i)
+	{
+		FloatImage* image = &images[i];
+		if (!image->data || image->width != size || image->height != size || image->num_channels != 3)
+			image->resize(size, size, 3);
+		queue->readTexture(color, [image](const void* data, int bytes) {
+			memcpy(image->data, data, bytes);
+		}, GL_RGB, GL_FLOAT, i);
+	}
+}
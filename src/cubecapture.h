@@ -0,0 +1,42 @@
+#pragma once
+#include "includes.h"
+#include "framework.h"
+
+#define MAX_CAPTURE_LIGHTS 8
+
+class Texture;
+class FloatImage;
+class ReadbackQueue;
+
+namespace GTR {
+	class Scene;
+	class Renderer;
+
+	// Renders the six faces of a cubemap in a single layered pass. The render calls are culled once
+	// against the sphere the faces can see and a geometry shader sends every triangle to the faces it touches.
+	// Materials are reduced to albedo, emissive and unshadowed lights, and there are no debug draws
+	class CubeCapture
+	{
+	public:
+		int size;
+		Texture* color; //cubemap
+		Texture* depth; //depth cubemap
+		int visible_calls; //render calls that passed the culling in the last capture
+
+		CubeCapture(int size, unsigned int type = GL_FLOAT);
+		~CubeCapture();
+
+		//face_mask has one bit per face, the faces not in it are left cleared
+		void render(Renderer* renderer, Scene* scene, Vector3 pos, float near_plane = 0.1, float far_plane = 1000, int face_mask = 0x3F);
+		//copies the faces to the layers first_layer .. first_layer + 5 of a cubemap array
+		void copyTo(Texture* cubemap_array, int first_layer, int face_mask = 0x3F);
+		void read(FloatImage images[6]);
+		//same but through PBOs, the images are filled when the queue completes the reads
+		void readAsync(ReadbackQueue* queue, FloatImage images[6]);
+
+	private:
+		unsigned int fbo;
+		unsigned int read_fbo;
+		unsigned int draw_fbo;
+	};
+};
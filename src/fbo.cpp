@@ -51,7 +51,7 @@ void FBO::freeTextures()
 	owns_textures = false;
 }
 
-bool FBO::create( int width, int height, int num_textures, int format, int type, bool use_depth_texture)
+bool FBO::create( int width, int height, int num_textures, int format, int type, bool use_depth_texture, int internal_format)
 {
 	assert(glGetError() == GL_NO_ERROR);
 	assert(width && height);
@@ -63,7 +63,7 @@ bool FBO::create( int width, int height, int num_textures, int format, int type,
 	std::vector<Texture*> textures(4);
 	for (int i = 0; i < num_textures; ++i)
 	{
-		Texture* colortex = textures[i] = new Texture(width, height, format, type, false); //,NULL, format == GL_RGBA ? GL_RGBA8 : GL_RGB8 
+		Texture* colortex = textures[i] = new Texture(width, height, format, type, false, NULL, internal_format);
 		glBindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	//set the min filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   //set the mag filter
@@ -151,6 +151,11 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 				assert(cubemap_face != -1); //MUST SPECIFY CUBEMAP FACE
 				glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT + i, GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubemap_face, texture ? texture->texture_id : NULL, 0);
 			}
+			else if (texture->texture_type == GL_TEXTURE_3D || texture->texture_type == GL_TEXTURE_CUBE_MAP_ARRAY)
+			{
+				assert(cubemap_face != -1); //MUST SPECIFY THE LAYER
+				glFramebufferTextureLayer(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT + i, texture->texture_id, 0, cubemap_face);
+			}
 			else
 			{
 				glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT + i, GL_TEXTURE_2D, texture ? texture->texture_id : NULL, 0);
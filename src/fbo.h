@@ -24,8 +24,8 @@ public:
 	FBO();
 	~FBO();
 
-	bool create(int width, int height, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool use_depth_texture = true );
-	bool setTexture(Texture* texture, int cubemap_face = -1);
+	bool create(int width, int height, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool use_depth_texture = true, int internal_format = 0 );
+	bool setTexture(Texture* texture, int cubemap_face = -1); //cubemap_face is the layer when using a 3D texture
 	bool setTextures(std::vector<Texture*> textures, Texture* depth = NULL, int cubemap_face = -1);
 	bool setDepthOnly(int width, int height); //use this for shadowmaps
 	
@@ -0,0 +1,196 @@
+#include "framecapture.h"
+#include "utils.h"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+FrameCapture::FrameCapture() : readback(3)
+{
+	rle = true;
+	max_frames = 6;
+	num_workers = 0;
+	frames_captured = 0;
+	frames_written = 0;
+	wait_time = 0;
+	recording = false;
+	first_index = 0;
+	must_exit = false;
+}
+
+FrameCapture::~FrameCapture()
+{
+	stop();
+}
+
+void FrameCapture::start(const char* prefix, int first_index)
+{
+	if (recording)
+		return;
+	this->prefix = prefix;
+	this->first_index = first_index;
+	frames_captured = 0;
+	frames_written = 0;
+	wait_time = 0;
+
+	for (int i = 0; i < max_frames; ++i)
+		frames.push_back(new sFrame());
+	free_frames = frames;
+
+	int threads = num_workers > 0 ? num_workers : (int)std::thread::hardware_concurrency() - 1;
+	threads = std::max(1, std::min(threads, max_frames));
+	must_exit = false;
+	for (int i = 0; i < threads; ++i)
+		workers.push_back(std::thread(&FrameCapture::workerLoop, this));
+	recording = true;
+	std::cout << " + Recording frames to " << prefix << "_*.tga with " << threads << " workers" << std::endl;
+}
+
+void FrameCapture::stop()
+{
+	if (!recording)
+		return;
+	readback.flush();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		must_exit = true;
+	}
+	frame_ready.notify_all();
+	for (int i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	workers.clear();
+
+	for (int i = 0; i < frames.size(); ++i)
+		delete frames[i];
+	frames.clear();
+	free_frames.clear();
+	recording = false;
+	std::cout << " + Recording stopped: " << frames_written << " frames, render thread waited " << wait_time << " ms" << std::endl;
+}
+
+//blocks while every buffer is still queued for the workers
+FrameCapture::sFrame* FrameCapture::acquireFrame()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (free_frames.empty())
+	{
+		long start_time = getTime();
+		frame_freed.wait(lock, [this] { return !free_frames.empty(); });
+		wait_time += getTime() - start_time;
+	}
+	sFrame* frame = free_frames.back();
+	free_frames.pop_back();
+	return frame;
+}
+
+void FrameCapture::capture(int width, int height)
+{
+	if (!recording)
+		return;
+	int index = first_index + frames_captured++;
+	readback.readScreen(0, 0, width, height, [this, index, width, height](const void* data, int bytes) {
+		sFrame* frame = acquireFrame();
+		frame->index = index;
+		frame->width = width;
+		frame->height = height;
+		frame->pixels.resize(bytes);
+		memcpy(&frame->pixels[0], data, bytes);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending.push_back(frame);
+		}
+		frame_ready.notify_one();
+	});
+}
+
+void FrameCapture::update()
+{
+	if (recording)
+		readback.update();
+}
+
+void FrameCapture::workerLoop()
+{
+	std::vector<uint8> file_data;
+	while (true)
+	{
+		sFrame* frame = NULL;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			frame_ready.wait(lock, [this] { return must_exit || !pending.empty(); });
+			if (pending.empty())
+				return; //only exits once the queue is empty
+			frame = pending.front();
+			pending.pop_front();
+		}
+
+		encodeTGA(&frame->pixels[0], frame->width, frame->height, rle, file_data);
+		char filename[1024];
+		snprintf(filename, sizeof(filename), "%s_%05d.tga", prefix.c_str(), frame->index);
+		FILE* file = fopen(filename, "wb");
+		if (file)
+		{
+			fwrite(&file_data[0], 1, file_data.size(), file);
+			fclose(file);
+		}
+		else
+			std::cout << "[ERROR] cannot write " << filename << std::endl;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			free_frames.push_back(frame);
+			frames_written++;
+		}
+		frame_freed.notify_one();
+	}
+}
+
+//the rows are already bottom first like glReadPixels gives them, only the channels are swapped to BGRA
+void FrameCapture::encodeTGA(const uint8* rgba, int width, int height, bool rle, std::vector<uint8>& out)
+{
+	out.clear();
+	out.reserve(18 + width * height * 4);
+	uint8 header[18] = { 0 };
+	header[2] = rle ? 10 : 2;
+	header[12] = width & 0xFF; header[13] = width >> 8;
+	header[14] = height & 0xFF; header[15] = height >> 8;
+	header[16] = 32;
+	header[17] = 8; //alpha bits
+	out.insert(out.end(), header, header + 18);
+
+	for (int y = 0; y < height; ++y)
+	{
+		const uint32* row = (const uint32*)(rgba + y * width * 4);
+		int x = 0;
+		while (x < width)
+		{
+			//packets can not cross rows and hold up to 128 pixels
+			int run = 1;
+			if (rle)
+				while (x + run < width && run < 128 && row[x + run] == row[x])
+					run++;
+			if (run > 1)
+			{
+				const uint8* p = (const uint8*)&row[x];
+				uint8 packet[5] = { (uint8)(0x80 | (run - 1)), p[2], p[1], p[0], p[3] };
+				out.insert(out.end(), packet, packet + 5);
+				x += run;
+				continue;
+			}
+
+			//raw packet until the next run of 2 or more
+			int count = 1;
+			while (x + count < width && count < 128 && (!rle || x + count + 1 >= width || row[x + count] != row[x + count + 1]))
+				count++;
+			if (rle)
+				out.push_back((uint8)(count - 1));
+			for (int i = 0; i < count; ++i)
+			{
+				const uint8* p = (const uint8*)&row[x + i];
+				uint8 bgra[4] = { p[2], p[1], p[0], p[3] };
+				out.insert(out.end(), bgra, bgra + 4);
+			}
+			x += count;
+		}
+	}
+}
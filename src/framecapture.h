@@ -0,0 +1,59 @@
+#pragma once
+#include "readback.h"
+#include "framework.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Dumps the frames to numbered TGA files without stalling the render loop. The pixels come back through
+// a ReadbackQueue and a pool of workers encodes and writes them. There are only max_frames buffers, when
+// all of them are waiting to be written the render thread blocks until a worker frees one (back-pressure)
+class FrameCapture
+{
+public:
+	bool rle; //run length compressed TGA, done on the workers
+	int max_frames; //frames waiting to be encoded, read when starting
+	int num_workers; //0 = one per core minus the render thread
+	int frames_captured;
+	int frames_written;
+	double wait_time; //ms the render thread spent blocked by the workers
+
+	FrameCapture();
+	~FrameCapture();
+
+	bool isRecording() { return recording; }
+	void start(const char* prefix, int first_index = 0); //files are prefix_00000.tga ... starting at first_index
+	void stop(); //waits until everything is on disk
+	void capture(int width, int height); //after rendering the frame, reads the bound framebuffer
+	void update(); //once per frame, collects the finished reads
+
+private:
+	struct sFrame {
+		int index;
+		int width;
+		int height;
+		std::vector<uint8> pixels; //RGBA, bottom row first
+	};
+
+	bool recording;
+	std::string prefix;
+	int first_index;
+	ReadbackQueue readback;
+	std::vector<sFrame*> frames;
+	std::vector<sFrame*> free_frames;
+	std::list<sFrame*> pending; //read, waiting for a worker
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable frame_ready;
+	std::condition_variable frame_freed;
+	bool must_exit;
+
+	sFrame* acquireFrame();
+	void workerLoop();
+
+public:
+	static void encodeTGA(const uint8* rgba, int width, int height, bool rle, std::vector<uint8>& out);
+};
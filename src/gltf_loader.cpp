@@ -21,6 +21,7 @@ std::string base_folder;
 #else
 	bool load_textures = true; //must textures be loadead?
 #endif
+bool upload_textures = true;
 
 void parseGLTFBufferVector3(std::vector<Vector3>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
 {
@@ -213,7 +214,8 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
 			if (primitive->indices && primitive->indices->count)
 				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
 		}
-		mesh->uploadToVRAM();
+		if (Mesh::auto_upload_to_vram)
+			mesh->uploadToVRAM();
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
 		result.push_back(mesh);
@@ -232,7 +234,18 @@ Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 	std::string fullpath = filename ? filename : "";
 
 	if (image->uri)
-		return Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str());
+	{
+		fullpath = std::string(base_folder) + "/" + image->uri;
+		if (upload_textures)
+			return Texture::GetAsync(fullpath.c_str());
+		//an empty texture with the name of the file, whoever needs the pixels loads them
+		Texture* tex = Texture::Find(fullpath.c_str());
+		if (!tex) {
+			tex = new Texture();
+			tex->setName(fullpath.c_str());
+		}
+		return tex;
+	}
 	else
 	if (filename)
 	{
@@ -248,7 +261,7 @@ Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 		fullpath = std::string(base_folder) + "/image" + ss.str();
 	}
 
-	if (image->buffer_view)
+	if (image->buffer_view && upload_textures)
 	{
 		Image img;
 		std::vector<unsigned char> buffer;
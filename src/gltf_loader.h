@@ -2,6 +2,9 @@
 
 #include "prefab.h"
 
+//false keeps only the file of every texture and creates no GL objects for them, for the CPU bake
+extern bool upload_textures;
+
 GTR::Prefab* loadGLTF(const char* filename);
 //GTR::Prefab* loadGLTF(const char* filename, cgltf_data* data, cgltf_options& options);
 GTR::Prefab* loadGLTF(const std::vector<unsigned char>& data, const std::string& path);
@@ -0,0 +1,560 @@
+#include "headless.h"
+#include "includes.h"
+#include "application.h"
+#include "renderer.h"
+#include "scene.h"
+#include "camera.h"
+#include "mesh.h"
+#include "texture.h"
+#include "task.h"
+#include "framecapture.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <atomic>
+
+//only Linux has the EGL context, the Windows project does not link EGL and --headless fails in createContext
+#ifdef __linux__
+	#define USE_EGL
+	#include <EGL/egl.h>
+	#include <EGL/eglext.h>
+#endif
+
+#define HEADLESS_WORKER_ATTEMPTS 2
+#define HEADLESS_WARMUP_FRAMES 8 //poses rendered before the first one of a shard, a full TAA jitter cycle
+#define HEADLESS_COMPARE_MAX_PIXELS 0.01 //fraction of the pixels allowed over the tolerance
+
+//globals of application.cpp
+extern Camera* camera;
+extern GTR::Scene* scene;
+extern GTR::Renderer* renderer;
+
+GTR::HeadlessRenderer::HeadlessRenderer()
+{
+	scene_filename = "data/scene.json";
+	width = 1024;
+	height = 768;
+	num_frames = 1;
+	frame_time = 1.0 / 30.0;
+	cpu_raster = false;
+	compare_tolerance = -1;
+	first = 0;
+	count = -1;
+	tile_x = tile_y = 0;
+	tiles_x = tiles_y = 1;
+	num_workers = 0;
+	display = surface = context = NULL;
+}
+
+bool GTR::HeadlessRenderer::parseArgs(int argc, char** argv)
+{
+	executable = argv[0];
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--headless")
+			continue;
+		else if (arg == "-scene" && has_value)
+			scene_filename = argv[++i];
+		else if (arg == "-size" && has_value) {
+			if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+				return false;
+		}
+		else if (arg == "-frames" && has_value)
+			num_frames = std::max(1, atoi(argv[++i]));
+		else if (arg == "-poses" && has_value)
+			poses_filename = argv[++i];
+		else if (arg == "-out" && has_value)
+			output_prefix = argv[++i];
+		else if (arg == "-stats" && has_value)
+			stats_filename = argv[++i];
+		else if (arg == "-first" && has_value)
+			first = std::max(0, atoi(argv[++i]));
+		else if (arg == "-count" && has_value)
+			count = atoi(argv[++i]);
+		else if (arg == "-workers" && has_value)
+			num_workers = std::max(1, atoi(argv[++i]));
+		else if (arg == "-tiles" && has_value) {
+			if (sscanf(argv[++i], "%dx%d", &tiles_x, &tiles_y) != 2 || tiles_x <= 0 || tiles_y <= 0)
+				return false;
+		}
+		else if (arg == "-cpu")
+			cpu_raster = true;
+		else if (arg == "-compare" && has_value)
+			compare_tolerance = clamp(atoi(argv[++i]), 0, 255);
+		else if (arg == "-tile" && i + 4 < argc) {
+			tile_x = atoi(argv[++i]);
+			tile_y = atoi(argv[++i]);
+			tiles_x = std::max(1, atoi(argv[++i]));
+			tiles_y = std::max(1, atoi(argv[++i]));
+		}
+		else {
+			std::cout << "[ERROR] unknown headless argument: " << arg << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool GTR::HeadlessRenderer::loadPoses(const char* filename, std::vector<sPose>& poses)
+{
+	std::ifstream file(filename);
+	if (!file.is_open())
+		return false;
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+		std::istringstream stream(line);
+		sPose pose;
+		pose.fov = 0;
+		if (!(stream >> pose.eye.x >> pose.eye.y >> pose.eye.z >> pose.center.x >> pose.center.y >> pose.center.z))
+			continue;
+		stream >> pose.fov;
+		poses.push_back(pose);
+	}
+	return true;
+}
+
+//fraction of the pixels with a channel that differs in more than tolerance, and the mean difference of the channels
+static double compareFrames(const uint8* a, const uint8* b, int num_pixels, int tolerance, double& mean)
+{
+	long long sum = 0;
+	int over = 0;
+	for (int i = 0; i < num_pixels; ++i)
+	{
+		int max_diff = 0;
+		for (int c = 0; c < 3; ++c) {
+			int diff = abs((int)a[i * 4 + c] - (int)b[i * 4 + c]);
+			sum += diff;
+			max_diff = std::max(max_diff, diff);
+		}
+		if (max_diff > tolerance)
+			over++;
+	}
+	mean = sum / (3.0 * std::max(num_pixels, 1));
+	return over / (double)std::max(num_pixels, 1);
+}
+
+bool GTR::HeadlessRenderer::createContext()
+{
+#ifdef USE_EGL
+	//the surfaceless platform of Mesa does not need a display server, the default display is the fallback
+	EGLDisplay egl_display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay)
+		egl_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, NULL, NULL))
+	{
+		egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, NULL, NULL))
+		{
+			std::cout << "[ERROR] EGL display not available" << std::endl;
+			return false;
+		}
+	}
+
+	const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+		EGL_DEPTH_SIZE, 24, EGL_STENCIL_SIZE, 8,
+		EGL_NONE };
+	EGLConfig config;
+	EGLint num_configs = 0;
+	if (!eglChooseConfig(egl_display, config_attribs, &config, 1, &num_configs) || num_configs == 0)
+	{
+		std::cout << "[ERROR] no EGL config with pbuffers" << std::endl;
+		return false;
+	}
+
+	//the pbuffer acts as the default framebuffer, so the renderer does not know it has no window
+	const EGLint surface_attribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+	EGLSurface egl_surface = eglCreatePbufferSurface(egl_display, config, surface_attribs);
+	if (egl_surface == EGL_NO_SURFACE)
+	{
+		std::cout << "[ERROR] cannot create a " << width << "x" << height << " pbuffer" << std::endl;
+		return false;
+	}
+
+	eglBindAPI(EGL_OPENGL_API);
+	const EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT, //FBO and the captures push and pop the viewport
+		EGL_NONE };
+	EGLContext egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
+	if (egl_context == EGL_NO_CONTEXT || !eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context))
+	{
+		std::cout << "[ERROR] cannot create an OpenGL 3.3 context" << std::endl;
+		return false;
+	}
+
+	display = egl_display;
+	surface = egl_surface;
+	context = egl_context;
+	std::cout << " * Headless " << width << " x " << height << std::endl;
+	std::cout << " * OpenGL Version: " << glGetString(GL_VERSION) << std::endl;
+	std::cout << " * Renderer: " << glGetString(GL_RENDERER) << std::endl;
+	return true;
+#else
+	std::cout << "[ERROR] headless rendering needs EGL, only available on Linux" << std::endl;
+	return false;
+#endif
+}
+
+void GTR::HeadlessRenderer::destroyContext()
+{
+#ifdef USE_EGL
+	if (!display)
+		return;
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display, context);
+	eglDestroySurface(display, surface);
+	eglTerminate(display);
+	display = surface = context = NULL;
+#endif
+}
+
+int GTR::HeadlessRenderer::run()
+{
+	if (num_workers > 0)
+		return runCoordinator();
+	if (!createContext())
+		return 1;
+
+	Application* app = new Application(width, height, NULL, scene_filename.c_str());
+	app->render_gui = false;
+	renderer->cpu_raster = cpu_raster;
+
+	//the textures are loaded in tasks, there is no loop running them so they are done here before the first frame
+	while (TaskManager::background.pending() || TaskManager::foreground.pending())
+	{
+		TaskManager::background.fetchTask();
+		TaskManager::foreground.fetchTask();
+	}
+
+	std::vector<sPose> poses;
+	if (poses_filename.size())
+	{
+		if (!loadPoses(poses_filename.c_str(), poses) || poses.empty())
+		{
+			std::cout << "[ERROR] no poses in " << poses_filename << std::endl;
+			destroyContext();
+			return 1;
+		}
+	}
+	else
+	{
+		//orbit the main camera around its center
+		Vector3 center = scene->main_camera.center;
+		Vector3 offset = scene->main_camera.eye - center;
+		for (int i = 0; i < num_frames; ++i)
+		{
+			float angle = 2 * PI * i / (float)num_frames;
+			sPose pose;
+			pose.eye = center + Vector3(offset.x * cos(angle) - offset.z * sin(angle), offset.y, offset.x * sin(angle) + offset.z * cos(angle));
+			pose.center = center;
+			pose.fov = 0;
+			poses.push_back(pose);
+		}
+	}
+
+	int last = count < 0 ? poses.size() : std::min((int)poses.size(), first + count);
+
+	//written aside and renamed at the end, so the coordinator never takes a killed worker's file as finished
+	FILE* stats = NULL;
+	std::string temp_stats = stats_filename + ".tmp";
+	if (stats_filename.size())
+	{
+		stats = fopen(temp_stats.c_str(), "w");
+		if (stats)
+			fprintf(stats, "# %d %d\nframe,cpu_ms,gpu_ms,draw_calls,triangles\n", first, last - first);
+	}
+
+	std::vector<uint8> gl_pixels;
+	int failed_frames = 0;
+	if (compare_tolerance >= 0)
+		std::cout << " + Headless: comparing with the CPU rasterizer, it has no shadows, SSAO, decals or post effects" << std::endl;
+
+	FrameCapture capture;
+	capture.rle = tiles_x * tiles_y == 1; //the tiles are read back by the coordinator with Image::loadTGA
+	if (output_prefix.size())
+		capture.start(output_prefix.c_str(), first);
+
+	//the tiles only see their part of the frame, so the auto exposure would pick a different one for each tile.
+	//SSAO, bloom and the TAA neighborhood also stop at the tile border and can show seams in the stitched frame
+	if (tiles_x * tiles_y > 1 && renderer->auto_exposure)
+	{
+		renderer->auto_exposure = false;
+		std::cout << " + Headless: tiled frame, the fixed exposure of the renderer is used instead of the auto exposure" << std::endl;
+	}
+
+	//a shard continues the timeline of the whole sequence and renders a few previous poses without capturing them,
+	//so the temporal effects have a history like in a single process run
+	int warmup_first = std::max(0, first - HEADLESS_WARMUP_FRAMES);
+	app->time = warmup_first * frame_time;
+	app->elapsed_time = frame_time;
+	app->frame = warmup_first;
+
+	for (int i = warmup_first; i < last; ++i)
+	{
+		sPose& pose = poses[i];
+		camera->lookAt(pose.eye, pose.center, Vector3(0, 1, 0));
+		if (pose.fov > 0)
+			camera->fov = pose.fov;
+
+		//a tile keeps the aspect of the whole frame and moves its part of the projection to the full viewport
+		float aspect = (width * tiles_x) / (float)(height * tiles_y);
+		camera->setPerspective(camera->fov, aspect, camera->near_plane, camera->far_plane);
+		if (tiles_x * tiles_y > 1)
+		{
+			Matrix44 tile;
+			tile.m[0] = tiles_x;
+			tile.m[5] = tiles_y;
+			tile.m[12] = tiles_x - 1 - 2 * tile_x;
+			tile.m[13] = tiles_y - 1 - 2 * tile_y;
+			camera->projection_matrix = camera->projection_matrix * tile;
+			camera->updateViewMatrix();
+		}
+
+		Mesh::num_meshes_rendered = 0;
+		Mesh::num_triangles_rendered = 0;
+		auto start = std::chrono::steady_clock::now();
+		app->render();
+		if (i < first)
+		{
+			app->time += frame_time;
+			app->frame++;
+			continue;
+		}
+		capture.update();
+		capture.capture(width, height);
+		double cpu_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		//same pose again on the CPU, its output has the same layout as glReadPixels
+		if (compare_tolerance >= 0 && !renderer->cpu_raster)
+		{
+			gl_pixels.resize(width * height * 4);
+			glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &gl_pixels[0]);
+			renderer->cpu_raster = true;
+			app->render();
+			renderer->cpu_raster = false;
+
+			double mean = 0;
+			double over = compareFrames(&gl_pixels[0], &renderer->soft_rasterizer->output[0], width * height, compare_tolerance, mean);
+			bool ok = over <= HEADLESS_COMPARE_MAX_PIXELS;
+			if (!ok)
+				failed_frames++;
+			printf(" + Frame %d: %.2f%% pixels over %d, mean difference %.2f %s\n", i, over * 100.0, compare_tolerance, mean, ok ? "" : "[FAIL]");
+		}
+
+		//gpu_frame_ms comes from a query a few frames old
+		if (stats)
+			fprintf(stats, "%d,%.3f,%.3f,%ld,%ld\n", i, cpu_ms, renderer->gpu_frame_ms, Mesh::num_meshes_rendered, Mesh::num_triangles_rendered);
+
+		app->time += frame_time;
+		app->elapsed_time = frame_time;
+		app->frame++;
+	}
+
+	capture.stop();
+	if (stats)
+	{
+		fclose(stats);
+		remove(stats_filename.c_str());
+		rename(temp_stats.c_str(), stats_filename.c_str());
+	}
+	std::cout << " + Headless: " << std::max(0, last - first) << " frames rendered" << std::endl;
+	if (failed_frames)
+		std::cout << "[ERROR] " << failed_frames << " frames differ between GL and the CPU rasterizer" << std::endl;
+
+	destroyContext();
+	return failed_frames ? 1 : 0;
+}
+
+int GTR::HeadlessRenderer::countPoses()
+{
+	if (poses_filename.empty())
+		return num_frames;
+	std::vector<sPose> poses;
+	loadPoses(poses_filename.c_str(), poses);
+	return poses.size();
+}
+
+//same arguments as this process for everything the workers have in common
+std::string GTR::HeadlessRenderer::workerCommand(int first, int count, int tile, const std::string& stats)
+{
+	std::string command = "\"" + executable + "\" --headless -scene \"" + scene_filename + "\"";
+	if (tile >= 0)
+	{
+		command += " -size " + std::to_string(width / tiles_x) + "x" + std::to_string(height / tiles_y);
+		command += " -tile " + std::to_string(tile % tiles_x) + " " + std::to_string(tile / tiles_x) + " " + std::to_string(tiles_x) + " " + std::to_string(tiles_y);
+		command += " -out \"" + output_prefix + "_tile" + std::to_string(tile) + "\"";
+	}
+	else
+	{
+		command += " -size " + std::to_string(width) + "x" + std::to_string(height);
+		if (output_prefix.size())
+			command += " -out \"" + output_prefix + "\"";
+	}
+	if (poses_filename.size())
+		command += " -poses \"" + poses_filename + "\"";
+	else
+		command += " -frames " + std::to_string(num_frames);
+	command += " -first " + std::to_string(first) + " -count " + std::to_string(count) + " -stats \"" + stats + "\"";
+	if (cpu_raster)
+		command += " -cpu";
+	if (compare_tolerance >= 0)
+		command += " -compare " + std::to_string(compare_tolerance);
+#ifdef WIN32
+	command = "\"" + command + "\""; //cmd.exe strips the outer quotes
+#endif
+	return command;
+}
+
+//a shard is done when the worker renamed its stats file and it has the expected range
+static bool shardDone(const std::string& filename, int first, int count)
+{
+	FILE* f = fopen(filename.c_str(), "r");
+	if (f == NULL)
+		return false;
+	int file_first = -1, file_count = -1;
+	bool ok = fscanf(f, "# %d %d", &file_first, &file_count) == 2 && file_first == first && file_count == count;
+	fclose(f);
+	return ok;
+}
+
+//joins the tiles written by the workers in the final frame, the rows are bottom first
+bool GTR::HeadlessRenderer::stitchTiles(int frame)
+{
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "_%05d.tga", frame);
+	int tile_width = width / tiles_x;
+	int tile_height = height / tiles_y;
+	std::vector<uint8> pixels(width * height * 4);
+	for (int tile = 0; tile < tiles_x * tiles_y; ++tile)
+	{
+		std::string filename = output_prefix + "_tile" + std::to_string(tile) + suffix;
+		Image image;
+		if (!image.loadTGA(filename.c_str()) || image.width != tile_width || image.height != tile_height || image.num_channels != 4)
+		{
+			std::cout << "[ERROR] wrong tile " << filename << std::endl;
+			return false;
+		}
+		int x0 = (tile % tiles_x) * tile_width;
+		int y0 = (tile / tiles_x) * tile_height;
+		for (int y = 0; y < tile_height; ++y)
+			memcpy(&pixels[((y0 + y) * width + x0) * 4], image.data + y * tile_width * 4, tile_width * 4);
+		remove(filename.c_str());
+	}
+
+	std::vector<uint8> file_data;
+	FrameCapture::encodeTGA(&pixels[0], width, height, true, file_data);
+	FILE* f = fopen((output_prefix + suffix).c_str(), "wb");
+	if (f == NULL)
+		return false;
+	fwrite(&file_data[0], 1, file_data.size(), f);
+	fclose(f);
+	return true;
+}
+
+//launches the workers like the distributed probe baker, several shards per worker so they end at the same time
+int GTR::HeadlessRenderer::runCoordinator()
+{
+	bool tiled = tiles_x * tiles_y > 1;
+	int total = countPoses();
+	int last = count < 0 ? total : std::min(total, first + count);
+	if (last <= first)
+	{
+		std::cout << "[ERROR] no poses to render" << std::endl;
+		return 1;
+	}
+	if (tiled && (width % tiles_x || height % tiles_y || output_prefix.empty()))
+	{
+		std::cout << "[ERROR] -tiles needs -out and a size divisible by the number of tiles" << std::endl;
+		return 1;
+	}
+
+	//a tiled job is a single frame split in tiles, otherwise the shards are ranges of poses
+	int num_shards = tiled ? tiles_x * tiles_y : std::min(last - first, num_workers * 4);
+	std::string shard_prefix = output_prefix.size() ? output_prefix : "headless";
+	std::vector<std::string> commands(num_shards);
+	std::vector<std::string> shard_stats(num_shards);
+	std::vector<int> shard_first(num_shards);
+	std::vector<int> shard_count(num_shards);
+	std::vector<int> pending;
+	for (int i = 0; i < num_shards; ++i)
+	{
+		shard_first[i] = tiled ? first : first + (int)((long long)(last - first) * i / num_shards);
+		shard_count[i] = tiled ? 1 : first + (int)((long long)(last - first) * (i + 1) / num_shards) - shard_first[i];
+		shard_stats[i] = shard_prefix + "_shard" + std::to_string(i) + ".csv";
+		commands[i] = workerCommand(shard_first[i], shard_count[i], tiled ? i : -1, shard_stats[i]);
+		if (!shardDone(shard_stats[i], shard_first[i], shard_count[i]))
+			pending.push_back(i);
+	}
+	if (pending.size() < num_shards)
+		std::cout << " + Headless: resuming, " << (num_shards - pending.size()) << " of " << num_shards << " shards already rendered" << std::endl;
+
+	auto start = std::chrono::steady_clock::now();
+	std::atomic<int> next(0);
+	std::atomic<int> failed(0);
+	auto launcher = [&]() {
+		int i;
+		while ((i = next++) < (int)pending.size())
+		{
+			int shard = pending[i];
+			bool done = false;
+			for (int attempt = 0; attempt < HEADLESS_WORKER_ATTEMPTS && !done; ++attempt) {
+				int code = system(commands[shard].c_str());
+				done = code == 0 && shardDone(shard_stats[shard], shard_first[shard], shard_count[shard]);
+				if (!done)
+					std::cout << "[WARN] headless worker of shard " << shard << " failed (" << code << ")" << std::endl;
+			}
+			if (!done)
+				failed++;
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (int i = 0; i < std::min(num_workers, (int)pending.size()); ++i)
+		pool.push_back(std::thread(launcher));
+	for (int i = 0; i < pool.size(); ++i)
+		pool[i].join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (failed)
+	{
+		std::cout << "[ERROR] " << failed << " shards could not be rendered, run again to resume" << std::endl;
+		return 1;
+	}
+	if (tiled && !stitchTiles(first))
+		return 1;
+
+	//the stats of the shards in order, then they are not needed anymore
+	FILE* stats = stats_filename.size() ? fopen(stats_filename.c_str(), "w") : NULL;
+	if (stats)
+		fprintf(stats, "shard,frame,cpu_ms,gpu_ms,draw_calls,triangles\n");
+	for (int i = 0; i < num_shards; ++i)
+	{
+		std::ifstream file(shard_stats[i]);
+		std::string line;
+		while (stats && std::getline(file, line))
+			if (line.size() && line[0] != '#' && line[0] != 'f')
+				fprintf(stats, "%d,%s\n", i, line.c_str());
+		file.close();
+		remove(shard_stats[i].c_str());
+	}
+	if (stats)
+		fclose(stats);
+
+	int frames = tiled ? 1 : last - first;
+	std::cout << " + Headless: " << frames << " frames (" << num_shards << " shards, " << pending.size() << " rendered now) in "
+		<< seconds << " s with " << num_workers << " workers, " << (pending.size() ? frames * pending.size() / (double)num_shards / seconds : 0) << " frames/s" << std::endl;
+	return 0;
+}
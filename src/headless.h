@@ -0,0 +1,66 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+#include <string>
+
+namespace GTR {
+
+	// Batch rendering without a window or an event loop. The context is an EGL pbuffer, which also works
+	// with Mesa's software rasterizer on hosts without a GPU. Renders a list of camera poses and writes
+	// the frames as TGA files and/or a CSV with the timings of every frame.
+	// With -workers it becomes a coordinator that splits the poses (or the tiles of one big frame with -tiles)
+	// across headless processes of this same program, reusing the shards a previous run already finished.
+	// -cpu renders with the SoftRasterizer, -compare T renders every frame with both and fails when more than
+	// 1% of the pixels differ in more than T (0..255) in some channel, the images written are the GL ones.
+	// usage: --headless [-scene file.json] [-size WxH] [-frames N] [-poses file] [-out prefix] [-stats file.csv]
+	//                   [-first F] [-count C] [-workers N] [-tiles NXxNY] [-cpu] [-compare T]
+	class HeadlessRenderer
+	{
+	public:
+		struct sPose {
+			Vector3 eye;
+			Vector3 center;
+			float fov; //0 keeps the one of the scene
+		};
+
+		std::string scene_filename;
+		int width;
+		int height;
+		int num_frames; //when there is no poses file the main camera orbits the scene in this many frames
+		std::string poses_filename; //a pose per line: eye.x eye.y eye.z center.x center.y center.z [fov]
+		std::string output_prefix; //empty to skip the images
+		std::string stats_filename;
+		float frame_time; //fixed elapsed time for the temporal effects
+		bool cpu_raster;
+		int compare_tolerance; //-1 does not compare the GL and CPU frames
+
+		//sharding, a process renders the poses [first, first + count) or only one tile of them
+		int first;
+		int count; //-1 until the last pose
+		int tile_x;
+		int tile_y;
+		int tiles_x;
+		int tiles_y;
+		int num_workers; //> 0 makes this process the coordinator
+		std::string executable;
+
+		HeadlessRenderer();
+
+		bool parseArgs(int argc, char** argv);
+		int run();
+		int runCoordinator();
+
+		static bool loadPoses(const char* filename, std::vector<sPose>& poses);
+
+	private:
+		void* display;
+		void* surface;
+		void* context;
+
+		bool createContext();
+		void destroyContext();
+		int countPoses();
+		std::string workerCommand(int first, int count, int tile, const std::string& stats);
+		bool stitchTiles(int frame);
+	};
+};
@@ -0,0 +1,455 @@
+#include "irradiancecache.h"
+#include "probebaker.h"
+#include "includes.h"
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+#ifndef WIN32
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#define IRR_ENDIAN_CHECK 0x01020304
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static unsigned short floatToHalf(float value)
+{
+	uint32 f;
+	memcpy(&f, &value, 4);
+	uint32 sign = (f >> 16) & 0x8000;
+	int exponent = (int)((f >> 23) & 0xff) - 127 + 15;
+	uint32 mantissa = f & 0x7fffff;
+
+	if (((f >> 23) & 0xff) == 0xff) //inf and nan
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	if (exponent >= 31)
+		return sign | 0x7c00;
+	if (exponent <= 0) //denormal
+	{
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32 half = mantissa >> shift;
+		uint32 rest = mantissa & ((1u << shift) - 1);
+		uint32 halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+			half++;
+		return sign | half;
+	}
+
+	//round to nearest even, a carry into the exponent is still right
+	uint32 half = sign | (exponent << 10) | (mantissa >> 13);
+	uint32 rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++;
+	return half;
+}
+
+static float halfToFloat(unsigned short h)
+{
+	uint32 sign = (uint32)(h & 0x8000) << 16;
+	int exponent = (h >> 10) & 0x1f;
+	uint32 mantissa = h & 0x3ff;
+	uint32 f;
+
+	if (exponent == 0)
+	{
+		if (mantissa == 0)
+			f = sign;
+		else { //denormal, normalize it
+			exponent = 1;
+			while (!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				exponent--;
+			}
+			f = sign | ((exponent - 15 + 127) << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	}
+	else if (exponent == 31)
+		f = sign | 0x7f800000 | (mantissa << 13);
+	else
+		f = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+
+	float value;
+	memcpy(&value, &f, 4);
+	return value;
+}
+
+//groups the n-th byte of every value together, the exponent bytes of similar values then repeat a lot
+static void shuffleBytes(const uint8* src, uint8* dst, int size, int element_size, bool unshuffle)
+{
+	int count = size / element_size;
+	for (int i = 0; i < count; ++i)
+		for (int b = 0; b < element_size; ++b) {
+			if (unshuffle)
+				dst[i * element_size + b] = src[b * count + i];
+			else
+				dst[b * count + i] = src[i * element_size + b];
+		}
+}
+
+static void writeLength(std::vector<uint8>& out, int length)
+{
+	while (length >= 255) {
+		out.push_back(255);
+		length -= 255;
+	}
+	out.push_back(length);
+}
+
+static bool readLength(const uint8*& src, const uint8* end, int& length)
+{
+	length = 0;
+	while (src < end) {
+		uint8 v = *src++;
+		length += v;
+		if (v != 255)
+			return true;
+	}
+	return false;
+}
+
+//LZ77: [literal length][literals][match length - 4][offset u16] repeated, ends after the last literals
+static void compressLZ(const uint8* src, int size, std::vector<uint8>& out)
+{
+	std::vector<int> table(1 << LZ_HASH_BITS, -1);
+	int anchor = 0;
+	int i = 0;
+	out.clear();
+
+	while (i + LZ_MIN_MATCH <= size)
+	{
+		uint32 sequence;
+		memcpy(&sequence, src + i, 4);
+		int hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+		int ref = table[hash];
+		table[hash] = i;
+
+		if (ref < 0 || i - ref > LZ_MAX_OFFSET || memcmp(src + ref, src + i, LZ_MIN_MATCH) != 0) {
+			i++;
+			continue;
+		}
+
+		int length = LZ_MIN_MATCH;
+		while (i + length < size && src[ref + length] == src[i + length])
+			length++;
+
+		writeLength(out, i - anchor);
+		out.insert(out.end(), src + anchor, src + i);
+		writeLength(out, length - LZ_MIN_MATCH);
+		int offset = i - ref;
+		out.push_back(offset & 0xff);
+		out.push_back(offset >> 8);
+
+		i += length;
+		anchor = i;
+	}
+
+	writeLength(out, size - anchor);
+	out.insert(out.end(), src + anchor, src + size);
+}
+
+static bool decompressLZ(const uint8* src, int size, uint8* dst, int dst_size)
+{
+	const uint8* end = src + size;
+	int pos = 0;
+	while (true)
+	{
+		int literals;
+		if (!readLength(src, end, literals) || literals > end - src || pos + literals > dst_size)
+			return false;
+		memcpy(dst + pos, src, literals);
+		src += literals;
+		pos += literals;
+		if (pos == dst_size)
+			return src == end;
+
+		int length;
+		if (!readLength(src, end, length) || end - src < 2)
+			return false;
+		length += LZ_MIN_MATCH;
+		int offset = src[0] | (src[1] << 8);
+		src += 2;
+		if (offset == 0 || offset > pos || pos + length > dst_size)
+			return false;
+		for (int i = 0; i < length; ++i, ++pos) //byte by byte, matches can overlap
+			dst[pos] = dst[pos - offset];
+	}
+}
+
+GTR::IrradianceCache::IrradianceCache()
+{
+	data = NULL;
+	mapped = NULL;
+	mapped_size = 0;
+#ifdef WIN32
+	file_handle = NULL;
+	mapping_handle = NULL;
+#endif
+}
+
+GTR::IrradianceCache::~IrradianceCache()
+{
+	close();
+}
+
+bool GTR::IrradianceCache::open(const char* filename)
+{
+	close();
+
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	file_handle = file;
+	LARGE_INTEGER size;
+	GetFileSizeEx(file, &size);
+	mapped_size = (size_t)size.QuadPart;
+	if (mapped_size >= sizeof(sIrrFileHeader)) {
+		mapping_handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping_handle)
+			mapped = (uint8*)MapViewOfFile((HANDLE)mapping_handle, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	fstat(fd, &st);
+	mapped_size = st.st_size;
+	if (mapped_size >= sizeof(sIrrFileHeader)) {
+		void* ptr = mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		mapped = ptr == MAP_FAILED ? NULL : (uint8*)ptr;
+	}
+	::close(fd);
+#endif
+
+	if (!mapped) {
+		close();
+		return false;
+	}
+
+	memcpy(&header, mapped, sizeof(header));
+	if (memcmp(header.magic, "IRRB", 4) != 0) {
+		close();
+		return false;
+	}
+
+	//version 2 had no bricks, its header ends before them
+	int v2_header_bytes = offsetof(sIrrFileHeader, num_bricks);
+	if (header.version == 2 && header.header_bytes == v2_header_bytes) {
+		header.num_bricks = 0;
+		header.bricks_offset = 0;
+		header.header_bytes = sizeof(header);
+		header.version = IRR_BIN_VERSION;
+	}
+
+	if (header.endian != IRR_ENDIAN_CHECK) {
+		std::cout << "[ERROR] irradiance file baked on a machine of the other endianness, bake it again: " << filename << std::endl;
+		close();
+		return false;
+	}
+
+	bool half = (header.flags & IRR_HALF) != 0;
+	//the fields may be garbage, every size and offset is checked in 64 bits so nothing wraps before the
+	//comparison with the file size, the data is read straight from the mapping
+	long long file_size = mapped_size;
+	long long brick_probes = IRR_BRICK_SIZE * IRR_BRICK_SIZE * IRR_BRICK_SIZE;
+	long long expected_probes = header.num_bricks ? header.num_bricks * brick_probes : (long long)header.dims.x * header.dims.y * header.dims.z;
+	bool valid = header.version == IRR_BIN_VERSION && header.endian == IRR_ENDIAN_CHECK && header.header_bytes == sizeof(header) &&
+		header.num_probes > 0 && header.num_probes == expected_probes && header.num_bricks >= 0 &&
+		(header.num_bricks == 0 || (header.bricks_offset >= (int)sizeof(header) &&
+			header.bricks_offset + (long long)header.num_bricks * sizeof(sIrrBrick) <= file_size)) &&
+		header.raw_bytes >= 0 && header.raw_bytes == (long long)header.num_probes * rowBytes(half) &&
+		header.data_offset >= (int)sizeof(header) && header.data_bytes >= 0 &&
+		(long long)header.data_offset + header.data_bytes <= file_size &&
+		((header.flags & IRR_COMPRESSED) || header.data_bytes == header.raw_bytes);
+	if (!valid) {
+		std::cout << "[ERROR] unsupported irradiance file (version " << header.version << "): " << filename << std::endl;
+		close();
+		return false;
+	}
+
+	bricks.resize(header.num_bricks);
+	if (header.num_bricks)
+		memcpy(&bricks[0], mapped + header.bricks_offset, header.num_bricks * sizeof(sIrrBrick));
+
+	const uint8* stored = mapped + header.data_offset;
+	if (ProbeBaker::checksum(stored, header.data_bytes) != header.checksum) {
+		std::cout << "[ERROR] irradiance file is corrupted: " << filename << std::endl;
+		close();
+		return false;
+	}
+
+	if (header.flags & IRR_COMPRESSED)
+	{
+		std::vector<uint8> shuffled(header.raw_bytes);
+		if (!decompressLZ(stored, header.data_bytes, &shuffled[0], header.raw_bytes)) {
+			std::cout << "[ERROR] irradiance file is corrupted: " << filename << std::endl;
+			close();
+			return false;
+		}
+		unpacked.resize(header.raw_bytes);
+		shuffleBytes(&shuffled[0], &unpacked[0], header.raw_bytes, half ? 2 : 4, true);
+		data = &unpacked[0];
+	}
+	else
+		data = stored; //straight from the mapped file
+
+	return true;
+}
+
+void GTR::IrradianceCache::close()
+{
+#ifdef WIN32
+	if (mapped)
+		UnmapViewOfFile(mapped);
+	if (mapping_handle)
+		CloseHandle((HANDLE)mapping_handle);
+	if (file_handle)
+		CloseHandle((HANDLE)file_handle);
+	file_handle = NULL;
+	mapping_handle = NULL;
+#else
+	if (mapped)
+		munmap(mapped, mapped_size);
+#endif
+	mapped = NULL;
+	mapped_size = 0;
+	data = NULL;
+	unpacked.clear();
+	bricks.clear();
+}
+
+unsigned int GTR::IrradianceCache::getDataType() const
+{
+	return (header.flags & IRR_HALF) ? GL_HALF_FLOAT : GL_FLOAT;
+}
+
+SphericalHarmonics GTR::IrradianceCache::getProbe(int index) const
+{
+	SphericalHarmonics sh;
+	if (header.flags & IRR_HALF) {
+		const unsigned short* row = (const unsigned short*)data + index * 27;
+		for (int i = 0; i < 27; ++i)
+			sh.coeffs[i / 3].v[i % 3] = halfToFloat(row[i]);
+	}
+	else
+		memcpy(&sh, data + index * rowBytes(false), sizeof(sh));
+	return sh;
+}
+
+void GTR::IrradianceCache::encode(const SphericalHarmonics* sh, int count, bool half, uint8* rows)
+{
+	if (!half) {
+		memcpy(rows, sh, count * sizeof(SphericalHarmonics));
+		return;
+	}
+	unsigned short* out = (unsigned short*)rows;
+	for (int i = 0; i < count; ++i)
+		for (int j = 0; j < 27; ++j)
+			*out++ = floatToHalf(sh[i].coeffs[j / 3].v[j % 3]);
+}
+
+bool GTR::IrradianceCache::save(const char* filename, Vector3 start, Vector3 end, Vector3 dims, const SphericalHarmonics* sh, int count, int flags, const sIrrBrick* bricks, int num_bricks)
+{
+	bool half = (flags & IRR_HALF) != 0;
+	int raw_bytes = count * rowBytes(half);
+	std::vector<uint8> rows(raw_bytes);
+	encode(sh, count, half, &rows[0]);
+
+	std::vector<uint8> stored;
+	if (flags & IRR_COMPRESSED)
+	{
+		std::vector<uint8> shuffled(raw_bytes);
+		shuffleBytes(&rows[0], &shuffled[0], raw_bytes, half ? 2 : 4, false);
+		compressLZ(&shuffled[0], raw_bytes, stored);
+		if (stored.size() >= raw_bytes) //not worth it
+			flags &= ~IRR_COMPRESSED;
+	}
+	if (!(flags & IRR_COMPRESSED))
+		stored.swap(rows);
+
+	sIrrFileHeader header = {};
+	memcpy(header.magic, "IRRB", 4);
+	header.version = IRR_BIN_VERSION;
+	header.endian = IRR_ENDIAN_CHECK;
+	header.header_bytes = sizeof(header);
+	header.start = start;
+	header.end = end;
+	header.dims = dims;
+	header.num_probes = count;
+	header.flags = flags;
+	header.data_offset = IRR_DATA_ALIGNMENT;
+	header.data_bytes = stored.size();
+	header.raw_bytes = raw_bytes;
+	header.checksum = ProbeBaker::checksum(&stored[0], stored.size());
+	header.num_bricks = num_bricks;
+	header.bricks_offset = IRR_DATA_ALIGNMENT + stored.size(); //after the data, the mapped rows stay aligned
+
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write irradiance file: " << filename << std::endl;
+		return false;
+	}
+	std::vector<uint8> padding(IRR_DATA_ALIGNMENT - sizeof(header), 0);
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(&padding[0], 1, padding.size(), f);
+	fwrite(&stored[0], 1, stored.size(), f);
+	if (num_bricks)
+		fwrite(bricks, sizeof(sIrrBrick), num_bricks, f);
+	fclose(f);
+	return true;
+}
+
+bool GTR::IrradianceCache::saveProbes(const char* filename, const SphericalHarmonics* sh, int count, const std::vector<int>& dirty)
+{
+	FILE* f = fopen(filename, "r+b");
+	if (f == NULL)
+		return false;
+
+	sIrrFileHeader header;
+	bool valid = fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, "IRRB", 4) == 0 &&
+		header.version == IRR_BIN_VERSION && header.endian == IRR_ENDIAN_CHECK && header.num_probes == count;
+	if (!valid || (header.flags & IRR_COMPRESSED))
+	{
+		std::vector<sIrrBrick> bricks(valid ? header.num_bricks : 0);
+		if (bricks.size()) {
+			fseek(f, header.bricks_offset, SEEK_SET);
+			valid = fread(&bricks[0], sizeof(sIrrBrick), bricks.size(), f) == bricks.size();
+		}
+		fclose(f);
+		if (!valid)
+			return false;
+		return save(filename, header.start, header.end, header.dims, sh, count, header.flags, bricks.size() ? &bricks[0] : NULL, bricks.size());
+	}
+
+	//the checksum needs all the rows, but only the dirty ones are written
+	bool half = (header.flags & IRR_HALF) != 0;
+	int row_bytes = rowBytes(half);
+	std::vector<uint8> rows(count * row_bytes);
+	encode(sh, count, half, &rows[0]);
+
+	for (int i = 0; i < dirty.size(); ++i) {
+		int index = dirty[i];
+		if (index < 0 || index >= count)
+			continue;
+		fseek(f, header.data_offset + index * row_bytes, SEEK_SET);
+		fwrite(&rows[index * row_bytes], 1, row_bytes, f);
+	}
+
+	header.checksum = ProbeBaker::checksum(&rows[0], rows.size());
+	fseek(f, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, f);
+	fclose(f);
+	return true;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "framework.h"
+#include "sphericalharmonics.h"
+#include <vector>
+
+#define IRR_BIN_VERSION 3
+#define IRR_DATA_ALIGNMENT 4096 //probe data starts on a page so it can be mapped and uploaded as is
+#define IRR_BRICK_SIZE 4 //probes per side of a brick
+
+namespace GTR {
+
+	enum eIrrFlags {
+		IRR_HALF = 1,		//coeffs stored as half floats
+		IRR_COMPRESSED = 2	//probe data shuffled by bytes and LZ compressed
+	};
+
+	//leaf of the adaptive octree, holds IRR_BRICK_SIZE^3 probes from start to start + size
+	struct sIrrBrick {
+		Vector3 start;
+		float size;
+		int level;
+	};
+
+	struct sIrrFileHeader {
+		char magic[4]; //"IRRB"
+		int version;
+		unsigned int endian; //0x01020304 as written by the machine that baked it, only that one can open it
+		int header_bytes;
+		Vector3 start;
+		Vector3 end;
+		Vector3 dims;
+		int num_probes;
+		int flags;
+		int data_offset;
+		int data_bytes; //bytes stored in the file
+		int raw_bytes; //bytes of the probe rows once unpacked
+		unsigned int checksum; //of the stored bytes
+		//version 3
+		int num_bricks; //0 for a regular grid
+		int bricks_offset;
+	};
+
+	// irradiance.bin: header followed by one row per probe with its 9 RGB coeffs,
+	// the same layout as the probes texture so the mapped file is uploaded directly.
+	// Files of the other endianness are rejected instead of swapped, swapping would need a copy of the data
+	class IrradianceCache
+	{
+	public:
+		sIrrFileHeader header;
+		std::vector<sIrrBrick> bricks;
+
+		IrradianceCache();
+		~IrradianceCache();
+
+		bool open(const char* filename);
+		void close();
+
+		const void* getProbeData() const { return data; }
+		unsigned int getDataType() const;
+		SphericalHarmonics getProbe(int index) const;
+
+		static int rowBytes(bool half) { return 9 * 3 * (half ? 2 : 4); }
+		static void encode(const SphericalHarmonics* sh, int count, bool half, uint8* rows);
+		static bool save(const char* filename, Vector3 start, Vector3 end, Vector3 dims, const SphericalHarmonics* sh, int count, int flags, const sIrrBrick* bricks = NULL, int num_bricks = 0);
+		//rewrites only the rows of the dirty probes, compressed files are saved again
+		static bool saveProbes(const char* filename, const SphericalHarmonics* sh, int count, const std::vector<int>& dirty);
+
+	private:
+		const uint8* data;
+		uint8* mapped;
+		size_t mapped_size;
+		std::vector<uint8> unpacked;
+#ifdef WIN32
+		void* file_handle;
+		void* mapping_handle;
+#endif
+	};
+};
@@ -0,0 +1,180 @@
+#include "irradiancesampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+//adds the 8 corners starting at first, offsets are the index steps along x, y and z
+static SphericalHarmonics blendCorners(const SphericalHarmonics* sh, int first, int ox, int oy, int oz, float fx, float fy, float fz)
+{
+	SphericalHarmonics result;
+	float w[8];
+	int index[8];
+	for (int i = 0; i < 8; ++i) {
+		int x = i & 1, y = (i >> 1) & 1, z = (i >> 2) & 1;
+		w[i] = (x ? fx : 1.0f - fx) * (y ? fy : 1.0f - fy) * (z ? fz : 1.0f - fz);
+		index[i] = first + x * ox + y * oy + z * oz;
+	}
+	for (int c = 0; c < 9; ++c) {
+		Vector3 v;
+		for (int i = 0; i < 8; ++i)
+			v = v + sh[index[i]].coeffs[c] * w[i];
+		result.coeffs[c] = v;
+	}
+	return result;
+}
+
+static float clampf(float v, float min, float max)
+{
+	return v < min ? min : (v > max ? max : v);
+}
+
+GTR::IrradianceSampler::IrradianceSampler()
+{
+	clear();
+}
+
+void GTR::IrradianceSampler::clear()
+{
+	coeffs.clear();
+	cell_bricks.clear();
+	brick_levels.clear();
+	dims[0] = dims[1] = dims[2] = 0;
+	res = 0;
+}
+
+void GTR::IrradianceSampler::setGrid(Vector3 start, Vector3 end, Vector3 dims, const SphericalHarmonics* sh, int count)
+{
+	clear();
+	this->start = start;
+	for (int i = 0; i < 3; ++i) {
+		this->dims[i] = (int)dims.v[i];
+		inv_size.v[i] = end.v[i] != start.v[i] ? 1.0f / (end.v[i] - start.v[i]) : 0.0f;
+	}
+	if (count != this->dims[0] * this->dims[1] * this->dims[2]) {
+		clear();
+		return;
+	}
+	coeffs.assign(sh, sh + count);
+}
+
+void GTR::IrradianceSampler::setBricks(Vector3 start, Vector3 end, const sIrrBrick* bricks, int num_bricks, const SphericalHarmonics* sh, int count)
+{
+	clear();
+	const int brick_probes = IRR_BRICK_SIZE * IRR_BRICK_SIZE * IRR_BRICK_SIZE;
+	if (!num_bricks || count != num_bricks * brick_probes)
+		return;
+
+	this->start = start;
+	float size = end.x - start.x;
+	inv_size.set(1.0f / size, 1.0f / size, 1.0f / size);
+
+	//same table as the indirection texture of the renderer
+	int max_level = 0;
+	for (int b = 0; b < num_bricks; ++b)
+		max_level = std::max(max_level, bricks[b].level);
+	res = 1 << max_level;
+	float cell = size / res;
+	cell_bricks.assign(res * res * res, 0);
+	brick_levels.resize(num_bricks);
+	for (int b = 0; b < num_bricks; ++b)
+	{
+		const sIrrBrick& brick = bricks[b];
+		brick_levels[b] = brick.level;
+		int cells = res >> brick.level;
+		int from[3];
+		for (int i = 0; i < 3; ++i)
+			from[i] = (int)floor((brick.start.v[i] - start.v[i]) / cell + 0.5f);
+		for (int z = from[2]; z < from[2] + cells; ++z)
+			for (int y = from[1]; y < from[1] + cells; ++y)
+				for (int x = from[0]; x < from[0] + cells; ++x)
+					if (x >= 0 && y >= 0 && z >= 0 && x < res && y < res && z < res)
+						cell_bricks[x + y * res + z * res * res] = b;
+	}
+	coeffs.assign(sh, sh + count);
+}
+
+SphericalHarmonics GTR::IrradianceSampler::sample(Vector3 pos) const
+{
+	if (coeffs.empty())
+		return SphericalHarmonics();
+	return res ? sampleBricks(pos) : sampleGrid(pos);
+}
+
+void GTR::IrradianceSampler::sample(const Vector3* positions, SphericalHarmonics* result, int count) const
+{
+	if (coeffs.empty()) {
+		for (int i = 0; i < count; ++i)
+			result[i] = SphericalHarmonics();
+		return;
+	}
+	if (res)
+		for (int i = 0; i < count; ++i)
+			result[i] = sampleBricks(positions[i]);
+	else
+		for (int i = 0; i < count; ++i)
+			result[i] = sampleGrid(positions[i]);
+}
+
+SphericalHarmonics GTR::IrradianceSampler::sampleGrid(Vector3 pos) const
+{
+	int base[3];
+	float f[3];
+	for (int i = 0; i < 3; ++i) {
+		float grid = clampf((pos.v[i] - start.v[i]) * inv_size.v[i], 0.0f, 1.0f) * (dims[i] - 1);
+		base[i] = std::min((int)grid, std::max(dims[i] - 2, 0));
+		f[i] = dims[i] > 1 ? grid - base[i] : 0.0f;
+	}
+
+	//a single probe along an axis has no neighbour there
+	int ox = dims[0] > 1 ? 1 : 0;
+	int oy = dims[1] > 1 ? dims[0] : 0;
+	int oz = dims[2] > 1 ? dims[0] * dims[1] : 0;
+	int first = base[0] + base[1] * dims[0] + base[2] * dims[0] * dims[1];
+	return blendCorners(&coeffs[0], first, ox, oy, oz, f[0], f[1], f[2]);
+}
+
+SphericalHarmonics GTR::IrradianceSampler::sampleBricks(Vector3 pos) const
+{
+	float local[3];
+	int cell[3];
+	for (int i = 0; i < 3; ++i) {
+		local[i] = clampf((pos.v[i] - start.v[i]) * inv_size.v[i], 0.0f, 0.99999f);
+		cell[i] = (int)(local[i] * res);
+	}
+	int brick = cell_bricks[cell[0] + cell[1] * res + cell[2] * res * res];
+	float scale = (float)(1 << brick_levels[brick]);
+
+	//position inside the brick in probe units
+	int base[3];
+	float f[3];
+	for (int i = 0; i < 3; ++i) {
+		float p = local[i] * scale;
+		p = (p - floor(p)) * (IRR_BRICK_SIZE - 1);
+		base[i] = std::min((int)p, IRR_BRICK_SIZE - 2);
+		f[i] = p - base[i];
+	}
+
+	const int side = IRR_BRICK_SIZE;
+	int first = brick * side * side * side + base[0] + base[1] * side + base[2] * side * side;
+	return blendCorners(&coeffs[0], first, 1, side, side * side, f[0], f[1], f[2]);
+}
+
+Vector3 GTR::IrradianceSampler::irradiance(const SphericalHarmonics& sh, Vector3 N)
+{
+	const float A0 = PI, A1 = (2.0f * PI) / 3.0f, A2 = PI * 0.25f;
+	float lobe[9] = {
+		0.282095f * A0,
+		0.488603f * N.y * A1,
+		0.488603f * N.z * A1,
+		0.488603f * N.x * A1,
+		1.092548f * N.x * N.y * A2,
+		1.092548f * N.y * N.z * A2,
+		0.315392f * (3.0f * N.z * N.z - 1.0f) * A2,
+		1.092548f * N.x * N.z * A2,
+		0.546274f * (N.x * N.x - N.y * N.y) * A2
+	};
+	Vector3 result;
+	for (int c = 0; c < 9; ++c)
+		result = result + sh.coeffs[c] * lobe[c];
+	return result;
+}
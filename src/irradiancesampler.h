@@ -0,0 +1,43 @@
+#pragma once
+#include "framework.h"
+#include "sphericalharmonics.h"
+#include "irradiancecache.h"
+#include <vector>
+
+namespace GTR {
+
+	// CPU queries of the baked probes, for dynamic objects and gameplay code.
+	// It keeps its own copy of the coeffs and never touches GL, so it also works headless
+	class IrradianceSampler
+	{
+	public:
+		IrradianceSampler();
+
+		void clear();
+		//regular grid, coeffs in x + y * dim.x + z * dim.x * dim.y order
+		void setGrid(Vector3 start, Vector3 end, Vector3 dims, const SphericalHarmonics* sh, int count);
+		//adaptive layout, IRR_BRICK_SIZE^3 probes per brick in brick order
+		void setBricks(Vector3 start, Vector3 end, const sIrrBrick* bricks, int num_bricks, const SphericalHarmonics* sh, int count);
+		bool isEmpty() const { return coeffs.empty(); }
+
+		//trilinear interpolation of the 8 probes around pos, the same weights the shaders use
+		SphericalHarmonics sample(Vector3 pos) const;
+		void sample(const Vector3* positions, SphericalHarmonics* result, int count) const;
+
+		//irradiance arriving to a surface with normal N, same cosine lobe as ComputeSHIrradiance
+		static Vector3 irradiance(const SphericalHarmonics& sh, Vector3 N);
+
+	private:
+		std::vector<SphericalHarmonics> coeffs;
+		Vector3 start;
+		Vector3 inv_size; //1 / (end - start)
+		int dims[3];
+		//bricks
+		std::vector<int> cell_bricks; //brick of every cell of the finest level
+		std::vector<int> brick_levels;
+		int res;
+
+		SphericalHarmonics sampleGrid(Vector3 pos) const;
+		SphericalHarmonics sampleBricks(Vector3 pos) const;
+	};
+};
@@ -16,8 +16,11 @@
 #include "input.h"
 #include "application.h"
 #include "task.h"
+#include "probebaker.h"
+#include "headless.h"
 
 #include <iostream> //to output
+#include <cstring>
 
 long last_time = 0; //this is used to calcule the elapsed time between frames
 
@@ -130,8 +133,10 @@ void mainLoop(SDL_Window* window)
 
 	while (!app->must_exit)
 	{
-		//render frame
+		//render frame, with the decoupled update the next update is running meanwhile
 		app->render();
+		app->finishUpdate(); //the gui and the events change the scene
+		app->updateCursor();
 		if (app->render_gui)
 			renderDebug(window, app); //Comentar si peta en modo debug
 		// swap between front buffer and back buffer
@@ -197,8 +202,15 @@ void mainLoop(SDL_Window* window)
 			frames_this_second = 0;
 		}
 
-		//update app logic
-		app->update(elapsed_time);
+		//update app logic, or copy what has to be rendered and update on the other thread while rendering
+		if (app->decoupled_update) {
+			app->captureSnapshot();
+			app->startUpdate(elapsed_time);
+		}
+		else {
+			app->sampleInput();
+			app->update(elapsed_time);
+		}
 
 		//execute a task in the main task manager (blocking)
 		TaskManager::foreground.fetchTask();
@@ -214,6 +226,24 @@ void mainLoop(SDL_Window* window)
 
 int main(int argc, char **argv)
 {
+	//irradiance bake worker launched by the coordinator, it does not need a window
+	if (argc >= 5 && strcmp(argv[1], "--bake-worker") == 0)
+		return GTR::ProbeBaker::runWorker(argv[2], atoi(argv[3]), atoi(argv[4]), argc >= 6 ? atoi(argv[5]) : 1);
+	GTR::ProbeBaker::executable = argv[0];
+
+	//CPU probe bake to irradiance.bin, no window nor GL context
+	if (argc >= 2 && strcmp(argv[1], "--bake") == 0)
+		return GTR::ProbeBaker::runCommandLine(argc, argv);
+
+	//batch rendering to files, no window nor event loop
+	if (argc >= 2 && strcmp(argv[1], "--headless") == 0)
+	{
+		GTR::HeadlessRenderer headless;
+		if (!headless.parseArgs(argc, argv))
+			return 1;
+		return headless.run();
+	}
+
 	std::cout << "Initiating app..." << std::endl;
 
 	//prepare SDL
@@ -260,6 +290,7 @@ int main(int argc, char **argv)
 
 	//main loop, application gets inside here till user closes it
 	mainLoop(window);
+	delete app; //stops the update thread
 
 	//save state and free memory
 	// Cleanup
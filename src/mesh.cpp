@@ -14,6 +14,7 @@
 #include "texture.h"
 //#include "animation.h"
 #include "extra/coldet/coldet.h"
+#include "parallel.h"
 
 //#include "engine/application.h"
 
@@ -721,12 +722,12 @@ bool Mesh::interleaveBuffers()
 
 	interleaved.resize(vertices.size());
 
-	for (unsigned int i = 0; i < vertices.size(); ++i)
+	parallel_for(0, (int)vertices.size(), 16384, [&](int i)
 	{
 		interleaved[i].vertex = vertices[i];
 		interleaved[i].normal = normals[i];
 		interleaved[i].uv = uvs[i];
-	}
+	});
 
 	vertices.resize(0);
 	normals.resize(0);
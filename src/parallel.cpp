@@ -0,0 +1,137 @@
+#include "parallel.h"
+#include "sphericalharmonics.h"
+#include "mesh.h"
+#include "texture.h"
+#include "animation.h"
+#include "probebaker.h"
+#include <chrono>
+#include <iostream>
+#include <cstring>
+
+int parallel_thread_limit = 0;
+
+typedef std::chrono::high_resolution_clock bench_clock;
+
+template<typename F> static double timeMs(F func, int iterations)
+{
+	bench_clock::time_point start = bench_clock::now();
+	for (int i = 0; i < iterations; ++i)
+		func();
+	return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count() / iterations;
+}
+
+static void printTimes(const char* name, const double* ms, const int* threads, int count)
+{
+	std::cout << " + " << name << ":";
+	for (int i = 0; i < count; ++i)
+		std::cout << "  " << threads[i] << "t " << ms[i] << " ms (x" << ms[0] / std::max(ms[i], 1e-6) << ")";
+	std::cout << std::endl;
+}
+
+void benchmarkParallel(GTR::Scene* scene)
+{
+	//the counts above the threads available would repeat the last one, it goes at the end instead
+	int max_threads = parallelThreads(1 << 30);
+	std::vector<int> thread_counts;
+	int top = std::min(max_threads, 16);
+	for (int c = 1; c < top; c *= 2)
+		thread_counts.push_back(c);
+	thread_counts.push_back(top);
+	const int num_counts = thread_counts.size();
+
+	//the same data for every thread count
+	int num_cubemaps = 64;
+	int face_size = 32;
+	std::vector<FloatImage> faces(num_cubemaps * 6);
+	for (int i = 0; i < faces.size(); ++i) {
+		faces[i].resize(face_size, face_size, 3);
+		for (int j = 0; j < face_size * face_size * 3; ++j)
+			faces[i].data[j] = (rand() % 1000) / 100.0f;
+	}
+	std::vector<SphericalHarmonics> sh(num_cubemaps);
+	computeSH(&faces[0]); //builds the table, a one time cost
+
+	Mesh mesh;
+	int num_vertices = 1 << 20;
+	mesh.vertices.resize(num_vertices);
+	mesh.normals.resize(num_vertices, Vector3(0, 1, 0));
+	mesh.uvs.resize(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		mesh.vertices[i].set((float)i, (float)(i % 7), (float)(i % 13));
+
+	Image image;
+	image.resize(4096, 4096, 4);
+	std::vector<float> values(1 << 22);
+	for (int i = 0; i < values.size(); ++i)
+		values[i] = (rand() % 10000) / 1000.0f - 5.0f;
+
+	//a chain of 128 bones, the most a skeleton holds; with ANIMATION_BONE_GRAIN that is two chunks at most
+	Animation animation;
+	animation.skeleton.num_bones = 128;
+	animation.num_animated_bones = 128;
+	animation.num_keyframes = 30;
+	animation.samples_per_second = 30;
+	animation.duration = 1;
+	animation.keyframes = new Matrix44[animation.num_keyframes * animation.num_animated_bones];
+	for (int i = 0; i < 128; ++i) {
+		animation.skeleton.bones[i].parent = i - 1;
+		animation.skeleton.bones[i].layer = BODY;
+		animation.bones_map[i] = i;
+	}
+	for (int i = 0; i < animation.num_keyframes * animation.num_animated_bones; ++i)
+		animation.keyframes[i].setTranslation(0, (i % 7) * 0.1f, 0);
+	Skeleton blended;
+
+	//a few probes over the bounds of the scene, with fewer rays than a real bake
+	GTR::ProbeBaker baker;
+	std::vector<Vector3> probe_positions;
+	std::vector<SphericalHarmonics> probe_sh;
+	if (scene) {
+		baker.num_samples = 64;
+		baker.build(scene);
+		for (int i = 0; i < 64; ++i)
+			probe_positions.push_back(Vector3(-300 + (i % 4) * 200.0f, 5 + ((i / 4) % 4) * 48.0f, -300 + (i / 16) * 200.0f));
+		probe_sh.resize(probe_positions.size());
+	}
+
+	std::vector<double> sh_ms(num_counts), mesh_ms(num_counts), flip_ms(num_counts), reduce_ms(num_counts);
+	std::vector<double> anim_ms(num_counts), blend_ms(num_counts), bake_ms(num_counts);
+	double reference_sum = 0;
+	bool deterministic = true;
+	for (int c = 0; c < num_counts; ++c) {
+		parallel_thread_limit = thread_counts[c];
+		sh_ms[c] = timeMs([&]() { computeSHBatch(&faces[0], &sh[0], num_cubemaps); }, 3);
+		mesh_ms[c] = timeMs([&]() { mesh.interleaveBuffers(); }, 3);
+		flip_ms[c] = timeMs([&]() { image.flipY(); }, 3);
+		anim_ms[c] = timeMs([&]() { animation.assignTime(0.37f); }, 1000);
+		blend_ms[c] = timeMs([&]() { blendSkeleton(&animation.skeleton, &animation.skeleton, 0.5f, &blended); }, 1000);
+		if (scene)
+			bake_ms[c] = timeMs([&]() { baker.bake(&probe_positions[0], &probe_sh[0], probe_positions.size()); }, 1);
+
+		double sum = 0;
+		reduce_ms[c] = timeMs([&]() {
+			sum = parallel_reduce(0, (int)values.size(), 0, 0.0, [&](int first, int last) {
+				double s = 0;
+				for (int i = first; i < last; ++i)
+					s += values[i];
+				return s;
+			}, [](double a, double b) { return a + b; });
+		}, 10);
+		if (c == 0)
+			reference_sum = sum;
+		else if (memcmp(&sum, &reference_sum, sizeof(double)) != 0)
+			deterministic = false;
+	}
+	parallel_thread_limit = 0;
+
+	std::cout << "Parallel loops, up to " << max_threads << " threads (the JobSystem workers and this one):" << std::endl;
+	printTimes("SH batch", &sh_ms[0], &thread_counts[0], num_counts);
+	printTimes("interleaveBuffers", &mesh_ms[0], &thread_counts[0], num_counts);
+	printTimes("flipY", &flip_ms[0], &thread_counts[0], num_counts);
+	printTimes("assignTime", &anim_ms[0], &thread_counts[0], num_counts);
+	printTimes("blendSkeleton", &blend_ms[0], &thread_counts[0], num_counts);
+	if (scene)
+		printTimes("CPU probe bake", &bake_ms[0], &thread_counts[0], num_counts);
+	printTimes("reduce", &reduce_ms[0], &thread_counts[0], num_counts);
+	std::cout << " + reduce result " << (deterministic ? "identical" : "DIFFERENT") << " with every thread count" << std::endl;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include "task.h"
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <algorithm>
+
+// Loops split in chunks of grain iterations run by the JobSystem workers and the calling thread.
+// With grain 0 the range is cut in PARALLEL_AUTO_CHUNKS chunks. The chunks only depend on the range and
+// the grain, never on the threads, and parallel_reduce joins them in order, so the results are the same
+// with any number of threads. max_threads 0 uses all the workers.
+
+#define PARALLEL_AUTO_CHUNKS 64
+
+extern int parallel_thread_limit; //caps every loop, 0 no cap, for the benchmark
+
+inline int parallelGrain(int count, int grain)
+{
+	return grain > 0 ? grain : std::max(1, (count + PARALLEL_AUTO_CHUNKS - 1) / PARALLEL_AUTO_CHUNKS);
+}
+
+//threads that would run a loop of num_chunks
+inline int parallelThreads(int num_chunks, int max_threads = 0)
+{
+	int threads = JobSystem::instance.numWorkers() + 1;
+	if (max_threads > 0)
+		threads = std::min(threads, max_threads);
+	if (parallel_thread_limit > 0)
+		threads = std::min(threads, parallel_thread_limit);
+	return std::max(1, std::min(threads, num_chunks));
+}
+
+//func(first, last) for every chunk
+template<typename F> void parallel_for_chunks(int begin, int end, int grain, F func, int max_threads = 0)
+{
+	int count = end - begin;
+	if (count <= 0)
+		return;
+	grain = parallelGrain(count, grain);
+	int num_chunks = (count + grain - 1) / grain;
+	int threads = parallelThreads(num_chunks, max_threads);
+	if (threads == 1) {
+		for (int first = begin; first < end; first += grain)
+			func(first, std::min(first + grain, end));
+		return;
+	}
+
+	//shared with the helpers, the ones that start after this returned only touch this and find no chunks left.
+	//running counts the chunks being done, it goes up before taking one so the wait below can't miss any
+	struct sLoopState {
+		std::atomic<int> next;
+		std::atomic<int> running;
+	};
+	std::shared_ptr<sLoopState> state = std::make_shared<sLoopState>();
+	state->next = 0;
+	state->running = 0;
+	F* f = &func;
+	auto run = [state, f, begin, end, grain, num_chunks]() {
+		while (true) {
+			state->running++;
+			int chunk = state->next++;
+			if (chunk >= num_chunks) {
+				state->running--;
+				return;
+			}
+			int first = begin + chunk * grain;
+			(*f)(first, std::min(first + grain, end));
+			state->running--;
+		}
+	};
+
+	for (int i = 1; i < threads; ++i)
+		JobSystem::instance.add(run, JOB_HIGH);
+	run();
+	//not JobSystem::wait, it would run other jobs on this thread while the last chunks finish
+	while (state->running > 0)
+		std::this_thread::yield();
+}
+
+//func(i) for every i in [begin, end)
+template<typename F> void parallel_for(int begin, int end, int grain, F func, int max_threads = 0)
+{
+	parallel_for_chunks(begin, end, grain, [&func](int first, int last) {
+		for (int i = first; i < last; ++i)
+			func(i);
+	}, max_threads);
+}
+
+//map(first, last) returns the value of a chunk, reduce(a, b) joins two, from the first chunk to the last
+template<typename T, typename M, typename R> T parallel_reduce(int begin, int end, int grain, T identity, M map, R reduce, int max_threads = 0)
+{
+	int count = end - begin;
+	if (count <= 0)
+		return identity;
+	grain = parallelGrain(count, grain);
+	std::vector<T> partials((count + grain - 1) / grain, identity);
+	parallel_for_chunks(begin, end, grain, [&](int first, int last) {
+		partials[(first - begin) / grain] = map(first, last);
+	}, max_threads);
+
+	T result = identity;
+	for (int i = 0; i < partials.size(); ++i)
+		result = reduce(result, partials[i]);
+	return result;
+}
+
+namespace GTR { class Scene; }
+
+//times the loops that use these with 1, 2, 4, 8 and 16 threads, the ones available, and prints the speedups.
+//the CPU probe bake is only timed when there is a scene
+void benchmarkParallel(GTR::Scene* scene = NULL);
@@ -0,0 +1,886 @@
+#include "probebaker.h"
+#include "scene.h"
+#include "prefab.h"
+#include "material.h"
+#include "mesh.h"
+#include "texture.h"
+#include "parallel.h"
+#include "irradiancecache.h"
+#include "gltf_loader.h"
+#include "utils.h"
+
+#include <atomic>
+#include <thread>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define BVH_LEAF_SIZE 4
+#define BVH_BINS 12
+#define RAY_EPSILON 0.01f
+
+#define BAKE_BIN_VERSION 1
+#define BAKE_JOB_FILENAME "bake_job.bin"
+#define BAKE_WORKER_ATTEMPTS 3
+
+std::string GTR::ProbeBaker::executable;
+
+struct sBakeJobHeader {
+	int version;
+	int num_samples;
+	int num_triangles;
+	int num_nodes;
+	int num_materials;
+	int num_lights;
+	int num_probes;
+	Vector3 background;
+	Vector3 ambient;
+	unsigned int checksum; //of the header (with this set to 0) and all the arrays
+};
+
+struct sBakeShardHeader {
+	int version;
+	int shard;
+	int first;
+	int count;
+	unsigned int job_checksum; //shards of another job are never merged
+	unsigned int checksum; //of the SH data
+};
+
+static Vector3 degamma(const Vector3& c) {
+	return Vector3(pow(c.x, 2.2f), pow(c.y, 2.2f), pow(c.z, 2.2f));
+}
+
+//average linear color of an image file, textures do not keep their pixels after the upload
+static Vector3 averageTextureColor(Texture* texture)
+{
+	static std::map<std::string, Vector3> cache;
+	if (!texture || texture->filename.size() <= 4)
+		return Vector3(1, 1, 1);
+
+	auto it = cache.find(texture->filename);
+	if (it != cache.end())
+		return it->second;
+
+	Vector3 color(1, 1, 1);
+	Image image;
+	if (image.load(texture->filename.c_str()) && image.width && image.height) {
+		Vector3 sum;
+		int num_pixels = image.width * image.height;
+		for (int i = 0; i < num_pixels; ++i) {
+			uint8* pixel = image.data + i * image.num_channels;
+			sum = sum + degamma(Vector3(pixel[0], pixel[1], pixel[2]) * (1.0f / 255.0f));
+		}
+		color = sum * (1.0f / num_pixels);
+	}
+	cache[texture->filename] = color;
+	return color;
+}
+
+static void growBounds(Vector3& min, Vector3& max, const Vector3& p) {
+	min.set(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+	max.set(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+}
+
+static float boundsArea(const Vector3& min, const Vector3& max) {
+	Vector3 d = max - min;
+	if (d.x < 0) return 0;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+//distance to the entry point of the box or -1 if it is missed
+static float intersectBounds(const Vector3& origin, const Vector3& inv_dir, const Vector3& min, const Vector3& max, float max_t)
+{
+	float tmin = 0, tmax = max_t;
+	for (int i = 0; i < 3; ++i) {
+		float t0 = (min.v[i] - origin.v[i]) * inv_dir.v[i];
+		float t1 = (max.v[i] - origin.v[i]) * inv_dir.v[i];
+		if (t0 > t1) std::swap(t0, t1);
+		tmin = std::max(tmin, t0);
+		tmax = std::min(tmax, t1);
+		if (tmin > tmax)
+			return -1;
+	}
+	return tmin;
+}
+
+GTR::ProbeBaker::ProbeBaker()
+{
+	num_samples = 512;
+	num_threads = 0;
+}
+
+void GTR::ProbeBaker::build(GTR::Scene* scene)
+{
+	triangles.clear();
+	nodes.clear();
+	materials.clear();
+	lights.clear();
+	background = degamma(scene->background_color);
+	ambient = scene->ambient_light;
+
+	std::vector<GTR::Material*> used;
+	for (int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (!ent->visible)
+			continue;
+
+		if (ent->entity_type == PREFAB)
+		{
+			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
+			if (pent->prefab)
+				addNode(&pent->prefab->root, ent->model, used);
+		}
+		else if (ent->entity_type == LIGHT)
+		{
+			LightEntity* light = (GTR::LightEntity*)ent;
+			sLight l;
+			l.type = light->light_type == DIRECTIONAL ? 0 : (light->light_type == SPOT ? 1 : 2);
+			l.position = light->model * Vector3();
+			l.vector = normalize(l.position - light->target);
+			l.front = normalize(light->model.rotateVector(Vector3(0, 0, -1)));
+			l.color = degamma(light->color) * light->intensity;
+			l.max_distance = light->max_distance;
+			l.cone_cos = cos(light->cone_angle * DEG2RAD);
+			l.cone_exp = light->cone_exp;
+			l.cast_shadows = light->cast_shadows;
+			lights.push_back(l);
+		}
+	}
+
+	initDirections();
+
+	if (triangles.empty())
+		return;
+
+	std::vector<Vector3> centroids(triangles.size());
+	for (int i = 0; i < triangles.size(); ++i) {
+		sTriangle& tri = triangles[i];
+		centroids[i] = tri.v0 + (tri.e1 + tri.e2) * (1.0f / 3.0f);
+	}
+
+	sBVHNode root;
+	root.first = 0;
+	root.count = triangles.size();
+	nodes.reserve(triangles.size() * 2 / BVH_LEAF_SIZE + 1);
+	nodes.push_back(root);
+	buildNode(0, centroids, 0);
+
+	std::cout << " + Probe baker: " << triangles.size() << " triangles, " << nodes.size() << " BVH nodes" << std::endl;
+}
+
+//fixed set of directions, so the result does not depend on the threads or processes
+void GTR::ProbeBaker::initDirections()
+{
+	directions.resize(num_samples);
+	for (int i = 0; i < num_samples; ++i) {
+		float y = 1.0f - 2.0f * (i + 0.5f) / num_samples;
+		float r = sqrt(std::max(0.0f, 1.0f - y * y));
+		float phi = i * 2.39996323f; //golden angle
+		directions[i].set(cos(phi) * r, y, sin(phi) * r);
+	}
+}
+
+void GTR::ProbeBaker::addNode(GTR::Node* node, const Matrix44& prefab_model, std::vector<GTR::Material*>& used)
+{
+	if (!node->visible)
+		return;
+
+	Matrix44 model = node->getGlobalMatrix(true) * prefab_model;
+
+	Mesh* mesh = node->mesh;
+	if (mesh && node->material)
+	{
+		int material = addMaterial(node->material, used);
+		bool interleaved = mesh->interleaved.size() > 0;
+		int num_vertices = interleaved ? mesh->interleaved.size() : mesh->vertices.size();
+		int num_indices = mesh->m_indices.size() ? mesh->m_indices.size() : num_vertices;
+
+		for (int i = 0; i + 2 < num_indices; i += 3)
+		{
+			Vector3 v[3];
+			for (int j = 0; j < 3; ++j) {
+				int index = mesh->m_indices.size() ? mesh->m_indices[i + j] : i + j;
+				v[j] = model * (interleaved ? mesh->interleaved[index].vertex : mesh->vertices[index]);
+			}
+
+			sTriangle tri;
+			tri.v0 = v[0];
+			tri.e1 = v[1] - v[0];
+			tri.e2 = v[2] - v[0];
+			tri.normal = cross(tri.e1, tri.e2);
+			float area = tri.normal.length();
+			if (area < 1e-8f)
+				continue;
+			tri.normal = tri.normal * (1.0f / area);
+			tri.material = material;
+			triangles.push_back(tri);
+		}
+	}
+
+	for (int i = 0; i < node->children.size(); ++i)
+		addNode(node->children[i], prefab_model, used);
+}
+
+int GTR::ProbeBaker::addMaterial(GTR::Material* material, std::vector<GTR::Material*>& used)
+{
+	for (int i = 0; i < used.size(); ++i)
+		if (used[i] == material)
+			return i;
+
+	sMaterial mat;
+	mat.albedo = degamma(material->color.xyz()) * averageTextureColor(material->color_texture.texture);
+	mat.emissive = material->emissive_factor;
+	if (material->emissive_texture.texture)
+		mat.emissive = mat.emissive * averageTextureColor(material->emissive_texture.texture);
+	used.push_back(material);
+	materials.push_back(mat);
+	return materials.size() - 1;
+}
+
+//binned SAH split, falls back to an even split when the bins do not separate the triangles
+void GTR::ProbeBaker::buildNode(int index, std::vector<Vector3>& centroids, int depth)
+{
+	int first = nodes[index].first;
+	int count = nodes[index].count;
+
+	Vector3 min(1e20f, 1e20f, 1e20f), max(-1e20f, -1e20f, -1e20f);
+	Vector3 cmin = min, cmax = max;
+	for (int i = first; i < first + count; ++i) {
+		sTriangle& tri = triangles[i];
+		growBounds(min, max, tri.v0);
+		growBounds(min, max, tri.v0 + tri.e1);
+		growBounds(min, max, tri.v0 + tri.e2);
+		growBounds(cmin, cmax, centroids[i]);
+	}
+	nodes[index].min = min;
+	nodes[index].max = max;
+
+	if (count <= BVH_LEAF_SIZE || depth >= 60)
+		return;
+
+	Vector3 extent = cmax - cmin;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	if (extent[axis] < 1e-6f)
+		return;
+
+	struct sBin { Vector3 min, max; int count; };
+	sBin bins[BVH_BINS];
+	for (int i = 0; i < BVH_BINS; ++i) {
+		bins[i].min.set(1e20f, 1e20f, 1e20f);
+		bins[i].max.set(-1e20f, -1e20f, -1e20f);
+		bins[i].count = 0;
+	}
+	float bin_scale = BVH_BINS / extent[axis];
+	for (int i = first; i < first + count; ++i) {
+		int b = std::min(BVH_BINS - 1, (int)((centroids[i][axis] - cmin[axis]) * bin_scale));
+		sTriangle& tri = triangles[i];
+		growBounds(bins[b].min, bins[b].max, tri.v0);
+		growBounds(bins[b].min, bins[b].max, tri.v0 + tri.e1);
+		growBounds(bins[b].min, bins[b].max, tri.v0 + tri.e2);
+		bins[b].count++;
+	}
+
+	//sweep from the right to get the cost of the right side of every split
+	float right_area[BVH_BINS];
+	int right_count[BVH_BINS];
+	Vector3 rmin(1e20f, 1e20f, 1e20f), rmax(-1e20f, -1e20f, -1e20f);
+	int rcount = 0;
+	for (int i = BVH_BINS - 1; i > 0; --i) {
+		if (bins[i].count) {
+			growBounds(rmin, rmax, bins[i].min);
+			growBounds(rmin, rmax, bins[i].max);
+		}
+		rcount += bins[i].count;
+		right_area[i] = boundsArea(rmin, rmax);
+		right_count[i] = rcount;
+	}
+
+	float best_cost = 1e30f;
+	int best_split = -1;
+	Vector3 lmin(1e20f, 1e20f, 1e20f), lmax(-1e20f, -1e20f, -1e20f);
+	int lcount = 0;
+	for (int i = 1; i < BVH_BINS; ++i) {
+		if (bins[i - 1].count) {
+			growBounds(lmin, lmax, bins[i - 1].min);
+			growBounds(lmin, lmax, bins[i - 1].max);
+		}
+		lcount += bins[i - 1].count;
+		if (!lcount || !right_count[i])
+			continue;
+		float cost = lcount * boundsArea(lmin, lmax) + right_count[i] * right_area[i];
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_split = i;
+		}
+	}
+
+	int mid = first + count / 2;
+	if (best_split != -1)
+	{
+		//not worth splitting small nodes if it is not cheaper than testing all of them
+		if (count <= 16 && best_cost >= count * boundsArea(min, max))
+			return;
+
+		int i = first, j = first + count - 1;
+		while (i <= j) {
+			int b = std::min(BVH_BINS - 1, (int)((centroids[i][axis] - cmin[axis]) * bin_scale));
+			if (b < best_split)
+				i++;
+			else {
+				std::swap(triangles[i], triangles[j]);
+				std::swap(centroids[i], centroids[j]);
+				j--;
+			}
+		}
+		if (i != first && i != first + count)
+			mid = i;
+	}
+
+	int left = nodes.size();
+	sBVHNode child;
+	child.first = first;
+	child.count = mid - first;
+	nodes.push_back(child);
+	child.first = mid;
+	child.count = first + count - mid;
+	nodes.push_back(child);
+	nodes[index].first = left;
+	nodes[index].count = 0;
+
+	buildNode(left, centroids, depth + 1);
+	buildNode(left + 1, centroids, depth + 1);
+}
+
+int GTR::ProbeBaker::intersect(const Vector3& origin, const Vector3& dir, float max_t, float& t, bool any_hit)
+{
+	if (nodes.empty())
+		return -1;
+
+	Vector3 inv_dir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	int hit = -1;
+	t = max_t;
+
+	int stack[64];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size)
+	{
+		sBVHNode& node = nodes[stack[--stack_size]];
+		if (intersectBounds(origin, inv_dir, node.min, node.max, t) < 0)
+			continue;
+
+		if (node.count)
+		{
+			//Moller-Trumbore
+			for (int i = node.first; i < node.first + node.count; ++i) {
+				sTriangle& tri = triangles[i];
+				Vector3 p = cross(dir, tri.e2);
+				float det = dot(tri.e1, p);
+				if (fabs(det) < 1e-10f)
+					continue;
+				float inv_det = 1.0f / det;
+				Vector3 s = origin - tri.v0;
+				float u = dot(s, p) * inv_det;
+				if (u < 0 || u > 1)
+					continue;
+				Vector3 q = cross(s, tri.e1);
+				float v = dot(dir, q) * inv_det;
+				if (v < 0 || u + v > 1)
+					continue;
+				float d = dot(tri.e2, q) * inv_det;
+				if (d > RAY_EPSILON && d < t) {
+					t = d;
+					hit = i;
+					if (any_hit)
+						return hit;
+				}
+			}
+			continue;
+		}
+
+		//visit the closest child first
+		float tl = intersectBounds(origin, inv_dir, nodes[node.first].min, nodes[node.first].max, t);
+		float tr = intersectBounds(origin, inv_dir, nodes[node.first + 1].min, nodes[node.first + 1].max, t);
+		if (tl >= 0 && tr >= 0) {
+			stack[stack_size++] = tl < tr ? node.first + 1 : node.first;
+			stack[stack_size++] = tl < tr ? node.first : node.first + 1;
+		}
+		else if (tl >= 0)
+			stack[stack_size++] = node.first;
+		else if (tr >= 0)
+			stack[stack_size++] = node.first + 1;
+	}
+
+	return hit;
+}
+
+static bool boxesOverlap(const Vector3& min_a, const Vector3& max_a, const Vector3& min_b, const Vector3& max_b)
+{
+	return min_a.x <= max_b.x && max_a.x >= min_b.x && min_a.y <= max_b.y && max_a.y >= min_b.y && min_a.z <= max_b.z && max_a.z >= min_b.z;
+}
+
+bool GTR::ProbeBaker::overlapsBox(const Vector3& min, const Vector3& max)
+{
+	if (nodes.empty())
+		return false;
+
+	int stack[64];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size)
+	{
+		sBVHNode& node = nodes[stack[--stack_size]];
+		if (!boxesOverlap(node.min, node.max, min, max))
+			continue;
+		if (!node.count) {
+			stack[stack_size++] = node.first;
+			stack[stack_size++] = node.first + 1;
+			continue;
+		}
+		for (int i = node.first; i < node.first + node.count; ++i) {
+			sTriangle& tri = triangles[i];
+			Vector3 tmin = tri.v0, tmax = tri.v0;
+			growBounds(tmin, tmax, tri.v0 + tri.e1);
+			growBounds(tmin, tmax, tri.v0 + tri.e2);
+			if (boxesOverlap(tmin, tmax, min, max))
+				return true;
+		}
+	}
+	return false;
+}
+
+//same light model as the shaders: lambert, cubic falloff and spot cone
+Vector3 GTR::ProbeBaker::shade(const Vector3& pos, const Vector3& dir, int triangle)
+{
+	sTriangle& tri = triangles[triangle];
+	sMaterial& mat = materials[tri.material];
+
+	Vector3 N = tri.normal;
+	if (dot(N, dir) > 0)
+		N = N * -1.0f;
+	Vector3 origin = pos + N * RAY_EPSILON;
+
+	Vector3 light = ambient;
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		sLight& l = lights[i];
+		Vector3 L;
+		float distance = 1e10f;
+		float factor = 1.0f;
+		if (l.type == 0)
+			L = l.vector;
+		else {
+			L = l.position - pos;
+			distance = L.length();
+			L = L * (1.0f / distance);
+			float att = std::max((l.max_distance - distance) / l.max_distance, 0.0f);
+			factor = att * att * att;
+			if (l.type == 1 && l.cone_cos > 0) {
+				float spot_cos = dot(l.front, L * -1.0f);
+				factor *= spot_cos >= l.cone_cos ? pow(spot_cos, l.cone_exp) : 0.0f;
+			}
+		}
+
+		float NdotL = dot(N, L);
+		if (NdotL <= 0 || factor <= 0)
+			continue;
+
+		float t;
+		if (l.cast_shadows && intersect(origin, L, distance, t, true) != -1)
+			continue;
+
+		light = light + l.color * (NdotL * factor);
+	}
+
+	return mat.emissive + mat.albedo * light;
+}
+
+SphericalHarmonics GTR::ProbeBaker::bakeProbe(const Vector3& pos)
+{
+	SphericalHarmonics sh;
+	float weight = 4.0f * PI / directions.size();
+	float weightAccum = 0;
+
+	for (int i = 0; i < directions.size(); ++i)
+	{
+		const Vector3& dir = directions[i];
+		float t;
+		int hit = intersect(pos, dir, 1e10f, t);
+		Vector3 value = hit == -1 ? background : shade(pos + dir * t, dir, hit);
+
+		//same weights and normalization as computeSH so both bakes can be mixed
+		float dx = dir.x, dy = dir.y, dz = dir.z;
+		sh.coeffs[0] = sh.coeffs[0] + value * (weight * 4 / 17);
+		sh.coeffs[1] = sh.coeffs[1] + value * (weight * 8 / 17 * dy);
+		sh.coeffs[2] = sh.coeffs[2] + value * (weight * 8 / 17 * dz);
+		sh.coeffs[3] = sh.coeffs[3] + value * (weight * 8 / 17 * dx);
+		sh.coeffs[4] = sh.coeffs[4] + value * (weight * 15 / 17 * dx * dy);
+		sh.coeffs[5] = sh.coeffs[5] + value * (weight * 15 / 17 * dy * dz);
+		sh.coeffs[6] = sh.coeffs[6] + value * (weight * 5 / 68 * (3.0f * dz * dz - 1.0f));
+		sh.coeffs[7] = sh.coeffs[7] + value * (weight * 15 / 17 * dx * dz);
+		sh.coeffs[8] = sh.coeffs[8] + value * (weight * 15 / 68 * (dx * dx - dy * dy));
+		weightAccum += weight * 3.0f;
+	}
+
+	for (int i = 0; i < 9; ++i)
+		sh.coeffs[i] = sh.coeffs[i] * (4 * PI / weightAccum);
+	return sh;
+}
+
+//the probes only read the shared data, one job per probe
+void GTR::ProbeBaker::bake(const Vector3* positions, SphericalHarmonics* result, int count)
+{
+	parallel_for(0, count, 1, [&](int i) { result[i] = bakeProbe(positions[i]); }, num_threads);
+}
+
+//FNV-1a, pass the previous hash to chain several blocks
+unsigned int GTR::ProbeBaker::checksum(const void* data, size_t size, unsigned int hash)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	return hash;
+}
+
+bool GTR::ProbeBaker::saveJob(const char* filename, const Vector3* positions, int count, unsigned int& job_checksum)
+{
+	sBakeJobHeader header;
+	header.version = BAKE_BIN_VERSION;
+	header.num_samples = num_samples;
+	header.num_triangles = triangles.size();
+	header.num_nodes = nodes.size();
+	header.num_materials = materials.size();
+	header.num_lights = lights.size();
+	header.num_probes = count;
+	header.background = background;
+	header.ambient = ambient;
+	header.checksum = 0;
+
+	unsigned int hash = checksum(&header, sizeof(header));
+	hash = checksum(triangles.data(), triangles.size() * sizeof(sTriangle), hash);
+	hash = checksum(nodes.data(), nodes.size() * sizeof(sBVHNode), hash);
+	hash = checksum(materials.data(), materials.size() * sizeof(sMaterial), hash);
+	hash = checksum(lights.data(), lights.size() * sizeof(sLight), hash);
+	hash = checksum(positions, count * sizeof(Vector3), hash);
+	header.checksum = job_checksum = hash;
+
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write bake job: " << filename << std::endl;
+		return false;
+	}
+	fwrite("PBJB", sizeof(char), 4, f);
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(triangles.data(), sizeof(sTriangle), triangles.size(), f);
+	fwrite(nodes.data(), sizeof(sBVHNode), nodes.size(), f);
+	fwrite(materials.data(), sizeof(sMaterial), materials.size(), f);
+	fwrite(lights.data(), sizeof(sLight), lights.size(), f);
+	fwrite(positions, sizeof(Vector3), count, f);
+	fclose(f);
+	return true;
+}
+
+bool GTR::ProbeBaker::loadJob(const char* filename, std::vector<Vector3>& positions, unsigned int& job_checksum)
+{
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+
+	char watermark[4];
+	sBakeJobHeader header;
+	if (fread(watermark, 4, 1, f) != 1 || memcmp(watermark, "PBJB", 4) != 0 ||
+		fread(&header, sizeof(header), 1, f) != 1 || header.version != BAKE_BIN_VERSION)
+	{
+		std::cout << "[ERROR] invalid bake job: " << filename << std::endl;
+		fclose(f);
+		return false;
+	}
+
+	//the counts must fit in what is left of the file before anything is allocated with them
+	long data_start = ftell(f);
+	fseek(f, 0, SEEK_END);
+	long long data_bytes = (long long)ftell(f) - data_start;
+	fseek(f, data_start, SEEK_SET);
+	if (header.num_triangles < 0 || header.num_nodes < 0 || header.num_materials < 0 || header.num_lights < 0 ||
+		header.num_probes < 0 || header.num_samples <= 0 ||
+		(long long)header.num_triangles * sizeof(sTriangle) + (long long)header.num_nodes * sizeof(sBVHNode) +
+		(long long)header.num_materials * sizeof(sMaterial) + (long long)header.num_lights * sizeof(sLight) +
+		(long long)header.num_probes * sizeof(Vector3) != data_bytes)
+	{
+		std::cout << "[ERROR] invalid bake job: " << filename << std::endl;
+		fclose(f);
+		return false;
+	}
+
+	triangles.resize(header.num_triangles);
+	nodes.resize(header.num_nodes);
+	materials.resize(header.num_materials);
+	lights.resize(header.num_lights);
+	positions.resize(header.num_probes);
+	bool ok = fread(triangles.data(), sizeof(sTriangle), triangles.size(), f) == triangles.size() &&
+		fread(nodes.data(), sizeof(sBVHNode), nodes.size(), f) == nodes.size() &&
+		fread(materials.data(), sizeof(sMaterial), materials.size(), f) == materials.size() &&
+		fread(lights.data(), sizeof(sLight), lights.size(), f) == lights.size() &&
+		fread(positions.data(), sizeof(Vector3), positions.size(), f) == positions.size();
+	fclose(f);
+
+	job_checksum = header.checksum;
+	header.checksum = 0;
+	unsigned int hash = checksum(&header, sizeof(header));
+	hash = checksum(triangles.data(), triangles.size() * sizeof(sTriangle), hash);
+	hash = checksum(nodes.data(), nodes.size() * sizeof(sBVHNode), hash);
+	hash = checksum(materials.data(), materials.size() * sizeof(sMaterial), hash);
+	hash = checksum(lights.data(), lights.size() * sizeof(sLight), hash);
+	hash = checksum(positions.data(), positions.size() * sizeof(Vector3), hash);
+	if (!ok || hash != job_checksum)
+	{
+		std::cout << "[ERROR] corrupted bake job: " << filename << std::endl;
+		return false;
+	}
+
+	num_samples = header.num_samples;
+	background = header.background;
+	ambient = header.ambient;
+	initDirections();
+	return true;
+}
+
+static std::string shardFilename(int shard)
+{
+	return "bake_shard_" + std::to_string(shard) + ".bin";
+}
+
+//only accepts a complete shard of the given job with the expected range
+static bool readShard(int shard, unsigned int job_checksum, int first, int count, SphericalHarmonics* result)
+{
+	FILE* f = fopen(shardFilename(shard).c_str(), "rb");
+	if (f == NULL)
+		return false;
+
+	char watermark[4];
+	sBakeShardHeader header;
+	std::vector<SphericalHarmonics> data(count);
+	bool ok = fread(watermark, 4, 1, f) == 1 && memcmp(watermark, "PBSH", 4) == 0 &&
+		fread(&header, sizeof(header), 1, f) == 1 && header.version == BAKE_BIN_VERSION &&
+		header.job_checksum == job_checksum && header.shard == shard && header.first == first && header.count == count &&
+		fread(data.data(), sizeof(SphericalHarmonics), count, f) == count &&
+		GTR::ProbeBaker::checksum(data.data(), count * sizeof(SphericalHarmonics)) == header.checksum;
+	fclose(f);
+
+	if (ok)
+		memcpy(result, data.data(), count * sizeof(SphericalHarmonics));
+	return ok;
+}
+
+static void shardRange(int shard, int num_shards, int count, int& first, int& shard_count)
+{
+	first = (int)((long long)count * shard / num_shards);
+	shard_count = (int)((long long)count * (shard + 1) / num_shards) - first;
+}
+
+int GTR::ProbeBaker::runWorker(const char* job_filename, int shard, int num_shards, int threads)
+{
+	ProbeBaker baker;
+	std::vector<Vector3> positions;
+	unsigned int job_checksum;
+	if (!baker.loadJob(job_filename, positions, job_checksum) || shard < 0 || shard >= num_shards)
+		return 1;
+
+	int first, count;
+	shardRange(shard, num_shards, positions.size(), first, count);
+	std::vector<SphericalHarmonics> result(count);
+	baker.num_threads = threads;
+	if (threads != 1)
+		JobSystem::instance.start(threads - 1); //the bake runs on the workers and this thread
+	if (count)
+		baker.bake(&positions[first], &result[0], count);
+
+	sBakeShardHeader header;
+	header.version = BAKE_BIN_VERSION;
+	header.shard = shard;
+	header.first = first;
+	header.count = count;
+	header.job_checksum = job_checksum;
+	header.checksum = checksum(result.data(), count * sizeof(SphericalHarmonics));
+
+	//written aside and renamed, so a killed worker never leaves a shard with the final name
+	std::string filename = shardFilename(shard);
+	std::string temp_filename = filename + ".tmp";
+	FILE* f = fopen(temp_filename.c_str(), "wb");
+	if (f == NULL)
+		return 1;
+	fwrite("PBSH", sizeof(char), 4, f);
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(result.data(), sizeof(SphericalHarmonics), count, f);
+	fclose(f);
+
+	remove(filename.c_str());
+	return rename(temp_filename.c_str(), filename.c_str()) == 0 ? 0 : 1;
+}
+
+int GTR::ProbeBaker::runCommandLine(int argc, char** argv)
+{
+	//the same grid as Renderer::generateProbes
+	std::string scene_filename = "data/scene.json";
+	std::string output_filename = "irradiance.bin";
+	Vector3 start_pos(-300, 5, -300);
+	Vector3 end_pos(300, 150, 300);
+	int dims[3] = { 12, 6, 12 };
+	int num_samples = -1;
+	int threads = 0;
+	int num_workers = 0;
+	int flags = IRR_HALF;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--bake")
+			continue;
+		else if (arg == "-scene" && has_value)
+			scene_filename = argv[++i];
+		else if (arg == "-out" && has_value)
+			output_filename = argv[++i];
+		else if (arg == "-dims" && has_value) {
+			if (sscanf(argv[++i], "%dx%dx%d", &dims[0], &dims[1], &dims[2]) != 3 || dims[0] < 2 || dims[1] < 2 || dims[2] < 2)
+				return 1;
+		}
+		else if (arg == "-samples" && has_value)
+			num_samples = std::max(1, atoi(argv[++i]));
+		else if (arg == "-threads" && has_value)
+			threads = std::max(0, atoi(argv[++i]));
+		else if (arg == "-workers" && has_value)
+			num_workers = std::max(1, atoi(argv[++i]));
+		else if (arg == "-float")
+			flags &= ~IRR_HALF;
+		else if (arg == "-compress")
+			flags |= IRR_COMPRESSED;
+		else {
+			std::cout << "[ERROR] unknown bake argument: " << arg << std::endl;
+			return 1;
+		}
+	}
+
+	//nothing may touch GL, there is no context
+	Mesh::auto_upload_to_vram = false;
+	upload_textures = false;
+	GTR::Scene scene;
+	if (!scene.load(scene_filename.c_str()))
+	{
+		std::cout << "[ERROR] cannot load scene: " << scene_filename << std::endl;
+		return 1;
+	}
+
+	if (threads != 1)
+		JobSystem::instance.start(threads ? threads - 1 : 0); //the bake runs on the workers and this thread
+
+	long start_time = getTime();
+	ProbeBaker baker;
+	if (num_samples > 0)
+		baker.num_samples = num_samples;
+	baker.num_threads = threads;
+	baker.build(&scene);
+
+	Vector3 delta = end_pos - start_pos;
+	delta.x /= (dims[0] - 1);
+	delta.y /= (dims[1] - 1);
+	delta.z /= (dims[2] - 1);
+	std::vector<Vector3> positions;
+	for (int z = 0; z < dims[2]; ++z)
+		for (int y = 0; y < dims[1]; ++y)
+			for (int x = 0; x < dims[0]; ++x)
+				positions.push_back(start_pos + delta * Vector3(x, y, z));
+
+	std::vector<SphericalHarmonics> result(positions.size());
+	if (num_workers > 0) {
+		if (!baker.bakeDistributed(&positions[0], &result[0], positions.size(), num_workers, num_workers * 4))
+			return 1;
+	}
+	else
+		baker.bake(&positions[0], &result[0], positions.size());
+	std::cout << positions.size() << " probes baked on the CPU in " << (getTime() - start_time) << " ms" << std::endl;
+
+	Vector3 dim_pos(dims[0], dims[1], dims[2]);
+	return IrradianceCache::save(output_filename.c_str(), start_pos, end_pos, dim_pos, &result[0], result.size(), flags) ? 0 : 1;
+}
+
+//the workers are local processes of this same program; they only need the job file,
+//so running them on other machines is a matter of copying it there and the shards back
+bool GTR::ProbeBaker::bakeDistributed(const Vector3* positions, SphericalHarmonics* result, int count, int num_workers, int num_shards)
+{
+	if (executable.empty())
+	{
+		std::cout << "[ERROR] bake workers need ProbeBaker::executable" << std::endl;
+		return false;
+	}
+
+	num_workers = std::max(1, num_workers);
+	num_shards = std::max(1, std::min(num_shards, count));
+
+	unsigned int job_checksum;
+	if (!saveJob(BAKE_JOB_FILENAME, positions, count, job_checksum))
+		return false;
+
+	//resume: shards left by a previous run of this same job are kept
+	std::vector<int> pending;
+	for (int i = 0; i < num_shards; ++i) {
+		int first, shard_count;
+		shardRange(i, num_shards, count, first, shard_count);
+		if (!readShard(i, job_checksum, first, shard_count, result + first))
+			pending.push_back(i);
+	}
+	if (pending.size() < num_shards)
+		std::cout << " + Probe baker: resuming, " << (num_shards - pending.size()) << " of " << num_shards << " shards already baked" << std::endl;
+
+	//workers share the cores of this machine
+	int threads = std::max(1, (int)std::thread::hardware_concurrency() / num_workers);
+
+	std::atomic<int> next(0);
+	std::atomic<int> failed(0);
+	auto launcher = [&]() {
+		int i;
+		while ((i = next++) < (int)pending.size())
+		{
+			int shard = pending[i];
+			int first, shard_count;
+			shardRange(shard, num_shards, count, first, shard_count);
+
+			std::string command = "\"" + executable + "\" --bake-worker " BAKE_JOB_FILENAME " " +
+				std::to_string(shard) + " " + std::to_string(num_shards) + " " + std::to_string(threads);
+#ifdef WIN32
+			command = "\"" + command + "\""; //cmd.exe strips the outer quotes
+#endif
+			bool done = false;
+			for (int attempt = 0; attempt < BAKE_WORKER_ATTEMPTS && !done; ++attempt) {
+				int code = system(command.c_str());
+				done = code == 0 && readShard(shard, job_checksum, first, shard_count, result + first);
+				if (!done)
+					std::cout << "[WARN] bake worker of shard " << shard << " failed (" << code << ")" << std::endl;
+			}
+			if (!done)
+				failed++;
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (int i = 0; i < std::min(num_workers, (int)pending.size()); ++i)
+		pool.push_back(std::thread(launcher));
+	for (int i = 0; i < pool.size(); ++i)
+		pool[i].join();
+
+	if (failed)
+	{
+		std::cout << "[ERROR] " << failed << " shards could not be baked, bake again to resume" << std::endl;
+		return false;
+	}
+
+	for (int i = 0; i < num_shards; ++i)
+		remove(shardFilename(i).c_str());
+	remove(BAKE_JOB_FILENAME);
+	return true;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include "framework.h"
+#include "sphericalharmonics.h"
+#include <vector>
+#include <string>
+
+namespace GTR {
+	class Scene;
+	class Node;
+	class Material;
+
+	// Bakes irradiance probes on the CPU by ray casting the scene triangles through a BVH.
+	// Only uses the mesh data kept in RAM and the image files of the textures, so it needs no GL context.
+	class ProbeBaker
+	{
+	public:
+		struct sTriangle {
+			Vector3 v0;
+			Vector3 e1; //v1 - v0
+			Vector3 e2; //v2 - v0
+			Vector3 normal;
+			int material; //index in materials
+		};
+
+		//inner nodes have count 0 and their children at first and first + 1
+		struct sBVHNode {
+			Vector3 min;
+			Vector3 max;
+			int first;
+			int count;
+		};
+
+		struct sMaterial {
+			Vector3 albedo; //linear, already multiplied by the average texture color
+			Vector3 emissive;
+		};
+
+		struct sLight {
+			int type; //0 directional, 1 spot, 2 point, like the shaders
+			Vector3 position;
+			Vector3 vector; //towards the light for directionals
+			Vector3 front;
+			Vector3 color; //linear color * intensity
+			float max_distance;
+			float cone_cos;
+			float cone_exp;
+			int cast_shadows; //int so the struct has no padding in the job file
+		};
+
+		std::vector<sTriangle> triangles;
+		std::vector<sBVHNode> nodes;
+		std::vector<sMaterial> materials;
+		std::vector<sLight> lights;
+		Vector3 background;
+		Vector3 ambient;
+
+		int num_samples; //rays per probe
+		int num_threads; //0 uses all the cores
+
+		static std::string executable; //path of this program, to launch the bake workers
+
+		ProbeBaker();
+
+		//gathers triangles, materials and lights and builds the BVH
+		void build(GTR::Scene* scene);
+
+		//computes the SH of count probes, spreading them across the threads
+		void bake(const Vector3* positions, SphericalHarmonics* result, int count);
+		SphericalHarmonics bakeProbe(const Vector3& pos);
+
+		//closest hit when any_hit is false, returns the triangle index or -1
+		int intersect(const Vector3& origin, const Vector3& dir, float max_t, float& t, bool any_hit = false);
+		//true if the bounds of any triangle touch the box
+		bool overlapsBox(const Vector3& min, const Vector3& max);
+
+		//distributed bake: the built scene and the probe positions go to a job file, every worker process
+		//bakes some shards of it into shard files and the coordinator merges them.
+		//shards already baked for the same job are reused, so calling it again resumes a failed bake
+		bool bakeDistributed(const Vector3* positions, SphericalHarmonics* result, int count, int num_workers, int num_shards);
+		bool saveJob(const char* filename, const Vector3* positions, int count, unsigned int& job_checksum);
+		bool loadJob(const char* filename, std::vector<Vector3>& positions, unsigned int& job_checksum);
+
+		//entry point of a worker process (--bake-worker job shard num_shards threads), returns the exit code
+		static int runWorker(const char* job_filename, int shard, int num_shards, int threads);
+		//bakes the probe grid of a scene without a window nor a GL context, the meshes stay in RAM and the
+		//textures are only read for their average color. Returns the exit code.
+		//usage: --bake [-scene file.json] [-out irradiance.bin] [-dims NXxNYxNZ] [-samples N] [-threads N] [-workers N] [-float] [-compress]
+		static int runCommandLine(int argc, char** argv);
+
+		static unsigned int checksum(const void* data, size_t size, unsigned int hash = 2166136261u);
+
+	private:
+		std::vector<Vector3> directions;
+
+		void initDirections();
+		void addNode(GTR::Node* node, const Matrix44& prefab_model, std::vector<GTR::Material*>& used);
+		int addMaterial(GTR::Material* material, std::vector<GTR::Material*>& used);
+		void buildNode(int index, std::vector<Vector3>& centroids, int depth);
+		Vector3 shade(const Vector3& pos, const Vector3& dir, int triangle);
+	};
+};
@@ -0,0 +1,151 @@
+#include "readback.h"
+#include "texture.h"
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+
+ReadbackQueue::ReadbackQueue(int num_buffers)
+{
+	buffers.resize(num_buffers);
+	for (int i = 0; i < num_buffers; ++i)
+	{
+		sReadback& buffer = buffers[i];
+		buffer.pbo = 0;
+		buffer.fence = 0;
+		buffer.bytes = buffer.capacity = 0;
+	}
+	next = 0;
+	num_pending = 0;
+}
+
+ReadbackQueue::~ReadbackQueue()
+{
+	for (int i = 0; i < buffers.size(); ++i)
+	{
+		if (buffers[i].fence)
+			glDeleteSync(buffers[i].fence);
+		if (buffers[i].pbo)
+			glDeleteBuffers(1, &buffers[i].pbo);
+	}
+}
+
+int ReadbackQueue::bytesPerPixel(GLenum format, GLenum type)
+{
+	int channels = 4;
+	switch (format)
+	{
+		case GL_RED: case GL_DEPTH_COMPONENT: channels = 1; break;
+		case GL_RG: channels = 2; break;
+		case GL_RGB: case GL_BGR: channels = 3; break;
+	}
+	switch (type)
+	{
+		case GL_FLOAT: case GL_UNSIGNED_INT: case GL_INT: return channels * 4;
+		case GL_HALF_FLOAT: case GL_UNSIGNED_SHORT: case GL_SHORT: return channels * 2;
+	}
+	return channels;
+}
+
+//the slot after the last submitted one, if it is still in flight we have to wait for it
+ReadbackQueue::sReadback& ReadbackQueue::acquire(int bytes)
+{
+	int index = (next + num_pending) % buffers.size();
+	if (num_pending == buffers.size())
+	{
+		complete(buffers[next]);
+		index = (next + num_pending) % buffers.size();
+	}
+
+	sReadback& buffer = buffers[index];
+	if (!buffer.pbo)
+		glGenBuffers(1, &buffer.pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.pbo);
+	if (buffer.capacity < bytes)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+		buffer.capacity = bytes;
+	}
+	buffer.bytes = bytes;
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	return buffer;
+}
+
+void ReadbackQueue::submit(sReadback& buffer, Callback callback)
+{
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	buffer.callback = callback;
+	num_pending++;
+}
+
+bool ReadbackQueue::readTexture(Texture* texture, Callback callback, GLenum format, GLenum type, int face, int level)
+{
+	assert(texture);
+	int width = std::max(1, (int)texture->width >> level);
+	int height = std::max(1, (int)texture->height >> level);
+	GLenum target = face >= 0 ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+	if ((face >= 0) != (texture->texture_type == GL_TEXTURE_CUBE_MAP))
+		return false;
+
+	sReadback& buffer = acquire(width * height * bytesPerPixel(format, type));
+	texture->bind();
+	glGetTexImage(target, level, format, type, 0); //into the buffer, returns right away
+	texture->unbind();
+	submit(buffer, callback);
+	return true;
+}
+
+bool ReadbackQueue::readScreen(int x, int y, int width, int height, Callback callback, GLenum format, GLenum type)
+{
+	if (width <= 0 || height <= 0)
+		return false;
+	sReadback& buffer = acquire(width * height * bytesPerPixel(format, type));
+	glReadPixels(x, y, width, height, format, type, 0);
+	submit(buffer, callback);
+	return true;
+}
+
+bool ReadbackQueue::isDone(sReadback& buffer, bool wait)
+{
+	GLenum result = glClientWaitSync(buffer.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0);
+	if (result == GL_WAIT_FAILED)
+		std::cout << "[WARN] readback fence failed" << std::endl;
+	return result != GL_TIMEOUT_EXPIRED;
+}
+
+//maps the buffer and hands the data to the callback, waits for the fence if needed
+void ReadbackQueue::complete(sReadback& buffer)
+{
+	while (!isDone(buffer, true));
+	glDeleteSync(buffer.fence);
+	buffer.fence = 0;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.pbo);
+	void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, buffer.bytes, GL_MAP_READ_BIT);
+	if (data)
+	{
+		if (buffer.callback)
+			buffer.callback(data, buffer.bytes);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	else
+		std::cout << "[WARN] could not map readback buffer" << std::endl;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	buffer.callback = NULL;
+	next = (next + 1) % buffers.size();
+	num_pending--;
+}
+
+void ReadbackQueue::update()
+{
+	while (num_pending && isDone(buffers[next], false))
+		complete(buffers[next]);
+}
+
+void ReadbackQueue::flush()
+{
+	while (num_pending)
+		complete(buffers[next]);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "includes.h"
+#include <vector>
+#include <functional>
+
+class Texture;
+
+// Reads textures or the screen back without stalling. Every read is copied into a pixel buffer object
+// and fenced; update() maps the ones the GPU has finished (usually a frame later) and calls their callback.
+// The buffers are a ring that is reused, when all of them are busy the oldest one is waited for.
+class ReadbackQueue
+{
+public:
+	//data is only valid during the call
+	typedef std::function<void(const void* data, int bytes)> Callback;
+
+	ReadbackQueue(int num_buffers = 8);
+	~ReadbackQueue();
+
+	//face is the cubemap face (-1 for 2D textures)
+	bool readTexture(Texture* texture, Callback callback, GLenum format = GL_RGBA, GLenum type = GL_UNSIGNED_BYTE, int face = -1, int level = 0);
+	//region of the framebuffer bound for reading
+	bool readScreen(int x, int y, int width, int height, Callback callback, GLenum format = GL_RGBA, GLenum type = GL_UNSIGNED_BYTE);
+
+	void update(); //calls the callbacks of the reads already done, never blocks
+	void flush(); //waits for all the pending reads
+	int pending() { return num_pending; }
+
+	static int bytesPerPixel(GLenum format, GLenum type);
+
+private:
+	struct sReadback {
+		GLuint pbo;
+		GLsync fence;
+		int bytes;
+		int capacity;
+		Callback callback;
+	};
+	std::vector<sReadback> buffers;
+	int next; //oldest submitted read, the reads complete in order
+	int num_pending;
+
+	sReadback& acquire(int bytes);
+	void submit(sReadback& buffer, Callback callback);
+	void complete(sReadback& buffer);
+	bool isDone(sReadback& buffer, bool wait);
+};
@@ -0,0 +1,227 @@
+#include "reflectionprobes.h"
+#include "renderer.h"
+#include "scene.h"
+#include "camera.h"
+#include "texture.h"
+#include "cubecapture.h"
+#include "shader.h"
+#include "mesh.h"
+#include "sphericalharmonics.h"
+#include <algorithm>
+
+GTR::ReflectionProbeManager::ReflectionProbeManager()
+{
+	size = 256;
+	levels = 6;
+	max_probes = 16;
+	steps_per_frame = 2;
+	auto_refresh = false;
+	cubemaps = NULL;
+	capture = NULL;
+	prefilter_fbo = 0;
+	frame = 0;
+	current = -1;
+	step = 0;
+}
+
+GTR::ReflectionProbeManager::~ReflectionProbeManager()
+{
+	if (capture)
+		delete capture;
+	if (cubemaps)
+		delete cubemaps;
+	if (prefilter_fbo)
+		glDeleteFramebuffers(1, &prefilter_fbo);
+}
+
+//slots of entities that left the scene are dropped, the ones after them move to other layers and are captured again
+void GTR::ReflectionProbeManager::removeMissing(Scene* scene)
+{
+	std::vector<sReflectionSlot> kept;
+	for (int i = 0; i < slots.size(); ++i)
+	{
+		if (std::find(scene->entities.begin(), scene->entities.end(), (BaseEntity*)slots[i].entity) == scene->entities.end())
+			continue;
+		sReflectionSlot slot = slots[i];
+		if (kept.size() != i) {
+			slot.valid = false;
+			slot.dirty = true;
+		}
+		kept.push_back(slot);
+	}
+	if (kept.size() == slots.size())
+		return;
+	slots = kept;
+	current = -1;
+}
+
+void GTR::ReflectionProbeManager::addProbes(Scene* scene)
+{
+	for (int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (ent->entity_type != eEntityType::REFLECTION_PROBE || getSlot((ReflectionProbeEntity*)ent) != -1)
+			continue;
+		if (slots.size() == max_probes) {
+			std::cout << "[WARN] too many reflection probes, max is " << max_probes << std::endl;
+			return;
+		}
+		sReflectionSlot slot;
+		slot.entity = (ReflectionProbeEntity*)ent;
+		slot.valid = false;
+		slot.dirty = true;
+		slot.last_update = 0;
+		slots.push_back(slot);
+	}
+}
+
+int GTR::ReflectionProbeManager::getSlot(ReflectionProbeEntity* entity) const
+{
+	for (int i = 0; i < slots.size(); ++i)
+		if (slots[i].entity == entity)
+			return i;
+	return -1;
+}
+
+void GTR::ReflectionProbeManager::refreshAll()
+{
+	for (int i = 0; i < slots.size(); ++i)
+		slots[i].dirty = true;
+}
+
+void GTR::ReflectionProbeManager::clear()
+{
+	slots.clear();
+	current = -1;
+}
+
+//dirty probes go first, then the ones that have waited longer, weighted by how close they are
+int GTR::ReflectionProbeManager::pickNext(Camera* camera) const
+{
+	int best = -1;
+	float best_score = 0;
+	for (int i = 0; i < slots.size(); ++i)
+	{
+		const sReflectionSlot& slot = slots[i];
+		if (!slot.entity->visible || (!slot.dirty && !auto_refresh))
+			continue;
+		float distance = slot.entity->model.getTranslation().distance(camera->eye);
+		float score = (frame - slot.last_update) / (1.0f + distance / slot.entity->radius);
+		if (slot.dirty)
+			score += 1000000.0f;
+		if (best == -1 || score > best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+void GTR::ReflectionProbeManager::update(Renderer* renderer, Scene* scene, Camera* camera)
+{
+	frame++;
+	removeMissing(scene);
+	addProbes(scene);
+	if (slots.empty())
+		return;
+
+	if (!cubemaps) {
+		cubemaps = new Texture();
+		cubemaps->createCubemapArray(size, max_probes, levels, GL_RGBA, GL_HALF_FLOAT);
+		capture = new CubeCapture(size, GL_HALF_FLOAT);
+		glGenFramebuffers(1, &prefilter_fbo);
+	}
+
+	for (int i = 0; i < steps_per_frame; ++i)
+	{
+		if (current == -1) {
+			current = pickNext(camera);
+			step = 0;
+			if (current == -1)
+				return;
+		}
+
+		//the six faces and then the mips, every one reads the previous level
+		if (step < 6)
+			captureFace(renderer, scene, current, step);
+		else
+			prefilterLevel(current, step - 5);
+
+		if (++step == 6 + levels - 1) {
+			sReflectionSlot& slot = slots[current];
+			slot.valid = true;
+			slot.dirty = false;
+			slot.last_update = frame;
+			current = -1;
+		}
+	}
+}
+
+void GTR::ReflectionProbeManager::captureFace(Renderer* renderer, Scene* scene, int slot, int face)
+{
+	capture->render(renderer, scene, slots[slot].entity->model.getTranslation(), 0.1, 1000, 1 << face);
+	capture->copyTo(cubemaps, slot * 6, 1 << face);
+}
+
+//GGX filtered level from the previous one, only that level is visible to the sampler while this one is written
+void GTR::ReflectionProbeManager::prefilterLevel(int slot, int level)
+{
+	Shader* shader = Shader::Get("reflection_prefilter");
+	if (!shader)
+		return;
+	Mesh* quad = Mesh::getQuad();
+	int level_size = std::max(size >> level, 1);
+
+	cubemaps->bind();
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_BASE_LEVEL, level - 1);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAX_LEVEL, level - 1);
+	cubemaps->unbind();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, prefilter_fbo);
+	glPushAttrib(GL_VIEWPORT_BIT);
+	glViewport(0, 0, level_size, level_size);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	glDisable(GL_CULL_FACE);
+
+	shader->enable();
+	shader->setUniform("u_texture", cubemaps, 0);
+	shader->setUniform("u_layer", (float)slot);
+	shader->setUniform("u_roughness", level / (float)(levels - 1));
+
+	Camera camera;
+	camera.setPerspective(90, 1, 0.1, 10);
+	for (int face = 0; face < 6; ++face)
+	{
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, cubemaps->texture_id, level, slot * 6 + face);
+		camera.lookAt(Vector3(), cubemapFaceNormals[face][2], cubemapFaceNormals[face][1]);
+		Matrix44 inv_vp = camera.viewprojection_matrix;
+		inv_vp.inverse();
+		shader->setUniform("u_inverse_viewprojection", inv_vp);
+		quad->render(GL_TRIANGLES);
+	}
+	shader->disable();
+
+	glPopAttrib();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+
+	cubemaps->bind();
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	cubemaps->unbind();
+}
+
+int GTR::ReflectionProbeManager::findNearest(Vector3 pos, int* result, int max) const
+{
+	std::vector<std::pair<float, int> > candidates;
+	for (int i = 0; i < slots.size(); ++i)
+		if (slots[i].valid && slots[i].entity->visible)
+			candidates.push_back(std::make_pair(slots[i].entity->model.getTranslation().distance(pos), i));
+	int count = std::min((int)candidates.size(), max);
+	std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end());
+	for (int i = 0; i < count; ++i)
+		result[i] = candidates[i].second;
+	return count;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+#define MAX_BLENDED_REFLECTION_PROBES 4
+
+class Texture;
+class Camera;
+
+namespace GTR {
+	class Scene;
+	class Renderer;
+	class ReflectionProbeEntity;
+	class CubeCapture;
+
+	//state of one probe in the array, its layers are slot * 6 .. slot * 6 + 5
+	struct sReflectionSlot {
+		ReflectionProbeEntity* entity;
+		bool valid; //all its faces and mips have been written once
+		bool dirty; //waiting for a refresh
+		int last_update; //frame of the last finished refresh
+	};
+
+	// Keeps all the reflection probes in one cubemap array and refreshes them a few steps per frame.
+	// A refresh is one step per face capture followed by one per roughness mip, the faces go through the
+	// layered capture pass with only their bit in the face mask
+	class ReflectionProbeManager
+	{
+	public:
+		int size; //of every face
+		int levels; //mips, the last one is the roughest
+		int max_probes;
+		int steps_per_frame; //faces captured and prefilter levels done every frame
+		bool auto_refresh; //keep refreshing the probes by priority, otherwise only the dirty ones
+
+		Texture* cubemaps; //GL_TEXTURE_CUBE_MAP_ARRAY
+		std::vector<sReflectionSlot> slots;
+
+		ReflectionProbeManager();
+		~ReflectionProbeManager();
+
+		//follows the probes added to or removed from the scene and spends the budget of this frame
+		void update(Renderer* renderer, Scene* scene, Camera* camera);
+		//refreshes all of them over the next frames
+		void refreshAll();
+		//forgets all the probes, when the scene is reloaded
+		void clear();
+		//valid probes closest to pos, returns how many were written
+		int findNearest(Vector3 pos, int* result, int max) const;
+		int getSlot(ReflectionProbeEntity* entity) const;
+
+	private:
+		CubeCapture* capture;
+		unsigned int prefilter_fbo;
+		int frame;
+		int current; //slot being refreshed, -1 when idle
+		int step;
+
+		void removeMissing(Scene* scene);
+		void addProbes(Scene* scene);
+		int pickNext(Camera* camera) const;
+		void captureFace(Renderer* renderer, Scene* scene, int slot, int face);
+		void prefilterLevel(int slot, int level);
+	};
+};
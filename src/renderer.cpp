@@ -9,44 +9,142 @@
 #include "material.h"
 #include "utils.h"
 #include "scene.h"
+#include "probebaker.h"
+#include "irradiancecache.h"
+#include "cubecapture.h"
 #include "application.h"
 #include "extra/hdre.h"
+#include "parallel.h"
 #include <algorithm>
 
 
 using namespace GTR;
 
+//radical inverse, used for the sub-pixel jitter of the temporal upscale
+static float halton(int index, int base) {
+	float f = 1.0;
+	float r = 0.0;
+	while (index > 0) {
+		f /= base;
+		r += f * (index % base);
+		index /= base;
+	}
+	return r;
+}
+
+//Projection into the uv space of a target where the image only fills the lower left uv_scale part,
+//for the passes that read the targets with gl_FragCoord
+static Matrix44 uvScaleMatrix(Vector2 uv_scale) {
+	Matrix44 m;
+	m.m[0] = uv_scale.x;
+	m.m[5] = uv_scale.y;
+	m.m[12] = uv_scale.x - 1.0;
+	m.m[13] = uv_scale.y - 1.0;
+	return m;
+}
+
 GTR::Renderer::Renderer() {
 	direct_light = NULL;
+	current_scene = NULL;
 	pipeline = DEFERRED;
 	light_render = MULTIPASS;
 	gbuffers_fbo = NULL;
 	illumination_fbo = NULL;
 	ssao_fbo = NULL;
-	decals_fbo = NULL;
+	decal_atlas = NULL;
+	decal_atlas_used = 0;
+	decals_drawn = decals_over_limit = decals_without_cell = 0;
+	decal_tiles = NULL;
 	volumetric_fbo = NULL;
+	volumetric_froxels = false;
+	froxel_max_distance = 500.0;
+	froxel_fbo = NULL;
+	froxel_scatter = NULL;
+	froxel_historyA = NULL;
+	froxel_historyB = NULL;
+	froxel_integrated = NULL;
+	froxel_carryA = NULL;
+	froxel_carryB = NULL;
+	froxel_integrate_fbo = 0;
 	show_gbuffers = false;
 	show_ssao = false;
 	ssaoplus = false;
+	ssao_half_res = false;
+	compact_formats = false;
+	compare_formats = false;
+	targets_compact = false;
+	memset(&stored_targets, 0, sizeof(stored_targets));
+	compare_texture = NULL;
+	dynamic_resolution = false;
+	target_frame_ms = 16.0;
+	min_render_scale = 0.5;
+	max_render_scale = 1.0;
+	render_scale = 1.0;
+	gpu_frame_ms = 0.0;
+	render_width = Application::instance->window_width;
+	render_height = Application::instance->window_height;
+	memset(gpu_time_queries, 0, sizeof(gpu_time_queries));
+	query_index = 0;
+	queries_issued = 0;
+	scale_cooldown = 0;
+	output_width = render_width;
+	output_height = render_height;
+	render_target_width = output_target_width = render_width;
+	render_target_height = output_target_height = render_height;
+	render_uv_scale = output_uv_scale = Vector2(1.0, 1.0);
+	last_render_uv_scale = last_output_uv_scale = Vector2(1.0, 1.0);
+	taa_upscale = false;
+	taa_render_scale = 0.67;
+	taa_frame = 0;
+	taa_historyA = NULL;
+	taa_historyB = NULL;
 	show_irr_texture = false;
 	motion_blur = false;
 	chr_lns = false;
 	ffxa = false;
 	dof = false;
 	bloom = false;
+	auto_exposure = false;
 	is_rendering_reflections = false;
 	interpolated_irr = false;
+	cpu_probe_bake = false;
+	parallel_recording = false;
+	record_threads = 0;
+	cpu_raster = false;
+	soft_rasterizer = NULL;
+	cpu_raster_texture = NULL;
+	bake_workers = 0;
+	irr_half_floats = true;
+	adaptive_probes = false;
+	probe_max_depth = 3;
+	irr_indirection = NULL;
+	irr_volume = NULL;
+	use_irr_volume = false;
+	forward_probe_sh = false;
+	irr_compress = false;
+	rebake_radius = 100;
 	ssao_blur = NULL;
-	irr_fbo = NULL;
+	ssao_half_depth = NULL;
+	ssao_half_texture = NULL;
+	ssao_historyA = NULL;
+	ssao_historyB = NULL;
+	irr_capture = NULL;
 	probes_texture = NULL;
+	probes_rows = 0;
 	postFX_textureA = NULL;
 	postFX_textureB = NULL;
 	postFX_textureC = NULL;
 	postFX_textureD = NULL;
 	blurred_texture = NULL;
+	log_lum_texture = NULL;
+	exposure_textureA = NULL;
+	exposure_textureB = NULL;
 	average_lum = 1.0;
 	lum_white = 1.0;
 	lum_scale = 1.0;
+	exposure_speed = 1.5;
+	min_exposure_lum = 0.05;
+	max_exposure_lum = 20.0;
 	min_distance_dof = 70.0;
 	max_distance_dof = 230.0;
 
@@ -59,14 +157,16 @@ GTR::Renderer::Renderer() {
 
 	reflection_fbo = new FBO();
 	reflection_fbo->create(Application::instance->window_width, Application::instance->window_height);
-	reflection_probe_fbo = new FBO();
-	probe = NULL;
 
 	skybox = CubemapFromHDRE("data/night.hdre");
 	cube.createCube();
 
+	//filter across the faces, the low mips of the reflection probes show the seams otherwise
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
 	ssao_random_points = generateSpherePoints(128, 1, false);
 	ssaoplus_random_points = generateSpherePoints(128, 1, true);
+	ssao_half_random_points = generateSpherePoints(16, 1, true);
 }
 
 void GTR::Renderer::generateSkybox(Camera* camera) {
@@ -94,16 +194,12 @@ void GTR::Renderer::generateSkybox(Camera* camera) {
 	glEnable(GL_DEPTH_TEST);
 }
 
-void GTR::Renderer::generateProbes(GTR::Scene* scene) {
+void GTR::Renderer::setProbeGrid(Vector3 start_pos, Vector3 end_pos, Vector3 dim) {
 	probes.clear();
-	//define the corners of the axis aligned grid
-	//this can be done using the boundings of our scene
-	Vector3 start_pos(-300, 5, -300);
-	Vector3 end_pos(300, 150, 300);
-
-	//define how many probes you want per dimension
-	Vector3 dim(12, 6, 12);
-
+	irr_sampler.clear();
+	irr_bricks.clear();
+	if (irr_indirection) delete irr_indirection;
+	irr_indirection = NULL;
 	irr_start_pos = start_pos;
 	irr_end_pos = end_pos;
 	irr_dim_pos = dim;
@@ -111,14 +207,14 @@ void GTR::Renderer::generateProbes(GTR::Scene* scene) {
 	//compute the vector from one corner to the other
 	Vector3 delta = (end_pos - start_pos);
 
-	irr_delta = delta;
-
 	//and scale it down according to the subdivisions
 	//we substract one to be sure the last probe is at end pos
 	delta.x /= (dim.x - 1);
 	delta.y /= (dim.y - 1);
 	delta.z /= (dim.z - 1);
 
+	irr_delta = delta;
+
 	for (int z = 0; z < dim.z; ++z) {
 		for (int y = 0; y < dim.y; ++y) {
 			for (int x = 0; x < dim.x; ++x)
@@ -135,69 +231,242 @@ void GTR::Renderer::generateProbes(GTR::Scene* scene) {
 			}
 		}
 	}
+}
 
-	for (int iP = 0; iP < probes.size(); iP++)
+void GTR::Renderer::generateProbes(GTR::Scene* scene) {
+	//define the corners of the axis aligned grid
+	//this can be done using the boundings of our scene
+	Vector3 start_pos(-300, 5, -300);
+	Vector3 end_pos(300, 150, 300);
+
+	//define how many probes you want per dimension
+	Vector3 dim(12, 6, 12);
+
+	//the triangles of the CPU baker also tell the adaptive placement where the geometry is
+	ProbeBaker baker;
+	if (adaptive_probes || cpu_probe_bake)
+		baker.build(scene);
+
+	if (adaptive_probes)
+		placeAdaptiveProbes(baker);
+	else
+		setProbeGrid(start_pos, end_pos, dim);
+	if (probes.empty())
+		return;
+
+	if (cpu_probe_bake)
+	{
+		long start_time = getTime();
+
+		std::vector<Vector3> positions(probes.size());
+		std::vector<SphericalHarmonics> result(probes.size());
+		for (int iP = 0; iP < probes.size(); iP++)
+			positions[iP] = probes[iP].pos;
+		if (bake_workers > 0) {
+			if (!baker.bakeDistributed(&positions[0], &result[0], probes.size(), bake_workers, bake_workers * 4))
+				return;
+		}
+		else
+			baker.bake(&positions[0], &result[0], probes.size());
+		for (int iP = 0; iP < probes.size(); iP++)
+			probes[iP].sh = result[iP];
+		std::cout << "Probes baked on the CPU in " << (getTime() - start_time) << " ms" << std::endl;
+	}
+	else
 	{
-		std::cout << "Generando probe numero " << iP << " de " << probes.size() << std::endl;
-		int probe_index = iP;
-		captureProbe(probes[iP], scene);
+		std::vector<Vector3> positions(probes.size());
+		std::vector<SphericalHarmonics> result(probes.size());
+		for (int iP = 0; iP < probes.size(); iP++)
+			positions[iP] = probes[iP].pos;
+		captureProbesSH(scene, &positions[0], &result[0], probes.size());
+		for (int iP = 0; iP < probes.size(); iP++)
+			probes[iP].sh = result[iP];
 	}
 
+	std::vector<SphericalHarmonics> sh_data(probes.size());
+	for (int i = 0; i < probes.size(); ++i)
+		sh_data[i] = probes[i].sh;
+
+	//rows in the layout of the texture, the same bytes go to the file
+	std::vector<uint8> rows(probes.size() * IrradianceCache::rowBytes(irr_half_floats));
+	IrradianceCache::encode(&sh_data[0], probes.size(), irr_half_floats, &rows[0]);
+	uploadProbes(&rows[0], irr_half_floats ? GL_HALF_FLOAT : GL_FLOAT);
+	createProbeVolume();
+	updateProbeSampler();
+
+	int flags = (irr_half_floats ? IRR_HALF : 0) | (irr_compress ? IRR_COMPRESSED : 0);
+	IrradianceCache::save("irradiance.bin", irr_start_pos, irr_end_pos, irr_dim_pos, &sh_data[0], probes.size(), flags,
+		irr_bricks.size() ? &irr_bricks[0] : NULL, irr_bricks.size());
+}
+
+//octree over a cube around the geometry, cells are only refined when there are triangles nearby.
+//every leaf becomes a brick of probes, so empty space gets a few coarse bricks
+void GTR::Renderer::placeAdaptiveProbes(ProbeBaker& baker) {
+	irr_bricks.clear();
+	if (baker.nodes.empty()) {
+		std::cout << "[WARN] no geometry to place the probes" << std::endl;
+		probes.clear();
+		return;
+	}
+
+	Vector3 min = baker.nodes[0].min;
+	Vector3 max = baker.nodes[0].max;
+	Vector3 extent = max - min;
+	float size = std::max(extent.x, std::max(extent.y, extent.z)) * 1.01f;
+	Vector3 start = (min + max) * 0.5f - Vector3(size, size, size) * 0.5f;
+
+	subdivideProbeCell(baker, start, size, 0);
+
+	irr_start_pos = start;
+	irr_end_pos = start + Vector3(size, size, size);
+	setProbeBricks();
+}
+
+void GTR::Renderer::subdivideProbeCell(ProbeBaker& baker, Vector3 start, float size, int level) {
+	//the margin refines a bit ahead of the surfaces, where the shaded points read the probes
+	Vector3 margin = Vector3(1, 1, 1) * (size * 0.25f);
+	if (level < probe_max_depth && baker.overlapsBox(start - margin, start + Vector3(size, size, size) + margin))
+	{
+		float half = size * 0.5f;
+		for (int i = 0; i < 8; ++i)
+			subdivideProbeCell(baker, start + Vector3(i & 1, (i >> 1) & 1, (i >> 2) & 1) * half, half, level + 1);
+		return;
+	}
+
+	sIrrBrick brick;
+	brick.start = start;
+	brick.size = size;
+	brick.level = level;
+	irr_bricks.push_back(brick);
+}
+
+//creates the probes of every brick, in brick order, and the indirection volume to find them
+void GTR::Renderer::setProbeBricks() {
+	probes.clear();
+	irr_sampler.clear();
+	int max_level = 0;
+	for (int b = 0; b < irr_bricks.size(); ++b)
+	{
+		sIrrBrick& brick = irr_bricks[b];
+		max_level = std::max(max_level, brick.level);
+		float spacing = brick.size / (IRR_BRICK_SIZE - 1);
+		for (int z = 0; z < IRR_BRICK_SIZE; ++z)
+			for (int y = 0; y < IRR_BRICK_SIZE; ++y)
+				for (int x = 0; x < IRR_BRICK_SIZE; ++x)
+				{
+					sProbe p;
+					p.local.set(x, y, z);
+					p.index = probes.size();
+					p.pos = brick.start + Vector3(x, y, z) * spacing;
+					probes.push_back(p);
+				}
+	}
+
+	//one texel per cell of the finest level with the brick index and its level
+	int res = 1 << max_level;
+	irr_dim_pos.set(res, res, res);
+	irr_delta = (irr_end_pos - irr_start_pos) * (1.0f / res);
+	std::vector<float> table(res * res * res * 2, 0.0f);
+	for (int b = 0; b < irr_bricks.size(); ++b)
+	{
+		sIrrBrick& brick = irr_bricks[b];
+		int cells = res >> brick.level;
+		int from[3];
+		for (int i = 0; i < 3; ++i)
+			from[i] = (int)floor((brick.start.v[i] - irr_start_pos.v[i]) / irr_delta.v[i] + 0.5f);
+		for (int z = from[2]; z < from[2] + cells; ++z)
+			for (int y = from[1]; y < from[1] + cells; ++y)
+				for (int x = from[0]; x < from[0] + cells; ++x) {
+					int index = x + y * res + z * res * res;
+					table[index * 2] = b;
+					table[index * 2 + 1] = brick.level;
+				}
+	}
+
+	if (irr_indirection) delete irr_indirection;
+	irr_indirection = new Texture();
+	irr_indirection->create3D(res, res, res, GL_RG, GL_FLOAT, false, (Uint8*)&table[0], GL_RG32F);
+
+	std::cout << " + Adaptive probes: " << irr_bricks.size() << " bricks, " << probes.size() << " probes" << std::endl;
+}
+
+//creates the probes texture from rows of 9 RGB coeffs per probe, when there are more probes than
+//the max texture height they wrap into more columns of 9 texels
+void GTR::Renderer::uploadProbes(const void* rows, unsigned int type) {
 	if (probes_texture != NULL) delete probes_texture;
 
-	//create the texture to store the probes (do this ONCE!!!)
+	GLint max_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	int num_probes = probes.size();
+	int columns = (num_probes + max_size - 1) / max_size;
+	if (columns * 9 > max_size) {
+		columns = max_size / 9;
+		num_probes = columns * max_size;
+		std::cout << "[WARN] too many probes for a texture of " << max_size << ", only the first " << num_probes << " are used, reduce the depth or the bricks" << std::endl;
+	}
+	probes_rows = columns > 1 ? max_size : num_probes;
+
 	probes_texture = new Texture(
-		9, //9 coefficients per probe
-		probes.size(), //as many rows as probes
+		9 * columns, //9 coefficients per probe
+		probes_rows, //as many rows as probes
 		GL_RGB, //3 channels per coefficient
-		GL_FLOAT); //they require a high range
+		type, //they require a high range
+		false,
+		NULL);
 
+	//half float rows are 54 bytes, not a multiple of 4
+	int row_bytes = IrradianceCache::rowBytes(type == GL_HALF_FLOAT);
 	probes_texture->bind();
-		//we must create the color information for the texture. because every SH are 27 floats in the RGB,RGB,... order, we can create an array of SphericalHarmonics and use it as pixels of the texture
-	SphericalHarmonics* sh_data = NULL;
-	sh_data = new SphericalHarmonics[dim.x * dim.y * dim.z];
-
-	//here we fill the data of the array with our probes in x,y,z order
-	for (int i = 0; i < probes.size(); ++i)
-		sh_data[i] = probes[i].sh;
-
-	//now upload the data to the GPU as a texture
-	probes_texture->upload(GL_RGB, GL_FLOAT, false, (uint8*)sh_data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int i = 0; i < columns; i++) {
+		int first = i * probes_rows;
+		int count = std::min(probes_rows, num_probes - first);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, i * 9, 0, 9, count, GL_RGB, type, (const uint8*)rows + first * row_bytes);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	probes_texture->unbind();
 
 	//disable any texture filtering when reading
 	probes_texture->bind();
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-	//always free memory after allocating it!!!
-	delete[] sh_data;
-
 	probes_texture->unbind();
-	// saveIrradianceToDisk ---------------------------------
-	//fill header structure
-	sIrrHeader header;
-
-	header.start = start_pos;
-	header.end = end_pos;
-	header.dims = dim;
-	header.delta = delta;
-	header.num_probes = dim.x * dim.y * dim.z;
-
-	//write to file header and probes data
-	FILE* f = fopen("irradiance.bin", "wb");
-	fwrite(&header, sizeof(header), 1, f);
-	fwrite(&(probes[0]), sizeof(sProbe), probes.size(), f);
-	fclose(f);
 }
 
 bool GTR::Renderer::loadProbes() {
+	//the file is mapped and its rows go to the texture without copies, unless it is compressed
+	IrradianceCache cache;
+	if (cache.open("irradiance.bin"))
+	{
+		if (cache.bricks.size()) {
+			irr_bricks = cache.bricks;
+			irr_start_pos = cache.header.start;
+			irr_end_pos = cache.header.end;
+			setProbeBricks();
+		}
+		else
+			setProbeGrid(cache.header.start, cache.header.end, cache.header.dims);
+		for (int i = 0; i < probes.size(); ++i)
+			probes[i].sh = cache.getProbe(i);
+		uploadProbes(cache.getProbeData(), cache.getDataType());
+		createProbeVolume();
+		updateProbeSampler();
+		return true;
+	}
+
+	//files from before the versioned format: header and the raw sProbe array
 	FILE* f = fopen("irradiance.bin", "rb");
 	if (!f)
 		return false;
 
 	//read header
 	sIrrHeader header;
-	fread(&header, sizeof(header), 1, f);
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(&header, "IRRB", 4) == 0) {
+		fclose(f);
+		return false;
+	}
+
+	setProbeGrid(header.start, header.end, header.dims);
 
 	//copy info from header to our local vars
 	irr_start_pos = header.start;
@@ -209,53 +478,140 @@ bool GTR::Renderer::loadProbes() {
 	//allocate space for the probes
 	probes.resize(num_probes);
 
-
 	//read from disk directly to our probes container in memory
 	fread(&probes[0], sizeof(sProbe), probes.size(), f);
 	fclose(f);
 
-	if (probes_texture != NULL) delete probes_texture;
+	std::vector<SphericalHarmonics> sh_data(probes.size());
+	for (int i = 0; i < probes.size(); ++i)
+		sh_data[i] = probes[i].sh;
+	uploadProbes(&sh_data[0], GL_FLOAT);
+	createProbeVolume();
+	updateProbeSampler();
+	return true;
+}
 
-	//create the texture to store the probes (do this ONCE!!!)
-	probes_texture = new Texture(
-		9, //9 coefficients per probe
-		probes.size(), //as many rows as probes
-		GL_RGB, //3 channels per coefficient
-		GL_FLOAT); //they require a high range
+//regular grids also get a 3D texture with the 9 coeffs side by side in x, (9 * dim.x, dim.y, dim.z),
+//so the sampler does the trilinear interpolation. Bricks keep using the rows
+void GTR::Renderer::createProbeVolume() {
+	if (irr_volume) delete irr_volume;
+	irr_volume = NULL;
+	if (!irr_bricks.empty() || probes.empty())
+		return;
 
-	probes_texture->bind();
-	//we must create the color information for the texture. because every SH are 27 floats in the RGB,RGB,... order, we can create an array of SphericalHarmonics and use it as pixels of the texture
-	SphericalHarmonics* sh_data = NULL;
-	sh_data = new SphericalHarmonics[irr_dim_pos.x * irr_dim_pos.y * irr_dim_pos.z];
+	int dx = irr_dim_pos.x, dy = irr_dim_pos.y, dz = irr_dim_pos.z;
+	GLint max_size = 0;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max_size);
+	if (9 * dx > max_size || dy > max_size || dz > max_size) {
+		std::cout << "[WARN] the probe grid does not fit in a 3D texture of " << max_size << ", the volume is not used" << std::endl;
+		return;
+	}
+	std::vector<Vector3> texels(9 * dx * dy * dz);
+	for (int i = 0; i < probes.size(); ++i) {
+		sProbe& p = probes[i];
+		int x = p.local.x, y = p.local.y, z = p.local.z;
+		for (int c = 0; c < 9; ++c)
+			texels[(c * dx + x) + y * 9 * dx + z * 9 * dx * dy] = p.sh.coeffs[c];
+	}
+
+	irr_volume = new Texture();
+	irr_volume->create3D(9 * dx, dy, dz, GL_RGB, GL_FLOAT, false, (Uint8*)&texels[0], GL_RGB16F);
+}
 
-	//here we fill the data of the array with our probes in x,y,z order
+//copies the coeffs to the CPU sampler, in the same order as the probes texture
+void GTR::Renderer::updateProbeSampler() {
+	std::vector<SphericalHarmonics> sh_data(probes.size());
 	for (int i = 0; i < probes.size(); ++i)
 		sh_data[i] = probes[i].sh;
+	if (sh_data.empty())
+		irr_sampler.clear();
+	else if (irr_bricks.size())
+		irr_sampler.setBricks(irr_start_pos, irr_end_pos, &irr_bricks[0], irr_bricks.size(), &sh_data[0], sh_data.size());
+	else
+		irr_sampler.setGrid(irr_start_pos, irr_end_pos, irr_dim_pos, &sh_data[0], sh_data.size());
+}
 
-	//now upload the data to the GPU as a texture
-	probes_texture->upload(GL_RGB, GL_FLOAT, false, (uint8*)sh_data);
+//bakes again only the given probes and rewrites their rows in the texture and in the file
+void GTR::Renderer::rebakeProbes(GTR::Scene* scene, const std::vector<int>& dirty) {
+	if (!probes_texture || dirty.empty())
+		return;
 
-	//disable any texture filtering when reading
-	probes_texture->bind();
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	if (cpu_probe_bake)
+	{
+		ProbeBaker baker;
+		baker.build(scene);
+		std::vector<Vector3> positions(dirty.size());
+		std::vector<SphericalHarmonics> result(dirty.size());
+		for (int i = 0; i < dirty.size(); ++i)
+			positions[i] = probes[dirty[i]].pos;
+		baker.bake(&positions[0], &result[0], dirty.size());
+		for (int i = 0; i < dirty.size(); ++i)
+			probes[dirty[i]].sh = result[i];
+	}
+	else
+	{
+		std::vector<Vector3> positions(dirty.size());
+		std::vector<SphericalHarmonics> result(dirty.size());
+		for (int i = 0; i < dirty.size(); ++i)
+			positions[i] = probes[dirty[i]].pos;
+		captureProbesSH(scene, &positions[0], &result[0], dirty.size());
+		for (int i = 0; i < dirty.size(); ++i)
+			probes[dirty[i]].sh = result[i];
+	}
 
-	//always free memory after allocating it!!!
-	delete[] sh_data;
+	std::vector<SphericalHarmonics> sh_data(probes.size());
+	for (int i = 0; i < probes.size(); ++i)
+		sh_data[i] = probes[i].sh;
 
+	bool half = probes_texture->type == GL_HALF_FLOAT;
+	std::vector<uint8> row(IrradianceCache::rowBytes(half));
+	probes_texture->bind();
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (int i = 0; i < dirty.size(); ++i) {
+		IrradianceCache::encode(&sh_data[dirty[i]], 1, half, &row[0]);
+		if (dirty[i] < probes_rows * (probes_texture->width / 9))
+			glTexSubImage2D(GL_TEXTURE_2D, 0, (dirty[i] / probes_rows) * 9, dirty[i] % probes_rows, 9, 1, GL_RGB, probes_texture->type, &row[0]);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 	probes_texture->unbind();
+	if (irr_volume)
+		createProbeVolume();
+	updateProbeSampler();
+
+	if (!IrradianceCache::saveProbes("irradiance.bin", &sh_data[0], probes.size(), dirty)) {
+		int flags = (half ? IRR_HALF : 0) | (irr_compress ? IRR_COMPRESSED : 0);
+		IrradianceCache::save("irradiance.bin", irr_start_pos, irr_end_pos, irr_dim_pos, &sh_data[0], probes.size(), flags,
+			irr_bricks.size() ? &irr_bricks[0] : NULL, irr_bricks.size());
+	}
+}
+
+void GTR::Renderer::rebakeProbesAround(GTR::Scene* scene, Vector3 center, float radius) {
+	std::vector<int> dirty;
+	for (int i = 0; i < probes.size(); ++i)
+		if (probes[i].pos.distance(center) <= radius)
+			dirty.push_back(i);
+	std::cout << "Rebaking " << dirty.size() << " probes" << std::endl;
+	rebakeProbes(scene, dirty);
 }
 
 void GTR::Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 {
+	updateRenderScale();
+	readback.update(); //screenshots and other reads from previous frames
+
 	camera->enable();
+	glBeginQuery(GL_TIME_ELAPSED, gpu_time_queries[query_index]);
 	renderSceneForward(scene, camera);
+	glEndQuery(GL_TIME_ELAPSED);
+	query_index = (query_index + 1) % 3;
+	queries_issued++;
 
 	//renderReflectionProbes(scene, camera);
 }
 
 void GTR::Renderer::renderSceneForward(GTR::Scene* scene, Camera* camera)
 {
+	current_scene = scene;
 	lights.clear();
 	render_calls.clear();
 	decals.clear();
@@ -272,7 +628,7 @@ void GTR::Renderer::renderSceneForward(GTR::Scene* scene, Camera* camera)
 		{
 			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
 			if (pent->prefab) 
-				renderPrefab(ent->model, pent->prefab, camera);
+				renderPrefab(ent->model, pent->prefab, camera, ent->id);
 		}
 
 		//is a light!
@@ -289,17 +645,38 @@ void GTR::Renderer::renderSceneForward(GTR::Scene* scene, Camera* camera)
 		}
 	}
 
+	//the entities that were not rendered this time are forgotten
+	previous_models.swap(current_models);
+	current_models.clear();
+
 	//Ordenar rendercalls
 	std::sort(render_calls.begin(), render_calls.end(), [](RenderCall rc1, RenderCall rc2) {
 		if(rc1.material->alpha_mode == GTR::eAlphaMode::BLEND && rc2.material->alpha_mode == GTR::eAlphaMode::BLEND) rc1.distance_to_camera > rc2.distance_to_camera;
 		return rc1.distance_to_camera < rc2.distance_to_camera;
 	});
 
+	//one SH per render call, the forward shaders get it as uniforms instead of reading the probes
+	if (forward_probe_sh && !irr_sampler.isEmpty()) {
+		std::vector<Vector3> centers(render_calls.size());
+		std::vector<SphericalHarmonics> result(render_calls.size());
+		for (int i = 0; i < render_calls.size(); i++)
+			centers[i] = render_calls[i].world_bounding.center;
+		if (!centers.empty())
+			irr_sampler.sample(&centers[0], &result[0], centers.size());
+		for (int i = 0; i < render_calls.size(); i++)
+			render_calls[i].probe_sh = result[i];
+	}
+
 	for (int i = 0; i < lights.size(); i++) {
 		if (lights[i]->cast_shadows) generateShadowMap(lights[i]);
 	}
 
+	//a few faces or mips of the reflection probes every frame
+	reflection_probes.update(this, scene, camera);
+
 	if (pipeline == FORWARD) renderForward(scene, camera);
+	else if (cpu_raster) renderDeferredCPU(scene, camera);
+	else if (compare_formats) renderFormatComparison(scene, camera);
 	else renderDeferred(scene, camera);
 
 	if (probes_texture && show_irr_texture) probes_texture->toViewport();
@@ -314,9 +691,10 @@ void GTR::Renderer::renderForward(GTR::Scene* scene, Camera* camera) {
 	checkGLErrors();
 	generateSkybox(camera);
 
+	bool probe_sh = forward_probe_sh && !irr_sampler.isEmpty();
 	for (int i = 0; i < render_calls.size(); i++) {
 		if (camera->testBoxInFrustum(render_calls[i].world_bounding.center, render_calls[i].world_bounding.halfsize))
-			renderMeshWithMaterialandLight(render_calls[i].model, render_calls[i].mesh, render_calls[i].material, camera);
+			renderMeshWithMaterialandLight(render_calls[i].model, render_calls[i].mesh, render_calls[i].material, camera, probe_sh ? &render_calls[i].probe_sh : NULL);
 	}
 
 	for(int i = 0; i < probes.size(); i++)
@@ -329,142 +707,155 @@ void GTR::Renderer::renderForward(GTR::Scene* scene, Camera* camera) {
 
 
 void GTR::Renderer::renderDeferred(GTR::Scene* scene, Camera* camera){
-	int width = Application::instance->window_width;
-	int height = Application::instance->window_height;
+	int width = render_width;
+	int height = render_height;
 	Shader* shader = NULL;
+	int octahedral_normals = compact_formats ? 1 : 0;
+
+	//the window was resized, the max scale changed or the motion vectors target is needed,
+	//a lower render scale only uses part of the targets
+	if (gbuffers_fbo && (gbuffers_fbo->width != render_target_width || gbuffers_fbo->height != render_target_height || gbuffers_fbo->num_color_textures != (taa_upscale ? 4 : 3)))
+		releaseDeferredTargets();
+	else if (postFX_textureA && (postFX_textureA->width != output_target_width || postFX_textureA->height != output_target_height))
+		releaseDeferredTargets();
+
+	vp_matrix_unjittered = camera->viewprojection_matrix;
+	if (taa_upscale) {
+		//sub-pixel offset of this frame in internal pixels, the resolve accumulates them
+		taa_frame = (taa_frame + 1) % 8;
+		taa_jitter = Vector2(halton(taa_frame + 1, 2) - 0.5, halton(taa_frame + 1, 3) - 0.5);
+		Matrix44 jitter;
+		jitter.setTranslation(taa_jitter.x * 2.0 / width, taa_jitter.y * 2.0 / height, 0.0);
+		camera->viewprojection_matrix = camera->viewprojection_matrix * jitter;
+	}
+
+	if (targets_compact != compact_formats)
+		swapDeferredTargets();
 
 	if (!gbuffers_fbo) {
 		//create and FBO
 		gbuffers_fbo = new FBO();
 
-		//create 3 textures of 4 components
-		gbuffers_fbo->create(width, height,	3, GL_RGBA, GL_UNSIGNED_BYTE, true);
+		//create 3 textures of 4 components, and one for the motion vectors if needed
+		gbuffers_fbo->create(render_target_width, render_target_height, taa_upscale ? 4 : 3, GL_RGBA, GL_UNSIGNED_BYTE, true);
 
-		decals_fbo = new FBO();
+		if (taa_upscale) {
+			Texture* gb3 = gbuffers_fbo->color_textures[3];
+			gb3->upload(GL_RG, GL_HALF_FLOAT, false, NULL, GL_RG16F);
+			gb3->bind();
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			gb3->unbind();
+		}
 
-		decals_fbo->create(width, height, 3, GL_RGBA, GL_UNSIGNED_BYTE, true);
+		if (compact_formats) {
+			//octahedral normals in rg need more than 8 bits, metalness goes to b
+			Texture* gb1 = gbuffers_fbo->color_textures[1];
+			gb1->upload(GL_RGBA, GL_UNSIGNED_BYTE, false, NULL, GL_RGB10_A2);
+			gb1->bind();
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			gb1->unbind();
+		}
 	}
 
 	Mesh* quad = Mesh::getQuad();
-	Matrix44 inv_vp = camera->viewprojection_matrix;
+	//the passes that read the targets with gl_FragCoord work in their uv space
+	Matrix44 vp = camera->viewprojection_matrix * uvScaleMatrix(render_uv_scale);
+	Matrix44 inv_vp = vp;
 	inv_vp.inverse();
+	Vector2 iRes(1.0 / (float)render_target_width, 1.0 / (float)render_target_height);
 
-	gbuffers_fbo->bind();
+	bindScaled(gbuffers_fbo, render_uv_scale);
 	// Clear the color and the depth buffer
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	checkGLErrors();
 
-	for (int i = 0; i < render_calls.size(); i++) {
+	if (parallel_recording)
+		renderGBufferRecorded(camera);
+	else for (int i = 0; i < render_calls.size(); i++) {
 		if (camera->testBoxInFrustum(render_calls[i].world_bounding.center, render_calls[i].world_bounding.halfsize))
-			renderMeshWithMaterialtoGBuffer(render_calls[i].model, render_calls[i].mesh, render_calls[i].material, camera);
+			renderMeshWithMaterialtoGBuffer(render_calls[i].model, render_calls[i].prev_model, render_calls[i].mesh, render_calls[i].material, camera);
 	}
 
 	gbuffers_fbo->unbind();
 
-	//decals
-	gbuffers_fbo->color_textures[0]->copyTo(decals_fbo->color_textures[0]);
-	gbuffers_fbo->color_textures[1]->copyTo(decals_fbo->color_textures[1]);
-	gbuffers_fbo->color_textures[2]->copyTo(decals_fbo->color_textures[2]);
-	
-	decals_fbo->bind();
-	gbuffers_fbo->depth_texture->copyTo(NULL);
-	decals_fbo->unbind();
-
-	if (decals.size()) {
-		gbuffers_fbo->bind();
-
-		shader = Shader::Get("decal");
-		shader->enable();
-		shader->setUniform("u_depth_texture", decals_fbo->depth_texture, 4);
-		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader->setUniform("u_inverse_viewprojection", inv_vp);
-		shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		glColorMask(true, true, true, false);
-
-		for (int i = 0; i < decals.size(); i++) {
-			DecalEntity* decal = decals[i];
-			Texture* decal_texture = Texture::Get(decal->texture.c_str());
-			if (!decal_texture) continue;
-			shader->setUniform("u_decal_texture", decal_texture, 5);
-			shader->setUniform("u_model", decal->model);
-			
-			Matrix44 imodel = decal->model;
-			imodel.inverse();
-			shader->setUniform("u_imodel", imodel);
-			cube.render(GL_TRIANGLES);
-		}
-
-		glColorMask(true, true, true, true);
-		glDisable(GL_BLEND);
-		gbuffers_fbo->unbind();
-	}
+	//decals, nothing to do if there are none
+	if (decals.size())
+		renderDecals(camera);
 
 	if (!ssao_fbo) {
 		//create and FBO
 		ssao_fbo = new FBO();
 
 		//create 1 texture of 3 components
-		ssao_fbo->create(width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
+		ssao_fbo->create(render_target_width, render_target_height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
 	}
 
-	ssao_fbo->bind();
-
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
-	if (ssaoplus) {
-		shader = Shader::Get("ssaoplus");
-		shader->enable();
-		shader->setUniform3Array("u_points", (float*)&ssaoplus_random_points[0], ssaoplus_random_points.size());
+	if (!ssao_blur) {
+		ssao_blur = new FBO();
+		ssao_blur->create(render_target_width, render_target_height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
 	}
+
+	if (ssao_half_res)
+		computeHalfResSSAO(camera);
 	else {
-		shader = Shader::Get("ssao");
-		shader->enable();
-		shader->setUniform("u_gb1_texture", gbuffers_fbo->color_textures[1], 2);
-		shader->setUniform3Array("u_points", (float*)&ssao_random_points[0], ssao_random_points.size());
-	}
-	shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_inverse_viewprojection", inv_vp);
-	shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
+		bindScaled(ssao_fbo, render_uv_scale);
 
-	quad->render(GL_TRIANGLES);
+		glDisable(GL_DEPTH_TEST);
+		glDisable(GL_BLEND);
+		if (ssaoplus) {
+			shader = Shader::Get("ssaoplus");
+			shader->enable();
+			shader->setUniform3Array("u_points", (float*)&ssaoplus_random_points[0], ssaoplus_random_points.size());
+		}
+		else {
+			shader = Shader::Get("ssao");
+			shader->enable();
+			shader->setUniform3Array("u_points", (float*)&ssao_random_points[0], ssao_random_points.size());
+		}
+		shader->setUniform("u_gb1_texture", gbuffers_fbo->color_textures[1], 2);
+		shader->setUniform("u_octahedral_normals", octahedral_normals);
+		shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+		shader->setUniform("u_viewprojection", vp);
+		shader->setUniform("u_inverse_viewprojection", inv_vp);
+		shader->setUniform("u_iRes", iRes);
 
-	ssao_fbo->unbind();
+		quad->render(GL_TRIANGLES);
 
-	if (!ssao_blur) {
-		ssao_blur = new FBO();
-		ssao_blur->create(width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
-	}
+		ssao_fbo->unbind();
 
-	ssao_blur->bind();
+		bindScaled(ssao_blur, render_uv_scale);
 
-	shader = Shader::Get("ssao_blur");
-	shader->enable();
-	shader->setUniform("ssaoInput", ssao_fbo->color_textures[0], 0);
+		shader = Shader::Get("ssao_blur");
+		shader->enable();
+		shader->setUniform("ssaoInput", ssao_fbo->color_textures[0], 0);
+		shader->setUniform("u_uv_scale", render_uv_scale);
 
-	quad->render(GL_TRIANGLES);
+		quad->render(GL_TRIANGLES);
 
-	ssao_blur->unbind();
+		ssao_blur->unbind();
+	}
 
 	if (!illumination_fbo) {
 		//create and FBO
 		illumination_fbo = new FBO();
 
-		//create 1 texture of 3 components
-		illumination_fbo->create(width, height, 1, GL_RGB, GL_FLOAT, true);
+		//create 1 texture of 3 components, 4 bytes per pixel instead of 12 with compact formats
+		int hdr_format = compact_formats ? GL_R11F_G11F_B10F : 0;
+		illumination_fbo->create(render_target_width, render_target_height, 1, GL_RGB, GL_FLOAT, true, hdr_format);
 
-		postFX_textureA = new Texture(width, height, GL_RGB, GL_FLOAT, false);
-		postFX_textureB = new Texture(width, height, GL_RGB, GL_FLOAT, false);
-		postFX_textureC = new Texture(width, height, GL_RGB, GL_FLOAT, false);
-		postFX_textureD = new Texture(width, height, GL_RGB, GL_FLOAT, false);
-		blurred_texture = new Texture(width, height, GL_RGB, GL_FLOAT, false);
+		postFX_textureA = new Texture(output_target_width, output_target_height, GL_RGB, GL_FLOAT, false, NULL, hdr_format);
+		postFX_textureB = new Texture(output_target_width, output_target_height, GL_RGB, GL_FLOAT, false, NULL, hdr_format);
+		postFX_textureC = new Texture(output_target_width, output_target_height, GL_RGB, GL_FLOAT, false, NULL, hdr_format);
+		postFX_textureD = new Texture(output_target_width, output_target_height, GL_RGB, GL_FLOAT, false, NULL, hdr_format);
+		blurred_texture = new Texture(output_target_width, output_target_height, GL_RGB, GL_FLOAT, false, NULL, hdr_format);
 	}
 
 	illumination_fbo->bind();
 
 	gbuffers_fbo->depth_texture->copyTo(NULL);
+	glViewport(0, 0, width, height);
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	glDisable(GL_DEPTH_TEST);
@@ -477,7 +868,7 @@ void GTR::Renderer::renderDeferred(GTR::Scene* scene, Camera* camera){
 	shader->enable();
 	gbuffertoshader(gbuffers_fbo, scene, camera, shader);
 	shader->setUniform("u_inverse_viewprojection", inv_vp);
-	shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
+	shader->setUniform("u_iRes", iRes);
 	
 	shader->setUniform("u_ssao_texture", ssao_blur->color_textures[0], 5);
 	shader->setUniform("u_ambient_light", scene->ambient_light);
@@ -486,22 +877,30 @@ void GTR::Renderer::renderDeferred(GTR::Scene* scene, Camera* camera){
 	lightToShader(direct_light, shader);
 
 	if (probes_texture) {
-		if(interpolated_irr) shader->setUniform("u_irr", 2.0f);
+		if (irr_indirection) {
+			shader->setUniform("u_irr", 3.0f);
+			shader->setUniform("u_irr_indirection", irr_indirection, 10);
+			shader->setUniform("u_irr_root_size", irr_end_pos.x - irr_start_pos.x);
+			shader->setUniform("u_irr_indirection_res", irr_dim_pos.x);
+		}
+		else if (irr_volume && use_irr_volume) {
+			shader->setUniform("u_irr", 4.0f);
+			shader->setUniform("u_irr_volume", irr_volume, 10);
+		}
+		else if(interpolated_irr) shader->setUniform("u_irr", 2.0f);
 		else shader->setUniform("u_irr", 1.0f);
 		shader->setUniform("u_irr_texture", probes_texture, 6);
 		shader->setUniform("u_irr_start", irr_start_pos);
 		shader->setUniform("u_irr_end", irr_end_pos);
 		shader->setUniform("u_irr_dim", irr_dim_pos);
 		shader->setUniform("u_irr_normal_distance", 0.1f);
-		shader->setUniform("u_num_probes", probes_texture->height);
+		shader->setUniform("u_irr_rows", probes_rows);
 		shader->setUniform("u_irr_delta", irr_end_pos - irr_start_pos);
 	}
 	else shader->setUniform("u_irr", 0.0f);
 
-	Texture* reflection = skybox;
-	if (probe && !is_rendering_reflections)
-		reflection = probe->texture;
-	shader->setUniform("u_skybox_texture", reflection, 9);
+	shader->setUniform("u_skybox_texture", skybox, 9);
+	reflectionProbesToShader(shader, camera->eye);
 	
 	glDisable(GL_DEPTH_TEST);
 	glDisable(GL_BLEND);
@@ -522,7 +921,7 @@ void GTR::Renderer::renderDeferred(GTR::Scene* scene, Camera* camera){
 		if (light->light_type == GTR::eLightType::SPOT || light->light_type == GTR::eLightType::POINT) {
 			gbuffertoshader(gbuffers_fbo, scene, camera, shader);
 			shader->setUniform("u_inverse_viewprojection", inv_vp);
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
+			shader->setUniform("u_iRes", iRes);
 			shader->setUniform("u_ambient_light", Vector3()); //Solo queremos pintar 1 vez la luz ambiente
 			lightToShader(light, shader);
 			Matrix44 m;
@@ -542,10 +941,11 @@ void GTR::Renderer::renderDeferred(GTR::Scene* scene, Camera* camera){
 
 	//Render alpha nodes
 	glEnable(GL_DEPTH_TEST);
+	bool probe_sh = forward_probe_sh && !irr_sampler.isEmpty();
 	for (int i = 0; i < render_calls.size(); i++) {
 		if (render_calls[i].material->alpha_mode == eAlphaMode::BLEND)
 			if (camera->testBoxInFrustum(render_calls[i].world_bounding.center, render_calls[i].world_bounding.halfsize))
-				renderMeshWithMaterialandLight(render_calls[i].model, render_calls[i].mesh, render_calls[i].material, camera);
+				renderMeshWithMaterialandLight(render_calls[i].model, render_calls[i].mesh, render_calls[i].material, camera, probe_sh ? &render_calls[i].probe_sh : NULL);
 	}
 
 
@@ -555,76 +955,665 @@ void GTR::Renderer::renderDeferred(GTR::Scene* scene, Camera* camera){
 	illumination_fbo->color_textures[0]->toViewport();
 
 
-	if (!volumetric_fbo) {
-		volumetric_fbo = new FBO();
-		volumetric_fbo->create(width, height, 1, GL_RGBA);
+	if (volumetric_froxels) {
+		computeVolumetricFroxels(scene, camera);
+
+		//one fetch per pixel, the volume already has the light integrated along the view ray
+		bindScaled(illumination_fbo, render_uv_scale);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+		shader = Shader::Get("froxel_apply");
+		shader->enable();
+		shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+		shader->setUniform("u_froxel_texture", froxel_integrated, 5);
+		shader->setUniform("u_froxel_dims", Vector3(froxel_integrated->width, froxel_integrated->height, froxel_integrated->depth));
+		shader->setUniform("u_froxel_range", Vector2(camera->near_plane, froxel_max_distance));
+		shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+		shader->setUniform("u_iRes", iRes);
+		shader->setUniform("u_uv_scale", render_uv_scale);
+		quad->render(GL_TRIANGLES);
+		illumination_fbo->unbind();
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glDisable(GL_BLEND);
 	}
+	else {
+		if (!volumetric_fbo) {
+			volumetric_fbo = new FBO();
+			volumetric_fbo->create(render_target_width, render_target_height, 1, GL_RGBA);
+		}
 
-	volumetric_fbo->bind();
+		bindScaled(volumetric_fbo, render_uv_scale);
 
-	//Hacer singlepass para varias luces
-	shader = Shader::Get("volumetric");
-	shader->enable();
-	shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
-	shader->setUniform("u_inverse_viewprojection", inv_vp);
-	shader->setUniform("u_iRes", Vector2(1.0 / (float)volumetric_fbo->color_textures[0]->width, 1.0 / (float)volumetric_fbo->color_textures[0]->height));
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_air_density", scene->air_density);
-	lightToShader(direct_light, shader);
+		//Hacer singlepass para varias luces
+		shader = Shader::Get("volumetric");
+		shader->enable();
+		shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+		shader->setUniform("u_inverse_viewprojection", inv_vp);
+		shader->setUniform("u_iRes", Vector2(1.0 / (float)volumetric_fbo->color_textures[0]->width, 1.0 / (float)volumetric_fbo->color_textures[0]->height));
+		shader->setUniform("u_camera_position", camera->eye);
+		shader->setUniform("u_air_density", scene->air_density);
+		lightToShader(direct_light, shader);
 
-	quad->render(GL_TRIANGLES);
+		quad->render(GL_TRIANGLES);
 
-	volumetric_fbo->unbind();
+		volumetric_fbo->unbind();
 
-	illumination_fbo->bind();
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	volumetric_fbo->color_textures[0]->toViewport();
-	illumination_fbo->unbind();
-	glDisable(GL_BLEND);
+		illumination_fbo->bind();
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		volumetric_fbo->color_textures[0]->toViewport();
+		illumination_fbo->unbind();
+		glDisable(GL_BLEND);
+	}
+
+	camera->viewprojection_matrix = vp_matrix_unjittered;
 
 	applyFX(illumination_fbo->color_textures[0], gbuffers_fbo->depth_texture, camera);
 
+	//the debug views are shown at window size
+	width = Application::instance->window_width;
+	height = Application::instance->window_height;
+
 	if (show_ssao) {
 		glDisable(GL_BLEND);
-		ssao_fbo->color_textures[0]->toViewport();
+		showTarget(ssao_half_res ? ssao_blur->color_textures[0] : ssao_fbo->color_textures[0], render_uv_scale, 0, 0, width, height);
 	}
+
 	if (show_gbuffers) {
 		glDisable(GL_BLEND);
-		glViewport(0, height * 0.5, width * 0.5, height * 0.5);
-		gbuffers_fbo->color_textures[0]->toViewport();
-
-		glViewport(width * 0.5, height * 0.5, width * 0.5, height * 0.5);
-		gbuffers_fbo->color_textures[1]->toViewport();
-
-		glViewport(0, 0, width * 0.5, height * 0.5);
-		gbuffers_fbo->color_textures[2]->toViewport();
+		showTarget(gbuffers_fbo->color_textures[0], render_uv_scale, 0, height * 0.5, width * 0.5, height * 0.5);
+		showTarget(gbuffers_fbo->color_textures[1], render_uv_scale, width * 0.5, height * 0.5, width * 0.5, height * 0.5);
+		showTarget(gbuffers_fbo->color_textures[2], render_uv_scale, 0, 0, width * 0.5, height * 0.5);
 
-		glViewport(width * 0.5, 0, width * 0.5, height * 0.5);
 		Shader* shader = Shader::getDefaultShader("depth");
 		shader->enable();
 		shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
-		gbuffers_fbo->depth_texture->toViewport(shader);
+		showTarget(gbuffers_fbo->depth_texture, render_uv_scale, width * 0.5, 0, width * 0.5, height * 0.5, shader);
 		shader->disable();
+	}
+	glViewport(0, 0, width, height);
+
+	//used by the temporal passes (ssao, motion blur, taa) of the next frame
+	vp_matrix_last = camera->viewprojection_matrix;
+	last_render_uv_scale = render_uv_scale;
+	last_output_uv_scale = output_uv_scale;
+}
+
+//Same G-buffer and lighting done by the SoftRasterizer, the result is only uploaded and shown
+void GTR::Renderer::renderDeferredCPU(GTR::Scene* scene, Camera* camera) {
+	int width = Application::instance->window_width;
+	int height = Application::instance->window_height;
+
+	if (!soft_rasterizer)
+		soft_rasterizer = new SoftRasterizer();
+	if (cpu_raster_texture && (cpu_raster_texture->width != width || cpu_raster_texture->height != height)) {
+		delete cpu_raster_texture;
+		cpu_raster_texture = NULL;
+	}
+	if (!cpu_raster_texture)
+		cpu_raster_texture = new Texture(width, height, GL_RGBA, GL_UNSIGNED_BYTE, false);
+
+	SoftRasterizer::sToneMapping tone;
+	tone.average_lum = average_lum;
+	tone.lum_white = lum_white;
+	tone.scale = lum_scale;
+	tone.auto_exposure = auto_exposure;
+	soft_rasterizer->render(render_calls, lights, scene, camera, &irr_sampler, tone, width, height);
+
+	cpu_raster_texture->bind();
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &soft_rasterizer->output[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	cpu_raster_texture->unbind();
+
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	cpu_raster_texture->toViewport();
+}
+
+//Renders the frame with both format sets to compare them, only meant for debugging as everything is rendered twice
+void GTR::Renderer::renderFormatComparison(GTR::Scene* scene, Camera* camera) {
+	int width = Application::instance->window_width;
+	int height = Application::instance->window_height;
+	bool compact = compact_formats;
+
+	compact_formats = false;
+	renderDeferred(scene, camera);
+
+	if (compare_texture && (compare_texture->width != width || compare_texture->height != height)) {
+		delete compare_texture;
+		compare_texture = NULL;
+	}
+	if (!compare_texture)
+		compare_texture = new Texture(width, height, GL_RGB, GL_UNSIGNED_BYTE, false);
+	compare_texture->bind();
+	glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+	compare_texture->unbind();
+
+	compact_formats = true;
+	renderDeferred(scene, camera);
+	compact_formats = compact;
+
+	//left half with the full formats
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(0, 0, width / 2, height);
+	compare_texture->toViewport();
+	glScissor(width / 2 - 1, 0, 2, height);
+	glClearColor(1.0, 1.0, 1.0, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+//Keeps the targets of the format not in use, so switching (or comparing) does not create them every frame
+void GTR::Renderer::swapDeferredTargets() {
+	std::swap(gbuffers_fbo, stored_targets.gbuffers_fbo);
+	std::swap(illumination_fbo, stored_targets.illumination_fbo);
+	std::swap(postFX_textureA, stored_targets.postFX_textureA);
+	std::swap(postFX_textureB, stored_targets.postFX_textureB);
+	std::swap(postFX_textureC, stored_targets.postFX_textureC);
+	std::swap(postFX_textureD, stored_targets.postFX_textureD);
+	std::swap(blurred_texture, stored_targets.blurred_texture);
+	targets_compact = !targets_compact;
+}
+
+//Applies all the visible decals to gb0 in a single fullscreen pass. Their textures are packed in an atlas
+//and every screen tile has a mask with the decals that touch it, so a pixel only tests the decals of its tile
+void GTR::Renderer::renderDecals(Camera* camera) {
+	const int max_decals = 32; //one bit per decal in the tile masks
+	const int atlas_cells = 4; //per side
+	const int cell_size = 512; //the decal uvs are clamped half a texel inside, so the neighbours never bleed in
+	const int tile_size = 32;
+	int width = render_width;
+	int height = render_height;
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int tiles_y = (height + tile_size - 1) / tile_size;
+
+	std::vector<Matrix44> imodels;
+	std::vector<Vector4> atlas_rects;
+	std::vector<unsigned int> tile_masks(tiles_x * tiles_y, 0);
+
+	decals_drawn = decals_over_limit = decals_without_cell = 0;
+	for (int i = 0; i < decals.size(); i++) {
+		DecalEntity* decal = decals[i];
+
+		//the decal volume is a unit cube
+		BoundingBox box = transformBoundingBox(decal->model, BoundingBox(Vector3(), Vector3(0.5, 0.5, 0.5)));
+		if (!camera->testBoxInFrustum(box.center, box.halfsize))
+			continue;
 
-		glViewport(0, 0, width, height);
+		//the texture is copied to the atlas the first time it is used
+		auto it = decal_atlas_slots.find(decal->texture);
+		if (it == decal_atlas_slots.end()) {
+			Texture* texture = Texture::Get(decal->texture.c_str());
+			int slot = -1;
+			if (texture && decal_atlas_used < atlas_cells * atlas_cells) {
+				if (!decal_atlas)
+					decal_atlas = new Texture(atlas_cells * cell_size, atlas_cells * cell_size, GL_RGBA, GL_UNSIGNED_BYTE, false);
+				slot = decal_atlas_used++;
+				FBO* fbo = Texture::getGlobalFBO(decal_atlas);
+				fbo->bind();
+				glViewport((slot % atlas_cells) * cell_size, (slot / atlas_cells) * cell_size, cell_size, cell_size);
+				glDisable(GL_BLEND);
+				texture->toViewport();
+				fbo->unbind();
+			}
+			else
+				std::cout << "Decal texture not found or atlas full: " << decal->texture << std::endl;
+			it = decal_atlas_slots.insert(std::make_pair(decal->texture, slot)).first;
+		}
+		if (it->second == -1) {
+			decals_without_cell++;
+			continue;
+		}
+		if (imodels.size() >= max_decals) {
+			decals_over_limit++;
+			continue;
+		}
+
+		int index = imodels.size();
+		Matrix44 imodel = decal->model;
+		imodel.inverse();
+		imodels.push_back(imodel);
+		atlas_rects.push_back(Vector4((it->second % atlas_cells) / (float)atlas_cells, (it->second / atlas_cells) / (float)atlas_cells, 1.0 / atlas_cells, 1.0 / atlas_cells));
+
+		//screen rectangle of the corners, the whole screen if the camera is close enough to cross it
+		Vector2 rect_min(width, height);
+		Vector2 rect_max(0, 0);
+		for (int j = 0; j < 8; j++) {
+			Vector3 corner((j & 1) ? 0.5 : -0.5, (j & 2) ? 0.5 : -0.5, (j & 4) ? 0.5 : -0.5);
+			Vector4 proj = camera->viewprojection_matrix * Vector4(decal->model * corner, 1.0);
+			if (proj.w <= 0.0) {
+				rect_min = Vector2(0, 0);
+				rect_max = Vector2(width, height);
+				break;
+			}
+			Vector2 pos((proj.x / proj.w * 0.5 + 0.5) * width, (proj.y / proj.w * 0.5 + 0.5) * height);
+			rect_min = Vector2(std::min(rect_min.x, pos.x), std::min(rect_min.y, pos.y));
+			rect_max = Vector2(std::max(rect_max.x, pos.x), std::max(rect_max.y, pos.y));
+		}
+		int x0 = clamp(rect_min.x / tile_size, 0, tiles_x - 1);
+		int y0 = clamp(rect_min.y / tile_size, 0, tiles_y - 1);
+		int x1 = clamp(rect_max.x / tile_size, 0, tiles_x - 1);
+		int y1 = clamp(rect_max.y / tile_size, 0, tiles_y - 1);
+		for (int y = y0; y <= y1; y++)
+			for (int x = x0; x <= x1; x++)
+				tile_masks[x + y * tiles_x] |= 1u << index;
+	}
+
+	decals_drawn = imodels.size();
+	if (!imodels.size())
+		return;
+
+	if (decal_tiles && (decal_tiles->width != tiles_x || decal_tiles->height != tiles_y)) {
+		delete decal_tiles;
+		decal_tiles = NULL;
+	}
+	if (!decal_tiles) {
+		decal_tiles = new Texture(tiles_x, tiles_y, GL_RED_INTEGER, GL_UNSIGNED_INT, false, NULL, GL_R32UI);
+		decal_tiles->bind();
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		decal_tiles->unbind();
+	}
+	decal_tiles->bind();
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tiles_x, tiles_y, GL_RED_INTEGER, GL_UNSIGNED_INT, &tile_masks[0]);
+	decal_tiles->unbind();
+
+	Matrix44 inv_vp = camera->viewprojection_matrix * uvScaleMatrix(render_uv_scale);
+	inv_vp.inverse();
+
+	//only gb0 is attached, so the depth can be read without copying it
+	FBO* fbo = Texture::getGlobalFBO(gbuffers_fbo->color_textures[0]);
+	bindScaled(fbo, render_uv_scale);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glColorMask(true, true, true, false);
+
+	Shader* shader = Shader::Get("decal");
+	shader->enable();
+	shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+	shader->setUniform("u_decal_atlas", decal_atlas, 5);
+	shader->setUniform("u_decal_tiles", decal_tiles, 6);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)render_target_width, 1.0 / (float)render_target_height));
+	shader->setUniform("u_tile_size", tile_size);
+	shader->setUniform("u_num_decals", (int)imodels.size());
+	shader->setMatrix44Array("u_decal_imodel", &imodels[0], imodels.size());
+	shader->setUniform4Array("u_decal_rect", (float*)&atlas_rects[0], atlas_rects.size());
+	Mesh::getQuad()->render(GL_TRIANGLES);
+
+	glColorMask(true, true, true, true);
+	glDisable(GL_BLEND);
+	fbo->unbind();
+}
+
+//Frees every target that depends on the render resolution, they are created again with the new size
+void GTR::Renderer::releaseDeferredTargets() {
+	for (int i = 0; i < 2; i++) {
+		delete gbuffers_fbo;
+		delete illumination_fbo;
+		delete postFX_textureA;
+		delete postFX_textureB;
+		delete postFX_textureC;
+		delete postFX_textureD;
+		delete blurred_texture;
+		gbuffers_fbo = illumination_fbo = NULL;
+		postFX_textureA = postFX_textureB = postFX_textureC = postFX_textureD = blurred_texture = NULL;
+		swapDeferredTargets(); //also the ones of the other format
+	}
+	delete ssao_fbo;
+	delete ssao_blur;
+	delete volumetric_fbo;
+	ssao_fbo = ssao_blur = volumetric_fbo = NULL;
+}
+
+//Picks the render resolution for this frame from the GPU time of the previous ones
+void GTR::Renderer::updateRenderScale() {
+	int window_width = Application::instance->window_width;
+	int window_height = Application::instance->window_height;
+	const float step = 0.05;
+
+	if (!gpu_time_queries[0])
+		glGenQueries(3, gpu_time_queries);
+
+	//the query we are about to reuse was issued 3 frames ago, so reading it should not stall
+	GLint available = 0;
+	if (queries_issued >= 3)
+		glGetQueryObjectiv(gpu_time_queries[query_index], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (available) {
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(gpu_time_queries[query_index], GL_QUERY_RESULT, &elapsed);
+		gpu_frame_ms = elapsed / 1000000.0;
+	}
+
+	if (!dynamic_resolution)
+		render_scale = 1.0;
+	else if (scale_cooldown > 0)
+		scale_cooldown--; //wait until the frames in flight use the new scale
+	else if (available && gpu_frame_ms > 0.0) {
+		//the cost grows with the pixel count, so the scale follows the square root of the time ratio
+		float wanted = render_scale * sqrt(target_frame_ms / gpu_frame_ms);
+		wanted = clamp(wanted, min_render_scale, max_render_scale);
+
+		//one step at a time and with some margin, so it does not oscillate between two scales
+		float old_scale = render_scale;
+		if (wanted < render_scale - step * 0.5)
+			render_scale = std::max(render_scale - step, min_render_scale);
+		else if (wanted > render_scale + step * 1.5)
+			render_scale = std::min(render_scale + step, max_render_scale);
+		if (render_scale != old_scale)
+			scale_cooldown = 3;
+	}
+
+	render_scale = clamp(render_scale, min_render_scale, max_render_scale);
+	if (!dynamic_resolution)
+		render_scale = 1.0;
+	output_width = std::max((int)(window_width * render_scale), 1);
+	output_height = std::max((int)(window_height * render_scale), 1);
+
+	//the targets are sized for the max scale, so changing the scale does not reallocate them
+	float max_scale = dynamic_resolution ? max_render_scale : 1.0;
+	output_target_width = std::max((int)(window_width * max_scale), output_width);
+	output_target_height = std::max((int)(window_height * max_scale), output_height);
+
+	//with temporal upscaling only the post chain runs at the output size
+	float upscale = taa_upscale ? taa_render_scale : 1.0;
+	render_width = std::max((int)(output_width * upscale), 1);
+	render_height = std::max((int)(output_height * upscale), 1);
+	render_target_width = std::max((int)(output_target_width * upscale), render_width);
+	render_target_height = std::max((int)(output_target_height * upscale), render_height);
+
+	render_uv_scale = Vector2(render_width / (float)render_target_width, render_height / (float)render_target_height);
+	output_uv_scale = Vector2(output_width / (float)output_target_width, output_height / (float)output_target_height);
+}
+
+//Binds a target with the viewport on the part of it that holds the image
+void GTR::Renderer::bindScaled(FBO* fbo, Vector2 uv_scale) {
+	fbo->bind();
+	glViewport(0, 0, std::max((int)(fbo->width * uv_scale.x + 0.5), 1), std::max((int)(fbo->height * uv_scale.y + 0.5), 1));
+}
+
+//Shows the part in use of a target on a rectangle of the window, the viewport is enlarged and the scissor cuts the rest
+void GTR::Renderer::showTarget(Texture* texture, Vector2 uv_scale, int x, int y, int w, int h, Shader* shader) {
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(x, y, w, h);
+	glViewport(x, y, w / uv_scale.x, h / uv_scale.y);
+	texture->toViewport(shader);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+//Fills a view aligned volume (froxels) with the in-scattering of all the lights and integrates it front to back,
+//the cost depends on the size of the volume and not on the screen resolution
+void GTR::Renderer::computeVolumetricFroxels(GTR::Scene* scene, Camera* camera) {
+	const int froxel_width = 160;
+	const int froxel_height = 90;
+	const int froxel_slices = 64;
+	Shader* shader = NULL;
+	Mesh* quad = Mesh::getQuad();
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+	Vector3 front = (camera->center - camera->eye).normalize();
+	Vector3 dims(froxel_width, froxel_height, froxel_slices);
+	Vector2 range(camera->near_plane, froxel_max_distance);
+	float blend = 0.1;
+
+	if (!froxel_fbo) {
+		froxel_fbo = new FBO();
+		froxel_scatter = new Texture();
+		froxel_scatter->create3D(froxel_width, froxel_height, froxel_slices, GL_RGBA, GL_HALF_FLOAT, false, NULL, GL_RGBA16F);
+		froxel_historyA = new Texture();
+		froxel_historyA->create3D(froxel_width, froxel_height, froxel_slices, GL_RGBA, GL_HALF_FLOAT, false, NULL, GL_RGBA16F);
+		froxel_historyB = new Texture();
+		froxel_historyB->create3D(froxel_width, froxel_height, froxel_slices, GL_RGBA, GL_HALF_FLOAT, false, NULL, GL_RGBA16F);
+		froxel_integrated = new Texture();
+		froxel_integrated->create3D(froxel_width, froxel_height, froxel_slices, GL_RGBA, GL_HALF_FLOAT, false, NULL, GL_RGBA16F);
+		froxel_carryA = new Texture(froxel_width, froxel_height, GL_RGBA, GL_FLOAT, false, NULL, GL_RGBA32F);
+		froxel_carryB = new Texture(froxel_width, froxel_height, GL_RGBA, GL_FLOAT, false, NULL, GL_RGBA32F);
+		glGenFramebuffers(1, &froxel_integrate_fbo);
+		blend = 1.0; //no history yet
+	}
+
+	glDisable(GL_DEPTH_TEST);
+
+	//Inject: in-scattering and extinction of every froxel, one additive pass per light
+	shader = Shader::Get("froxel_inject");
+	shader->enable();
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_camera_front", front);
+	shader->setUniform("u_froxel_dims", dims);
+	shader->setUniform("u_froxel_range", range);
+	shader->setUniform("u_air_density", scene->air_density);
+	shader->setUniform("u_frame", (int)(Application::instance->frame % 64));
+
+	for (int slice = 0; slice < froxel_slices; slice++) {
+		float slice_near = range.x * pow(range.y / range.x, slice / (float)froxel_slices);
+		float slice_far = range.x * pow(range.y / range.x, (slice + 1) / (float)froxel_slices);
+
+		froxel_fbo->setTexture(froxel_scatter, slice);
+		froxel_fbo->bind();
+		glDisable(GL_BLEND);
+		glClearColor(0.0, 0.0, 0.0, scene->air_density); //alpha stores the extinction
+		glClear(GL_COLOR_BUFFER_BIT);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE);
+		shader->setUniform("u_slice", (float)slice);
+
+		for (int i = 0; i < lights.size(); i++) {
+			LightEntity* light = lights[i];
+			if (light->light_type != GTR::eLightType::DIRECTIONAL) {
+				//skip the lights that do not reach this slice, so local lights only pay for the froxels they touch
+				float light_depth = (light->model * Vector3() - camera->eye).dot(front);
+				if (light_depth + light->max_distance < slice_near || light_depth - light->max_distance > slice_far)
+					continue;
+				if (!camera->testSphereInFrustum(light->model * Vector3(), light->max_distance))
+					continue;
+			}
+			lightToShader(light, shader);
+			quad->render(GL_TRIANGLES);
+		}
+		froxel_fbo->unbind();
+	}
+	glDisable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	//Temporal: blend with the reprojected volume of the previous frames, the injection is jittered in depth
+	shader = Shader::Get("froxel_temporal");
+	shader->enable();
+	shader->setUniform("u_texture", froxel_scatter, 0);
+	shader->setUniform("u_history_texture", froxel_historyA, 1);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_viewprojection_old", vp_matrix_last);
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_camera_front", front);
+	shader->setUniform("u_froxel_dims", dims);
+	shader->setUniform("u_froxel_range", range);
+	shader->setUniform("u_blend", blend);
+	for (int slice = 0; slice < froxel_slices; slice++) {
+		froxel_fbo->setTexture(froxel_historyB, slice);
+		froxel_fbo->bind();
+		shader->setUniform("u_slice", (float)slice);
+		quad->render(GL_TRIANGLES);
+		froxel_fbo->unbind();
+	}
+	std::swap(froxel_historyA, froxel_historyB);
+
+	//Integrate: every froxel stores the light and the opacity accumulated from the camera up to it.
+	//a draw writes 7 slices and carries the running sum to the next one, so every froxel is read once
+	const int batch_slices = 7;
+	shader = Shader::Get("froxel_integrate");
+	shader->enable();
+	shader->setUniform("u_texture", froxel_historyA, 0);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_camera_front", front);
+	shader->setUniform("u_froxel_dims", dims);
+	shader->setUniform("u_froxel_range", range);
+	glBindFramebuffer(GL_FRAMEBUFFER, froxel_integrate_fbo);
+	glPushAttrib(GL_VIEWPORT_BIT);
+	glViewport(0, 0, froxel_width, froxel_height);
+	for (int first = 0; first < froxel_slices; first += batch_slices) {
+		GLenum buffers[batch_slices + 1];
+		for (int i = 0; i < batch_slices; i++) {
+			bool used = first + i < froxel_slices;
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, used ? froxel_integrated->texture_id : 0, 0, used ? first + i : 0);
+			buffers[i] = used ? GL_COLOR_ATTACHMENT0 + i : GL_NONE;
+		}
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + batch_slices, GL_TEXTURE_2D, froxel_carryB->texture_id, 0);
+		buffers[batch_slices] = GL_COLOR_ATTACHMENT0 + batch_slices;
+		glDrawBuffers(batch_slices + 1, buffers);
+
+		shader->setUniform("u_carry_texture", froxel_carryA, 1);
+		shader->setUniform("u_first_slice", first);
+		quad->render(GL_TRIANGLES);
+		std::swap(froxel_carryA, froxel_carryB);
+	}
+	glPopAttrib();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void GTR::Renderer::computeHalfResSSAO(Camera* camera) {
+	int half_width = std::max(render_target_width / 2, 1);
+	int half_height = std::max(render_target_height / 2, 1);
+	Shader* shader = NULL;
+	FBO* fbo = NULL;
+	Mesh* quad = Mesh::getQuad();
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+	Matrix44 vp_uv = camera->viewprojection_matrix * uvScaleMatrix(render_uv_scale);
+	Matrix44 inv_vp_uv = vp_uv;
+	inv_vp_uv.inverse();
+	Vector2 nearfar(camera->near_plane, camera->far_plane);
+
+	if (!ssao_half_depth || ssao_half_depth->width != half_width || ssao_half_depth->height != half_height) {
+		if (ssao_half_depth) {
+			delete ssao_half_depth;
+			delete ssao_half_texture;
+			delete ssao_historyA;
+			delete ssao_historyB;
+		}
+		//depth and raw ao only need one channel, the history keeps (ao, linear depth)
+		ssao_half_depth = new Texture(half_width, half_height, GL_RED, GL_FLOAT, false, NULL, GL_R32F);
+		ssao_half_texture = new Texture(half_width, half_height, GL_RED, GL_HALF_FLOAT, false, NULL, GL_R16F);
+		ssao_historyA = new Texture(half_width, half_height, GL_RG, GL_HALF_FLOAT, false, NULL, GL_RG16F);
+		ssao_historyB = new Texture(half_width, half_height, GL_RG, GL_HALF_FLOAT, false, NULL, GL_RG16F);
+
+		//an empty history is rejected by the depth test of the temporal pass
+		Texture::getGlobalFBO(ssao_historyA)->bind();
+		glClearColor(1.0, 0.0, 0.0, 1.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+		Texture::getGlobalFBO(ssao_historyA)->unbind();
 	}
+
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+
+	//Downsample depth, keeping the farthest of every 2x2 block
+	fbo = Texture::getGlobalFBO(ssao_half_depth);
+	bindScaled(fbo, render_uv_scale);
+	shader = Shader::Get("depth_downsample");
+	shader->enable();
+	shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+	quad->render(GL_TRIANGLES);
+	fbo->unbind();
+
+	//Few samples per pixel, rotated with a noise that changes every frame
+	fbo = Texture::getGlobalFBO(ssao_half_texture);
+	bindScaled(fbo, render_uv_scale);
+	shader = Shader::Get("ssao_half");
+	shader->enable();
+	shader->setUniform("u_depth_texture", ssao_half_depth, 4);
+	shader->setUniform("u_gb1_texture", gbuffers_fbo->color_textures[1], 2);
+	shader->setUniform("u_octahedral_normals", compact_formats ? 1 : 0);
+	shader->setUniform3Array("u_points", (float*)&ssao_half_random_points[0], ssao_half_random_points.size());
+	shader->setUniform("u_viewprojection", vp_uv);
+	shader->setUniform("u_inverse_viewprojection", inv_vp_uv);
+	shader->setUniform("u_camera_nearfar", nearfar);
+	shader->setUniform("u_frame", (int)(Application::instance->frame % 64));
+	shader->setUniform("u_uv_scale", render_uv_scale);
+	quad->render(GL_TRIANGLES);
+	fbo->unbind();
+
+	//Accumulate with the reprojected result of the previous frames
+	fbo = Texture::getGlobalFBO(ssao_historyB);
+	bindScaled(fbo, render_uv_scale);
+	shader = Shader::Get("ssao_temporal");
+	shader->enable();
+	shader->setUniform("u_history_texture", ssao_historyA, 1);
+	shader->setUniform("u_depth_texture", ssao_half_depth, 4);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_viewprojection_old", vp_matrix_last);
+	shader->setUniform("u_camera_nearfar", nearfar);
+	shader->setUniform("u_blend", 0.1f);
+	shader->setUniform("u_uv_scale", render_uv_scale);
+	shader->setUniform("u_history_uv_scale", last_render_uv_scale);
+	ssao_half_texture->toViewport(shader);
+	fbo->unbind();
+	std::swap(ssao_historyA, ssao_historyB);
+
+	//Depth aware upsample to full resolution
+	bindScaled(ssao_blur, render_uv_scale);
+	shader = Shader::Get("ssao_upsample");
+	shader->enable();
+	shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+	shader->setUniform("u_camera_nearfar", nearfar);
+	shader->setUniform("u_uv_scale", render_uv_scale);
+	ssao_historyA->toViewport(shader);
+	ssao_blur->unbind();
 }
 
 void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Camera* camera) {
 	Shader* shader = NULL;
 	Texture* current_texture = color_texture;
 	FBO* fbo = NULL;
-	int width = Application::instance->window_width;
-	int height = Application::instance->window_height;
+	int width = output_target_width;
+	int height = output_target_height;
 	Matrix44 inv_vp = camera->viewprojection_matrix;
 	inv_vp.inverse();
+	//for the passes that reconstruct the position in the uv space of the output targets
+	Matrix44 inv_vp_uv = camera->viewprojection_matrix * uvScaleMatrix(output_uv_scale);
+	inv_vp_uv.inverse();
+	Matrix44 vp_last_uv = vp_matrix_last * uvScaleMatrix(output_uv_scale);
+
+	if (taa_upscale) {
+		//Temporal upscale from the internal resolution to the output one
+		float blend = 0.1;
+		if (!taa_historyA || taa_historyA->width != width || taa_historyA->height != height) {
+			delete taa_historyA;
+			delete taa_historyB;
+			int hdr_format = compact_formats ? GL_R11F_G11F_B10F : GL_RGB16F;
+			taa_historyA = new Texture(width, height, GL_RGB, GL_FLOAT, false, NULL, hdr_format);
+			taa_historyB = new Texture(width, height, GL_RGB, GL_FLOAT, false, NULL, hdr_format);
+			blend = 1.0; //no history yet
+		}
+		fbo = Texture::getGlobalFBO(taa_historyB);
+		bindScaled(fbo, output_uv_scale);
+		shader = Shader::Get("taa_resolve");
+		shader->enable();
+		shader->setUniform("u_uv_scale", render_uv_scale);
+		shader->setUniform("u_history_uv_scale", last_output_uv_scale);
+		shader->setUniform("u_history_texture", taa_historyA, 1);
+		shader->setUniform("u_velocity_texture", gbuffers_fbo->color_textures[3], 2);
+		shader->setUniform("u_depth_texture", depth_texture, 3);
+		shader->setUniform("u_inverse_viewprojection", inv_vp);
+		shader->setUniform("u_viewprojection_old", vp_matrix_last);
+		shader->setUniform("u_jitter", taa_jitter);
+		shader->setUniform("u_blend", blend);
+		current_texture->toViewport(shader);
+		fbo->unbind();
+		std::swap(taa_historyA, taa_historyB);
+		current_texture = taa_historyA;
+	}
 
 	if (dof) {
 		fbo = Texture::getGlobalFBO(postFX_textureA);
-		fbo->bind();
+		bindScaled(fbo, output_uv_scale);
 		shader = Shader::Get("nonegativecolors");
 		shader->enable();
+		shader->setUniform("u_uv_scale", output_uv_scale);
 		current_texture->toViewport(shader);
 		fbo->unbind();
 		current_texture = postFX_textureA;
@@ -633,17 +1622,19 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 		//Blur
 		for (int i = 0; i < 16; i++) {
 			fbo = Texture::getGlobalFBO(postFX_textureA);
-			fbo->bind();
+			bindScaled(fbo, output_uv_scale);
 			shader = Shader::Get("blur2");
 			shader->enable();
+			shader->setUniform("u_uv_scale", output_uv_scale);
 			shader->setUniform("parameters", Vector2(1, 0));
 			current_texture->toViewport(shader);
 			fbo->unbind();
 
 			fbo = Texture::getGlobalFBO(blurred_texture);
-			fbo->bind();
+			bindScaled(fbo, output_uv_scale);
 			shader = Shader::Get("blur2");
 			shader->enable();
+			shader->setUniform("u_uv_scale", output_uv_scale);
 			shader->setUniform("parameters", Vector2(0, 1));
 			postFX_textureA->toViewport(shader);
 			fbo->unbind();
@@ -656,25 +1647,25 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	if (motion_blur) {
 		//Motion Blur
 		fbo = Texture::getGlobalFBO(postFX_textureA);
-		fbo->bind();
+		bindScaled(fbo, output_uv_scale);
 		shader = Shader::Get("motionblur");
 		shader->enable();
+		shader->setUniform("u_uv_scale", output_uv_scale);
 		shader->setUniform("u_depth_texture", depth_texture, 1);
-		shader->setUniform("u_inverse_viewprojection", inv_vp);
-		shader->setUniform("u_viewprojection_old", vp_matrix_last);
+		shader->setUniform("u_inverse_viewprojection", inv_vp_uv);
+		shader->setUniform("u_viewprojection_old", vp_last_uv);
 		current_texture->toViewport(shader);
 		fbo->unbind();
 		current_texture = postFX_textureA;
 		std::swap(postFX_textureA, postFX_textureB);
-
-		vp_matrix_last = camera->viewprojection_matrix;
 	}
 
 	//Saturation + Vigneting
 	fbo = Texture::getGlobalFBO(postFX_textureA);
-	fbo->bind();
+	bindScaled(fbo, output_uv_scale);
 	shader = Shader::Get("vigneting");
 	shader->enable();
+	shader->setUniform("u_uv_scale", output_uv_scale);
 	shader->setUniform("u_vigneting", vigneting);
 	shader->setUniform("u_saturation", saturation);
 	current_texture->toViewport(shader);
@@ -682,12 +1673,13 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	current_texture = postFX_textureA;
 	std::swap(postFX_textureA, postFX_textureB);
 
-	if (ffxa) {
+	if (ffxa && !taa_upscale) {
 		//FFXA
 		fbo = Texture::getGlobalFBO(postFX_textureA);
-		fbo->bind();
+		bindScaled(fbo, output_uv_scale);
 		shader = Shader::Get("ffxa");
 		shader->enable();
+		shader->setUniform("u_uv_scale", output_uv_scale);
 		shader->setUniform("u_viewportSize", Vector2((float)width, (float)height));
 		shader->setUniform("u_iViewportSize", Vector2(1.0 / (float)width, 1.0 / (float)height));
 		current_texture->toViewport(shader);
@@ -699,10 +1691,11 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	if (chr_lns) {
 		//Chromatic aberration and lens distortion
 		fbo = Texture::getGlobalFBO(postFX_textureA);
-		fbo->bind();
+		bindScaled(fbo, output_uv_scale);
 		shader = Shader::Get("chrlns");
 		shader->enable();
-		shader->setUniform("resolution", Vector2((float)width, (float)height));
+		shader->setUniform("u_uv_scale", output_uv_scale);
+		shader->setUniform("resolution", Vector2((float)output_width, (float)output_height));
 		current_texture->toViewport(shader);
 		shader->disable();
 		fbo->unbind();
@@ -711,9 +1704,10 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	}
 	//LUT
 	/*fbo = Texture::getGlobalFBO(postFX_textureA);
-	fbo->bind();
+	bindScaled(fbo, output_uv_scale);
 	shader = Shader::Get("lut");
 	shader->enable();
+	shader->setUniform("u_uv_scale", output_uv_scale);
 	shader->setUniform("u_amount", 3.0f);
 	shader->setUniform("u_textureB", postFX_textureC, 1);
 	current_texture->toViewport(shader);
@@ -725,18 +1719,20 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	if (bloom) {
 		//Bloom
 		fbo = Texture::getGlobalFBO(postFX_textureC);
-		fbo->bind();
+		bindScaled(fbo, output_uv_scale);
 		shader = Shader::Get("contrast");
 		shader->enable();
+		shader->setUniform("u_uv_scale", output_uv_scale);
 		shader->setUniform("u_intensity", contrast);
 		current_texture->toViewport(shader);
 		fbo->unbind();
 		current_texture = postFX_textureC;
 
 		fbo = Texture::getGlobalFBO(postFX_textureD);
-		fbo->bind();
+		bindScaled(fbo, output_uv_scale);
 		shader = Shader::Get("threshold");
 		shader->enable();
+		shader->setUniform("u_uv_scale", output_uv_scale);
 		shader->setUniform("u_threshold", threshold);
 		current_texture->toViewport(shader);
 		fbo->unbind();
@@ -744,18 +1740,20 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 
 		for (int i = 0; i < 12; i++) {
 			fbo = Texture::getGlobalFBO(postFX_textureA);
-			fbo->bind();
+			bindScaled(fbo, output_uv_scale);
 			shader = Shader::Get("blur");
 			shader->enable();
+			shader->setUniform("u_uv_scale", output_uv_scale);
 			shader->setUniform("u_offset", vec2(pow(2.0f, i) / current_texture->width, 0.0) * debug_factor);
 			shader->setUniform("u_intensity", 1.0f);
 			current_texture->toViewport(shader);
 			fbo->unbind();
 
 			fbo = Texture::getGlobalFBO(postFX_textureB);
-			fbo->bind();
+			bindScaled(fbo, output_uv_scale);
 			shader = Shader::Get("blur");
 			shader->enable();
+			shader->setUniform("u_uv_scale", output_uv_scale);
 			shader->setUniform("u_offset", vec2(0.0, pow(2.0f, i) / current_texture->height) * debug_factor);
 			shader->setUniform("u_intensity", 1.0f);
 			postFX_textureA->toViewport(shader);
@@ -764,9 +1762,10 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 		}
 
 		fbo = Texture::getGlobalFBO(postFX_textureA);
-		fbo->bind();
+		bindScaled(fbo, output_uv_scale);
 		shader = Shader::Get("mix");
 		shader->enable();
+		shader->setUniform("u_uv_scale", output_uv_scale);
 		shader->setUniform("u_intensity", debug_factor2);
 		shader->setUniform("u_textureB", postFX_textureC, 1);
 		current_texture->toViewport(shader);
@@ -778,12 +1777,13 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 	if (dof) {
 		//Depth of field
 		fbo = Texture::getGlobalFBO(postFX_textureA);
-		fbo->bind();
+		bindScaled(fbo, output_uv_scale);
 		shader = Shader::Get("dof");
 		shader->enable();
+		shader->setUniform("u_uv_scale", output_uv_scale);
 		shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
 		shader->setUniform("u_textureB", blurred_texture, 1);
-		shader->setUniform("u_inverse_viewprojection", inv_vp);
+		shader->setUniform("u_inverse_viewprojection", inv_vp_uv);
 		shader->setUniform("u_depth_texture", depth_texture, 2);
 		shader->setUniform("u_min_distance", min_distance_dof);
 		shader->setUniform("u_max_distance", max_distance_dof);
@@ -794,17 +1794,73 @@ void GTR::Renderer::applyFX(Texture* color_texture, Texture* depth_texture, Came
 		std::swap(postFX_textureA, postFX_textureB);
 	}
 
+	//Auto exposure, it only touches a 64x64 target and two 1x1 textures
+	if (auto_exposure)
+		computeExposure(color_texture);
+
 	//Tonemapper
 	shader = Shader::Get("tonemapper");
 	shader->enable();
+	shader->setUniform("u_uv_scale", output_uv_scale);
 	shader->setUniform("u_average_lum", average_lum);
 	shader->setUniform("u_lumwhite2", lum_white * lum_white);
 	shader->setUniform("u_scale", lum_scale);
+	if (auto_exposure) {
+		shader->setUniform("u_auto_exposure", 1);
+		shader->setUniform("u_exposure_texture", exposure_textureA, 1);
+	}
+	else shader->setUniform("u_auto_exposure", 0);
 
 	glDisable(GL_BLEND);
 	current_texture->toViewport(shader);
 }
 
+void GTR::Renderer::computeExposure(Texture* color_texture) {
+	Shader* shader = NULL;
+	FBO* fbo = NULL;
+	const int lum_size = 64;
+
+	if (!log_lum_texture) {
+		//power of two so the mipmap chain ends in a 1x1 texel with the average
+		log_lum_texture = new Texture(lum_size, lum_size, GL_RGB, GL_FLOAT, true);
+
+		//both start at middle grey so the first frames do not flash
+		float data[3] = { 1.0, 1.0, 1.0 };
+		exposure_textureA = new Texture(1, 1, GL_RGB, GL_FLOAT, false, (Uint8*)data);
+		exposure_textureB = new Texture(1, 1, GL_RGB, GL_FLOAT, false, (Uint8*)data);
+	}
+
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	//Log luminance of the scene at low resolution
+	fbo = Texture::getGlobalFBO(log_lum_texture);
+	fbo->bind();
+	shader = Shader::Get("luminance");
+	shader->enable();
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)lum_size, 1.0 / (float)lum_size));
+	shader->setUniform("u_uv_scale", render_uv_scale);
+	color_texture->toViewport(shader);
+	fbo->unbind();
+
+	//the GPU averages it for us while building the mipmaps
+	log_lum_texture->generateMipmaps();
+
+	//Temporal adaptation, the result stays in a 1x1 texture read by the tonemapper
+	float dt = Application::instance->elapsed_time;
+	fbo = Texture::getGlobalFBO(exposure_textureB);
+	fbo->bind();
+	shader = Shader::Get("exposure_adapt");
+	shader->enable();
+	shader->setUniform("u_log_lum_texture", log_lum_texture, 1);
+	shader->setUniform("u_max_lod", (float)log2(lum_size));
+	shader->setUniform("u_adapt_factor", (float)(1.0 - exp(-dt * exposure_speed)));
+	shader->setUniform("u_lum_range", Vector2(min_exposure_lum, max_exposure_lum));
+	exposure_textureA->toViewport(shader);
+	fbo->unbind();
+	std::swap(exposure_textureA, exposure_textureB);
+}
+
 std::vector<Vector3> GTR::generateSpherePoints(int num, float radius, bool hemi) {
 	std::vector<Vector3> points;
 	points.resize(num);
@@ -837,6 +1893,7 @@ void GTR::Renderer::gbuffertoshader(FBO* gbuffers_fbo, GTR::Scene* scene, Camera
 	shader->setUniform("u_gb1_texture", gbuffers_fbo->color_textures[1], 2);
 	shader->setUniform("u_gb2_texture", gbuffers_fbo->color_textures[2], 3);
 	shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
+	shader->setUniform("u_octahedral_normals", compact_formats ? 1 : 0);
 
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 }
@@ -932,15 +1989,15 @@ void GTR::Renderer::generateShadowMap(LightEntity* light) {
 }
 
 //renders all the prefab
-void GTR::Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera)
+void GTR::Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, int entity_id)
 {
 	assert(prefab && "PREFAB IS NULL");
 	//assign the model to the root node
-	renderNode(model, &prefab->root, camera);
+	renderNode(model, &prefab->root, camera, entity_id);
 }
 
 //renders a node of the prefab and its children
-void GTR::Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+void GTR::Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera, int entity_id)
 {
 	if (!node->visible)
 		return;
@@ -960,6 +2017,12 @@ void GTR::Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Ca
 		rc.mesh = node->mesh;
 		rc.material = node->material;
 		rc.model = node_model;
+
+		//the prefab can be shared, the entity and the node identify the instance
+		std::pair<int, int> key(entity_id, node->m_Id);
+		auto it = previous_models.find(key);
+		rc.prev_model = it != previous_models.end() ? it->second : node_model;
+		current_models[key] = node_model;
 		rc.world_bounding = world_bounding;
 		rc.distance_to_camera = nodepos.distance(camera->eye);
 		if (node->material->alpha_mode == GTR::eAlphaMode::BLEND) rc.distance_to_camera += 1000000;
@@ -971,11 +2034,11 @@ void GTR::Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Ca
 
 	//iterate recursively with children
 	for (int i = 0; i < node->children.size(); ++i)
-		renderNode(prefab_model, node->children[i], camera);
+		renderNode(prefab_model, node->children[i], camera, entity_id);
 }
 
 //renders a mesh given its transform and material
-void GTR::Renderer::renderMeshWithMaterialandLight(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void GTR::Renderer::renderMeshWithMaterialandLight(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const SphericalHarmonics* probe_sh)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material )
@@ -988,7 +2051,7 @@ void GTR::Renderer::renderMeshWithMaterialandLight(const Matrix44 model, Mesh* m
 	Texture* emissive_texture = NULL;
 	Texture* occlusion_texture = NULL;
 	Texture* normal_texture = NULL;
-	Scene* scene = GTR::Scene::instance;
+	Scene* scene = current_scene;
 
 	int num_lights = lights.size();
 
@@ -1047,10 +2110,8 @@ void GTR::Renderer::renderMeshWithMaterialandLight(const Matrix44 model, Mesh* m
 		shader->setUniform("u_have_normal_texture", 1); //Un prefab puede no tener un normal_map
 	} else shader->setUniform("u_have_normal_texture", 0);
 
-	Texture* reflection = skybox;
-	if (probe && !is_rendering_reflections)
-		reflection = probe->texture;
-	shader->setUniform("u_skybox_texture", reflection, 9);
+	shader->setUniform("u_skybox_texture", skybox, 9);
+	reflectionProbesToShader(shader, model * Vector3());
 
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
 	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
@@ -1059,6 +2120,13 @@ void GTR::Renderer::renderMeshWithMaterialandLight(const Matrix44 model, Mesh* m
 	shader->setUniform("u_roughness_factor", material->roughness_factor);
 	shader->setUniform("u_metallic_factor", material->metallic_factor);
 
+	//irradiance of the probes around the object, sampled on the CPU
+	if (probe_sh) {
+		shader->setUniform3Array("u_probe_sh", (float*)probe_sh->coeffs, 9);
+		shader->setUniform("u_have_probe_sh", 1);
+	}
+	else shader->setUniform("u_have_probe_sh", 0);
+
 	glDepthFunc(GL_LEQUAL);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 
@@ -1161,7 +2229,7 @@ void GTR::Renderer::renderMeshWithMaterialandLight(const Matrix44 model, Mesh* m
 	glDepthFunc(GL_LESS);
 }
 
-void GTR::Renderer::renderMeshWithMaterialtoGBuffer(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void GTR::Renderer::renderMeshWithMaterialtoGBuffer(const Matrix44 model, const Matrix44 prev_model, Mesh* mesh, GTR::Material* material, Camera* camera)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -1176,7 +2244,7 @@ void GTR::Renderer::renderMeshWithMaterialtoGBuffer(const Matrix44 model, Mesh*
 	Texture* emissive_texture = NULL;
 	Texture* occlusion_texture = NULL;
 	Texture* normal_texture = NULL;
-	Scene* scene = GTR::Scene::instance;
+	Scene* scene = current_scene;
 
 	texture = material->color_texture.texture;
 	//texture = material->emissive_texture;
@@ -1209,6 +2277,10 @@ void GTR::Renderer::renderMeshWithMaterialtoGBuffer(const Matrix44 model, Mesh*
 	shader->setUniform("u_model", model);
 	float t = getTime();
 	shader->setUniform("u_time", t);
+	shader->setUniform("u_octahedral_normals", compact_formats ? 1 : 0);
+	shader->setUniform("u_model_old", prev_model);
+	shader->setUniform("u_viewprojection_current", vp_matrix_unjittered);
+	shader->setUniform("u_viewprojection_old", vp_matrix_last);
 
 	shader->setUniform("u_color", material->color);
 	if (texture)
@@ -1244,6 +2316,102 @@ void GTR::Renderer::renderMeshWithMaterialtoGBuffer(const Matrix44 model, Mesh*
 	shader->disable();
 }
 
+//uniforms of gbuffers.fs, resolved on this thread before recording
+enum eGBufferUniform {
+	GB_VIEWPROJECTION, GB_CAMERA_POSITION, GB_TIME, GB_OCTAHEDRAL_NORMALS, GB_VIEWPROJECTION_CURRENT, GB_VIEWPROJECTION_OLD,
+	GB_MODEL, GB_MODEL_OLD, GB_COLOR, GB_TEXTURE, GB_TEXTURE_EMISSIVE, GB_TEXTURE_OCCLUSION, GB_HAVE_OCCLUSION_TEXTURE,
+	GB_TEXTURE_NORMAL, GB_HAVE_NORMAL_TEXTURE, GB_ALPHA_CUTOFF, GB_EMISSIVE_FACTOR, GB_ROUGHNESS_FACTOR, GB_METALLIC_FACTOR,
+	GB_NUM_UNIFORMS
+};
+static const char* gbuffer_uniform_names[GB_NUM_UNIFORMS] = {
+	"u_viewprojection", "u_camera_position", "u_time", "u_octahedral_normals", "u_viewprojection_current", "u_viewprojection_old",
+	"u_model", "u_model_old", "u_color", "u_texture", "u_texture_emissive", "u_texture_occlusion", "u_have_occlusion_texture",
+	"u_texture_normal", "u_have_normal_texture", "u_alpha_cutoff", "u_emissive_factor", "u_roughness_factor", "u_metallic_factor"
+};
+
+//same draws as renderMeshWithMaterialtoGBuffer, every thread records a consecutive range of the render calls
+//and the buffers are replayed in order, so the draw order is the one of the sorted calls
+void GTR::Renderer::renderGBufferRecorded(Camera* camera)
+{
+	Shader* shader = Shader::Get("gbuffers");
+	if (!shader)
+		return;
+	Texture::getWhiteTexture(); //created here, not by the workers
+
+	int locations[GB_NUM_UNIFORMS];
+	for (int i = 0; i < GB_NUM_UNIFORMS; ++i)
+		locations[i] = shader->getUniformLocation(gbuffer_uniform_names[i]);
+
+	int threads = parallelThreads((int)render_calls.size() / 16, record_threads); //not worth a thread for a few draws
+	if (command_buffers.size() < threads)
+		command_buffers.resize(threads);
+
+	for (int t = 0; t < threads; ++t) {
+		CommandBuffer& buffer = command_buffers[t];
+		buffer.clear();
+		buffer.setProgram(shader);
+	}
+	//the frame uniforms only once, the program keeps them
+	CommandBuffer& first_buffer = command_buffers[0];
+	first_buffer.setUniform(locations[GB_VIEWPROJECTION], camera->viewprojection_matrix);
+	first_buffer.setUniform(locations[GB_CAMERA_POSITION], camera->eye);
+	first_buffer.setUniform(locations[GB_TIME], (float)getTime());
+	first_buffer.setUniform(locations[GB_OCTAHEDRAL_NORMALS], compact_formats ? 1 : 0);
+	first_buffer.setUniform(locations[GB_VIEWPROJECTION_CURRENT], vp_matrix_unjittered);
+	first_buffer.setUniform(locations[GB_VIEWPROJECTION_OLD], vp_matrix_last);
+
+	//a consecutive range of calls per buffer, so the replay keeps the order
+	parallel_for(0, threads, 1, [&](int t) {
+		int first = (int)((long long)render_calls.size() * t / threads);
+		int last = (int)((long long)render_calls.size() * (t + 1) / threads);
+		recordGBuffer(command_buffers[t], camera, first, last, locations);
+	}, threads);
+
+	for (int t = 0; t < threads; ++t)
+		command_buffers[t].execute();
+	shader->disable();
+}
+
+//no GL calls here, it runs on the worker threads
+void GTR::Renderer::recordGBuffer(CommandBuffer& buffer, Camera* camera, int first, int last, const int* locations)
+{
+	Texture* white = Texture::getWhiteTexture();
+	for (int i = first; i < last; ++i)
+	{
+		RenderCall& call = render_calls[i];
+		Mesh* mesh = call.mesh;
+		Material* material = call.material;
+		if (!mesh || !mesh->getNumVertices() || !material || material->alpha_mode == eAlphaMode::BLEND)
+			continue;
+		if (!camera->testBoxInFrustum(call.world_bounding.center, call.world_bounding.halfsize))
+			continue;
+
+		Texture* texture = material->color_texture.texture;
+		Texture* emissive_texture = material->emissive_texture.texture;
+		Texture* occlusion_texture = material->metallic_roughness_texture.texture;
+		Texture* normal_texture = material->normal_texture.texture;
+
+		buffer.setCullFace(!material->two_sided);
+		buffer.setUniform(locations[GB_MODEL], call.model);
+		buffer.setUniform(locations[GB_MODEL_OLD], call.prev_model);
+		buffer.setUniform(locations[GB_COLOR], material->color);
+		buffer.setTexture(locations[GB_TEXTURE], texture ? texture : white, 5);
+		if (emissive_texture)
+			buffer.setTexture(locations[GB_TEXTURE_EMISSIVE], emissive_texture, 6);
+		if (occlusion_texture)
+			buffer.setTexture(locations[GB_TEXTURE_OCCLUSION], occlusion_texture, 7);
+		buffer.setUniform(locations[GB_HAVE_OCCLUSION_TEXTURE], occlusion_texture ? 1 : 0);
+		if (normal_texture)
+			buffer.setTexture(locations[GB_TEXTURE_NORMAL], normal_texture, 8);
+		buffer.setUniform(locations[GB_HAVE_NORMAL_TEXTURE], normal_texture ? 1 : 0);
+		buffer.setUniform(locations[GB_ALPHA_CUTOFF], material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0.0f);
+		buffer.setUniform(locations[GB_EMISSIVE_FACTOR], material->emissive_factor);
+		buffer.setUniform(locations[GB_ROUGHNESS_FACTOR], material->roughness_factor);
+		buffer.setUniform(locations[GB_METALLIC_FACTOR], material->metallic_factor);
+		buffer.draw(mesh, GL_TRIANGLES);
+	}
+}
+
 void GTR::Renderer::renderShadowMap(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera) {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -1252,7 +2420,7 @@ void GTR::Renderer::renderShadowMap(const Matrix44 model, Mesh* mesh, GTR::Mater
 
 	//define locals to simplify coding
 	Shader* shader = NULL;
-	Scene* scene = GTR::Scene::instance;
+	Scene* scene = current_scene;
 
 	//select if render both sides of the triangles
 	if (material->two_sided)
@@ -1317,38 +2485,43 @@ void GTR::Renderer::renderProbe(Vector3 pos, float size, float* coeffs)
 
 void GTR::Renderer::captureProbe(sProbe& probe, GTR::Scene* scene) {
 	FloatImage images[6]; //here we will store the six views
-	Camera cam;
+	captureProbeFaces(probe.pos, scene, images);
 
-//set the fov to 90 and the aspect to 1
-	cam.setPerspective(90, 1, 0.1, 1000);
+	//compute the coefficients given the six images
+	probe.sh = computeSH(images);
+}
 
-	if (irr_fbo == NULL) {
-		irr_fbo = new FBO();
-		irr_fbo->create(64, 64, 1, GL_RGB, GL_FLOAT);
-	}
+void GTR::Renderer::captureProbeFaces(Vector3 pos, GTR::Scene* scene, FloatImage images[6]) {
+	if (irr_capture == NULL)
+		irr_capture = new CubeCapture(64, GL_FLOAT);
 
-	for (int i = 0; i < 6; i++) //for every cubemap face
-	{
-		//compute camera orientation using defined vectors
-		Vector3 eye = probe.pos;
-		Vector3 front = cubemapFaceNormals[i][2];
-		Vector3 center = probe.pos + front;
-		Vector3 up = cubemapFaceNormals[i][1];
-		cam.lookAt(eye, center, up);
-		cam.enable();
+	//the six faces in one pass and read them back
+	irr_capture->render(this, scene, pos);
+	irr_capture->read(images);
+}
 
-		//render the scene from this point of view
-		irr_fbo->bind();
-		renderForward(scene, &cam);
-		irr_fbo->unbind();
+//the next probes are rendered while the faces of the previous ones are still being copied to the PBOs,
+//a batch is projected on every core once all its reads arrived
+void GTR::Renderer::captureProbesSH(GTR::Scene* scene, const Vector3* positions, SphericalHarmonics* result, int count) {
+	if (irr_capture == NULL)
+		irr_capture = new CubeCapture(64, GL_FLOAT);
 
-		//read the pixels back and store in a FloatImage
-		images[i].fromTexture(irr_fbo->color_textures[0]);
+	const int batch_size = 64;
+	ReadbackQueue queue(4 * 6); //up to 4 probes in flight, then it waits for the oldest
+	FloatImage* images = new FloatImage[batch_size * 6];
+	for (int first = 0; first < count; first += batch_size)
+	{
+		int num = std::min(batch_size, count - first);
+		std::cout << "Generando probes " << first << "-" << first + num - 1 << " de " << count << std::endl;
+		for (int iP = 0; iP < num; iP++)
+		{
+			irr_capture->render(this, scene, positions[first + iP]);
+			irr_capture->readAsync(&queue, &images[iP * 6]);
+		}
+		queue.flush();
+		computeSHBatch(images, &result[first], num);
 	}
-
-	//compute the coefficients given the six images
-	probe.sh = computeSH(images);
-
+	delete[] images;
 }
 
 
@@ -1379,22 +2552,6 @@ Texture* GTR::CubemapFromHDRE(const char* filename)
 	return texture;
 }
 
-void GTR::Renderer::updateReflectionProbes(GTR::Scene* scene) {
-	for (int i = 0; i < scene->entities.size(); i++) {
-		BaseEntity* ent = scene->entities[i];
-		if (!ent->visible || ent->entity_type != eEntityType::REFLECTION_PROBE)
-			continue;
-		ReflectionProbeEntity* probe = (ReflectionProbeEntity*)ent;
-		if (!probe->texture) {
-			probe->texture = new Texture();
-			probe->texture->createCubemap(512, 512, NULL, GL_RGB, GL_UNSIGNED_INT, true);
-		}
-
-		captureReflectionProbe(scene, probe->texture, probe->model.getTranslation());
-		this->probe = probe;
-	}
-}
-
 void GTR::Renderer::renderReflectionProbes(GTR::Scene* scene, Camera* camera){
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj", false, false);
 	Shader* shader = Shader::Get("reflection_probe");
@@ -1411,40 +2568,43 @@ void GTR::Renderer::renderReflectionProbes(GTR::Scene* scene, Camera* camera){
 		if (!ent->visible || ent->entity_type != eEntityType::REFLECTION_PROBE)
 			continue;
 
-		ReflectionProbeEntity* probe = (ReflectionProbeEntity*) ent;
-		if (!probe->texture)
+		int slot = reflection_probes.getSlot((ReflectionProbeEntity*)ent);
+		if (slot == -1 || !reflection_probes.slots[slot].valid)
 			continue;
 
 		Matrix44 model = ent->model;
 		model.scale(10, 10, 10);
 		shader->setUniform("u_model", model);
-		shader->setUniform("u_texture", probe->texture, 0);
+		shader->setUniform("u_texture", reflection_probes.cubemaps, 0);
+		shader->setUniform("u_layer", (float)slot);
 
 		mesh->render(GL_TRIANGLES);
 	}
 	shader->disable();
 }
 
-void GTR::Renderer::captureReflectionProbe(GTR::Scene* scene, Texture* tex, Vector3 pos) {
-	Camera camera;
-	for (int i = 0; i < 6; i++) {
-		reflection_probe_fbo->setTexture(tex, i);
-
-		reflection_probe_fbo->bind();
-		camera.setPerspective(90, 1, 0.1, 1000);
-		// render view
-		Vector3 eye = pos;
-		Vector3 center = pos + cubemapFaceNormals[i][2];
-		Vector3 up = cubemapFaceNormals[i][1];
-		camera.lookAt(eye, center, up);
-		camera.enable();
-		
-		is_rendering_reflections = true;
-		renderForward(scene, &camera);
-		is_rendering_reflections = false;
-		reflection_probe_fbo->unbind();
-
+//the probes closest to pos, the shader blends them by distance and fills the rest with the skybox
+void GTR::Renderer::reflectionProbesToShader(Shader* shader, Vector3 pos) {
+	int nearest[MAX_BLENDED_REFLECTION_PROBES];
+	int count = 0;
+	if (reflection_probes.cubemaps && !is_rendering_reflections)
+		count = reflection_probes.findNearest(pos, nearest, MAX_BLENDED_REFLECTION_PROBES);
+
+	Vector3 positions[MAX_BLENDED_REFLECTION_PROBES];
+	float radius[MAX_BLENDED_REFLECTION_PROBES];
+	float layers[MAX_BLENDED_REFLECTION_PROBES];
+	for (int i = 0; i < count; ++i) {
+		ReflectionProbeEntity* ent = reflection_probes.slots[nearest[i]].entity;
+		positions[i] = ent->model.getTranslation();
+		radius[i] = ent->radius;
+		layers[i] = nearest[i];
 	}
-	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-	tex->generateMipmaps();
+	shader->setUniform("u_num_reflection_probes", count);
+	if (!count)
+		return;
+	shader->setUniform("u_reflection_probes", reflection_probes.cubemaps, 11);
+	shader->setUniform3Array("u_reflection_probe_pos", (float*)positions, count);
+	shader->setUniform1Array("u_reflection_probe_radius", radius, count);
+	shader->setUniform1Array("u_reflection_probe_layer", layers, count);
+	shader->setUniform("u_reflection_levels", (float)reflection_probes.levels);
 }
\ No newline at end of file
@@ -2,6 +2,13 @@
 #include "prefab.h"
 #include "sphericalharmonics.h"
 #include "mesh.h"
+#include "irradiancecache.h"
+#include "irradiancesampler.h"
+#include "reflectionprobes.h"
+#include "readback.h"
+#include "softrasterizer.h"
+#include "commandbuffer.h"
+#include <map>
 
 //forward declarations
 class Camera;
@@ -18,15 +25,19 @@ struct sIrrHeader {
 namespace GTR {
 	class Prefab;
 	class Material;
+	class ProbeBaker;
+	class CubeCapture;
 
 	class RenderCall {
 	public:
 		Mesh* mesh;
 		Material* material;
 		Matrix44 model;
+		Matrix44 prev_model; //model of the previous frame, for the motion vectors
 
 		BoundingBox world_bounding;
 		float distance_to_camera;
+		SphericalHarmonics probe_sh; //probes sampled at the center of the bounding, for the forward shaders
 	};
 
 	//struct to store probes
@@ -37,6 +48,17 @@ namespace GTR {
 		SphericalHarmonics sh; //coeffs
 	};
 
+	//render targets of the deferred pipeline that depend on the format set
+	struct sDeferredTargets {
+		FBO* gbuffers_fbo;
+		FBO* illumination_fbo;
+		Texture* postFX_textureA;
+		Texture* postFX_textureB;
+		Texture* postFX_textureC;
+		Texture* postFX_textureD;
+		Texture* blurred_texture;
+	};
+
 	
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code 
@@ -57,6 +79,7 @@ namespace GTR {
 		std::vector<RenderCall> render_calls;
 		std::vector<LightEntity*> lights;
 		std::vector<DecalEntity*> decals;
+		GTR::Scene* current_scene; //the one being rendered, it can be a snapshot instead of Scene::instance
 		epipeline pipeline;
 		elightrender light_render;
 
@@ -66,22 +89,90 @@ namespace GTR {
 		void lightToShader(LightEntity* light, Shader* shader);
 		void gbuffertoshader(FBO* gbuffers_fbo, GTR::Scene* scene, Camera* camera, Shader* shader);
 		void applyFX(Texture* color_texture, Texture* depth_texture, Camera* camera);
+		void computeExposure(Texture* color_texture);
+		void computeHalfResSSAO(Camera* camera);
+		void computeVolumetricFroxels(GTR::Scene* scene, Camera* camera);
 
 		bool show_gbuffers;
 		bool show_ssao;
 		bool ssaoplus;
+		bool ssao_half_res;
+		bool compact_formats; //octahedral normals and R11G11B10F lighting/post targets
+		bool compare_formats; //left half full formats, right half compact ones
+		bool targets_compact; //format of the targets currently in use
+		sDeferredTargets stored_targets; //targets of the other format
+		Texture* compare_texture;
+
+		//dynamic resolution, the deferred targets are created at max_render_scale and the frame is rendered
+		//into the lower left part of them that render_scale needs to hold target_frame_ms
+		bool dynamic_resolution;
+		float target_frame_ms;
+		float min_render_scale;
+		float max_render_scale;
+		float render_scale;
+		float gpu_frame_ms;
+		int render_width;
+		int render_height;
+		int output_width;
+		int output_height;
+		int render_target_width; //size of the targets
+		int render_target_height;
+		int output_target_width;
+		int output_target_height;
+		Vector2 render_uv_scale; //part of the targets that holds the image
+		Vector2 output_uv_scale;
+		Vector2 last_render_uv_scale; //of the previous frame, the histories were written with it
+		Vector2 last_output_uv_scale;
+		GLuint gpu_time_queries[3];
+		int query_index;
+		int queries_issued;
+		int scale_cooldown;
+
+		//temporal upscaling, renders at taa_render_scale with jitter and resolves to the output size
+		bool taa_upscale;
+		float taa_render_scale;
+		int taa_frame;
+		Vector2 taa_jitter;
+		Texture* taa_historyA;
+		Texture* taa_historyB;
+		Matrix44 vp_matrix_unjittered;
+		std::map<std::pair<int, int>, Matrix44> previous_models; //by entity and node id, only the ones of the last frame
+		std::map<std::pair<int, int>, Matrix44> current_models;
 		bool interpolated_irr;
+		bool parallel_recording; //the G-buffer draws are prepared on worker threads and replayed here
+		int record_threads; //0 uses all the cores
+		std::vector<CommandBuffer> command_buffers; //one per recording thread, kept to reuse the memory
+		bool cpu_raster; //deferred G-buffer and lighting on the CPU threads, see SoftRasterizer
+		SoftRasterizer* soft_rasterizer;
+		Texture* cpu_raster_texture;
+		bool cpu_probe_bake; //bake the irradiance probes with the CPU ray tracer instead of rendering them
+		int bake_workers; //worker processes for the CPU bake, 0 bakes in this process
+		bool irr_half_floats; //store the probes as half floats
+		bool irr_compress; //compress irradiance.bin, it can not be mapped then
+		float rebake_radius;
+		bool adaptive_probes; //octree of probe bricks around the geometry instead of the fixed grid
+		int probe_max_depth;
+		std::vector<sIrrBrick> irr_bricks; //empty for the regular grid
+		Texture* irr_indirection; //brick index and level for every cell of the finest level
+		Texture* irr_volume; //coeffs of a regular grid in a 3D texture, read with hardware trilinear
+		bool use_irr_volume;
+		IrradianceSampler irr_sampler; //CPU copy of the probes
+		bool forward_probe_sh; //forward objects get the SH of their render call instead of reading the probes
 		bool show_irr_texture;
 		bool motion_blur;
 		bool chr_lns;
 		bool dof;
 		bool ffxa;
 		bool bloom;
+		bool auto_exposure;
 		bool is_rendering_reflections;
 		
 		float average_lum;
 		float lum_white;
 		float lum_scale;
+		float exposure_speed;
+		float min_exposure_lum;
+		float max_exposure_lum;
 		float vigneting;
 		float saturation;
 		float contrast;
@@ -93,63 +184,110 @@ namespace GTR {
 
 		Matrix44 vp_matrix_last;
 		FBO* gbuffers_fbo;
-		FBO* decals_fbo;
+		Texture* decal_atlas;
+		std::map<std::string, int> decal_atlas_slots; //cell of every texture, -1 if it could not be added
+		int decal_atlas_used;
+		//visible decals of the last frame: applied, skipped past the 32 of the pass, and skipped because
+		//their texture is missing or did not fit in the atlas
+		int decals_drawn;
+		int decals_over_limit;
+		int decals_without_cell;
+		Texture* decal_tiles;
 		FBO* illumination_fbo;
 		FBO* ssao_fbo;
 		FBO* ssao_blur;
-		FBO* irr_fbo;
+		Texture* ssao_half_depth;
+		Texture* ssao_half_texture;
+		Texture* ssao_historyA;
+		Texture* ssao_historyB;
+		CubeCapture* irr_capture;
+		ReadbackQueue readback;
 		FBO* volumetric_fbo;
+		bool volumetric_froxels;
+		float froxel_max_distance;
+		FBO* froxel_fbo;
+		Texture* froxel_scatter;
+		Texture* froxel_historyA;
+		Texture* froxel_historyB;
+		Texture* froxel_integrated;
+		Texture* froxel_carryA; //running integration between the draws of the integrate pass
+		Texture* froxel_carryB;
+		unsigned int froxel_integrate_fbo;
 		FBO* reflection_fbo;
-		FBO* reflection_probe_fbo;
 		Texture* probes_texture;
+		int probes_rows; //probes per column of the texture, they continue in the next 9 texels
 		Texture* postFX_textureA;
 		Texture* postFX_textureB;
 		Texture* postFX_textureC;
 		Texture* postFX_textureD;
 		Texture* blurred_texture;
+		Texture* log_lum_texture;
+		Texture* exposure_textureA;
+		Texture* exposure_textureB;
 		LightEntity* direct_light;
 
 		std::vector<Vector3> ssao_random_points;
 		std::vector<Vector3> ssaoplus_random_points;
-		ReflectionProbeEntity* probe;
+		std::vector<Vector3> ssao_half_random_points;
+		ReflectionProbeManager reflection_probes;
 
 		std::vector<sProbe> probes;
 		Vector3 irr_start_pos;
 		Vector3 irr_end_pos;
 		Vector3 irr_dim_pos;
 		Vector3 irr_delta;
+		void setProbeGrid(Vector3 start_pos, Vector3 end_pos, Vector3 dim);
+		void placeAdaptiveProbes(ProbeBaker& baker);
+		void subdivideProbeCell(ProbeBaker& baker, Vector3 start, float size, int level);
+		void setProbeBricks();
+		void createProbeVolume();
+		void updateProbeSampler();
 		void generateProbes(GTR::Scene* scene);
+		void uploadProbes(const void* rows, unsigned int type);
+		void rebakeProbes(GTR::Scene* scene, const std::vector<int>& dirty);
+		void rebakeProbesAround(GTR::Scene* scene, Vector3 center, float radius);
 		void renderProbe(Vector3 pos, float size, float* coeffs);
 		void captureProbe(sProbe& probe, GTR::Scene* scene);
+		void captureProbeFaces(Vector3 pos, GTR::Scene* scene, FloatImage images[6]);
+		void captureProbesSH(GTR::Scene* scene, const Vector3* positions, SphericalHarmonics* result, int count);
 		bool loadProbes();
 
 		Mesh cube;
 
 		Texture* skybox;
 		void generateSkybox(Camera* camera);
-		void updateReflectionProbes(GTR::Scene* scene);
 		void renderReflectionProbes(GTR::Scene* scene, Camera* camera);
-		void captureReflectionProbe(GTR::Scene* scene, Texture* tex, Vector3 pos);
+		void reflectionProbesToShader(Shader* shader, Vector3 pos);
 
 		Renderer();
 
 		//Render types
 		void renderForward(GTR::Scene* scene, Camera* camera);
 		void renderDeferred(GTR::Scene* scene, Camera* camera);
+		void renderDeferredCPU(GTR::Scene* scene, Camera* camera);
+		void renderFormatComparison(GTR::Scene* scene, Camera* camera);
+		void swapDeferredTargets();
+		void releaseDeferredTargets();
+		void renderDecals(Camera* camera);
+		void renderGBufferRecorded(Camera* camera);
+		void recordGBuffer(CommandBuffer& buffer, Camera* camera, int first, int last, const int* locations);
+		void updateRenderScale();
+		void bindScaled(FBO* fbo, Vector2 uv_scale);
+		void showTarget(Texture* texture, Vector2 uv_scale, int x, int y, int w, int h, Shader* shader = NULL);
 
 		//renders several elements of the scene
 		void renderScene(GTR::Scene* scene, Camera* camera);
 		void renderSceneForward(GTR::Scene* scene, Camera* camera);
 	
 		//to render a whole prefab (with all its nodes)
-		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
+		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, int entity_id = -1);
 
 		//to render one node from the prefab and its children
-		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera);
+		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera, int entity_id = -1);
 
 		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterialandLight(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
-		void renderMeshWithMaterialtoGBuffer(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		void renderMeshWithMaterialandLight(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const SphericalHarmonics* probe_sh = NULL);
+		void renderMeshWithMaterialtoGBuffer(const Matrix44 model, const Matrix44 prev_model, Mesh* mesh, GTR::Material* material, Camera* camera);
 	};
 
 	Texture* CubemapFromHDRE(const char* filename);
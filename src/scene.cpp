@@ -5,6 +5,7 @@
 #include "extra/cJSON.h"
 
 GTR::Scene* GTR::Scene::instance = NULL;
+int GTR::BaseEntity::last_id = 0;
 
 GTR::Scene::Scene()
 {
@@ -241,12 +242,14 @@ void GTR::DecalEntity::configure(cJSON* json) {
 
 GTR::ReflectionProbeEntity::ReflectionProbeEntity() {
 	entity_type = eEntityType::REFLECTION_PROBE;
-	texture = NULL;
+	radius = 150;
 }
 
 void GTR::ReflectionProbeEntity::renderInMenu() {
-
+	BaseEntity::renderInMenu();
+	ImGui::DragFloat("Radius", &radius);
 }
 
 void GTR::ReflectionProbeEntity::configure(cJSON* json) {
+	radius = readJSONNumber(json, "radius", radius);
 }
\ No newline at end of file
@@ -35,12 +35,14 @@ namespace GTR {
 	class BaseEntity
 	{
 	public:
+		static int last_id;
+		int id; //unique, the copies of the snapshots keep it
 		Scene* scene;
 		std::string name;
 		eEntityType entity_type;
 		Matrix44 model;
 		bool visible;
-		BaseEntity() { entity_type = NONE; visible = true; }
+		BaseEntity() { id = last_id++; entity_type = NONE; visible = true; }
 		virtual ~BaseEntity() {}
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json) {}
@@ -94,7 +96,7 @@ namespace GTR {
 	class ReflectionProbeEntity : public GTR::BaseEntity
 	{
 	public:
-		Texture* texture;
+		float radius; //distance where it stops affecting the reflections
 
 		ReflectionProbeEntity();
 		virtual void renderInMenu();
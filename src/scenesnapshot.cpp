@@ -0,0 +1,111 @@
+#include "scenesnapshot.h"
+#include "fbo.h"
+#include "camera.h"
+#include <algorithm>
+
+GTR::SceneSnapshot::SceneSnapshot() : real_instance(Scene::instance)
+{
+	//the instance has to stay on the real scene
+	Scene::instance = real_instance;
+	frame = -1;
+}
+
+GTR::SceneSnapshot::~SceneSnapshot()
+{
+	for (int i = 0; i < scene.entities.size(); ++i)
+		destroy(scene.entities[i]);
+	scene.entities.clear();
+}
+
+void GTR::SceneSnapshot::destroy(BaseEntity* entity)
+{
+	if (!entity)
+		return;
+	if (entity->entity_type == LIGHT) {
+		LightEntity* light = (LightEntity*)entity;
+		delete light->fbo; //the shadowmap is its depth texture
+		delete light->light_camera;
+	}
+	delete entity;
+}
+
+GTR::BaseEntity* GTR::SceneSnapshot::clone(BaseEntity* entity)
+{
+	BaseEntity* result = NULL;
+	switch (entity->entity_type)
+	{
+	case PREFAB: result = new PrefabEntity(*(PrefabEntity*)entity); break;
+	case DECALL: result = new DecalEntity(*(DecalEntity*)entity); break;
+	case REFLECTION_PROBE: result = new ReflectionProbeEntity(*(ReflectionProbeEntity*)entity); break;
+	case LIGHT: {
+		LightEntity* light = new LightEntity(*(LightEntity*)entity);
+		light->fbo = NULL;
+		light->shadowmap = NULL;
+		light->light_camera = NULL;
+		result = light;
+		break;
+	}
+	default: result = new BaseEntity(*entity);
+	}
+	result->scene = &scene;
+	return result;
+}
+
+void GTR::SceneSnapshot::copy(BaseEntity* source, BaseEntity* target)
+{
+	switch (source->entity_type)
+	{
+	case PREFAB: *(PrefabEntity*)target = *(PrefabEntity*)source; break;
+	case DECALL: *(DecalEntity*)target = *(DecalEntity*)source; break;
+	case REFLECTION_PROBE: *(ReflectionProbeEntity*)target = *(ReflectionProbeEntity*)source; break;
+	case LIGHT: {
+		//the shadowmap belongs to the copy
+		LightEntity* light = (LightEntity*)target;
+		FBO* fbo = light->fbo;
+		Texture* shadowmap = light->shadowmap;
+		Camera* light_camera = light->light_camera;
+		*light = *(LightEntity*)source;
+		light->fbo = fbo;
+		light->shadowmap = shadowmap;
+		light->light_camera = light_camera;
+		break;
+	}
+	default: *target = *source;
+	}
+	target->scene = &scene;
+}
+
+void GTR::SceneSnapshot::capture(Scene* source, Camera* source_camera, long frame)
+{
+	this->frame = frame;
+	camera = *source_camera;
+	scene.background_color = source->background_color;
+	scene.ambient_light = source->ambient_light;
+	scene.air_density = source->air_density;
+	scene.main_camera = source->main_camera;
+	scene.filename = source->filename;
+
+	//entities added or removed, the copies of the ones still there are kept
+	if (sources != source->entities)
+	{
+		std::vector<BaseEntity*> entities;
+		for (int i = 0; i < source->entities.size(); ++i)
+		{
+			BaseEntity* entity = source->entities[i];
+			int index = std::find(sources.begin(), sources.end(), entity) - sources.begin();
+			if (index < sources.size() && scene.entities[index]->entity_type == entity->entity_type) {
+				entities.push_back(scene.entities[index]);
+				scene.entities[index] = NULL;
+			}
+			else
+				entities.push_back(clone(entity));
+		}
+		for (int i = 0; i < scene.entities.size(); ++i)
+			destroy(scene.entities[i]);
+		scene.entities = entities;
+		sources = source->entities;
+	}
+
+	for (int i = 0; i < sources.size(); ++i)
+		copy(sources[i], scene.entities[i]);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "scene.h"
+
+namespace GTR {
+
+	// Copy of the scene and the camera that the renderer reads while the update thread keeps changing the
+	// real ones. The copied entities are kept between captures (only the values are copied again), so the
+	// renderer can keep using them as keys (previous models, reflection slots) and the lights keep their
+	// own shadowmaps.
+	class SceneSnapshot
+	{
+		Scene* real_instance; //before scene, its constructor replaces Scene::instance
+
+	public:
+		Scene scene;
+		Camera camera;
+		long frame; //frame of the application when it was captured, -1 if never
+
+		SceneSnapshot();
+		~SceneSnapshot();
+
+		//nothing else can be changing source while capturing
+		void capture(Scene* source, Camera* source_camera, long frame);
+
+	private:
+		std::vector<BaseEntity*> sources; //entity of the source scene of every copy
+
+		BaseEntity* clone(BaseEntity* entity);
+		void destroy(BaseEntity* entity); //with the shadowmap of the copied lights
+		void copy(BaseEntity* source, BaseEntity* target);
+	};
+};
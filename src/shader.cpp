@@ -61,7 +61,7 @@ Shader::Shader()
 {
 	if (!Shader::s_ready)
 		Shader::init();
-	program = vs = fs = 0;
+	program = vs = fs = gs = 0;
 	compiled = false;
 	from_atlas = false;
 
@@ -232,9 +232,21 @@ bool Shader::LoadAtlas(const char* filename)
 		std::string macros = "";
 		if (pos3 != std::string::npos)
 			macros = line.substr(pos3 + 1);
+
+		//an optional geometry shader goes before the macros: name vs fs gs [macros]
+		std::string gs_filename = "";
+		int pos4 = macros.find_first_of(' ');
+		std::string first = trim(macros.substr(0, pos4));
+		if (first.size() > 3 && first.substr(first.size() - 3) == ".gs")
+		{
+			gs_filename = first;
+			macros = pos4 == std::string::npos ? "" : macros.substr(pos4 + 1);
+		}
+
 		std::string vs_code = s_shaders_atlas[vs_filename];
 		std::string fs_code = s_shaders_atlas[fs_filename];
-		if (!vs_code.size() || !fs_code.size())
+		std::string gs_code = gs_filename.size() ? s_shaders_atlas[gs_filename] : "";
+		if (!vs_code.size() || !fs_code.size() || (gs_filename.size() && !gs_code.size()))
 		{
 			std::cout << " * Error in shader atlas, couldnt find files for " << name << std::endl;
 			continue;
@@ -242,6 +254,8 @@ bool Shader::LoadAtlas(const char* filename)
 
 		vs_code = macros + "\n" + vs_code;
 		fs_code = macros + "\n" + fs_code;
+		if (gs_code.size())
+			gs_code = macros + "\n" + gs_code;
 
 		Shader* shader = NULL;
 		auto it = s_Shaders.find(name);
@@ -253,7 +267,7 @@ bool Shader::LoadAtlas(const char* filename)
 		else
 			shader = it->second;
 
-		if (!shader->compileFromMemory(vs_code, fs_code))
+		if (!shader->compileFromMemory(vs_code, fs_code, gs_code))
 		{
 			delete shader;
 			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
@@ -296,7 +310,7 @@ bool Shader::hasInfoLog() const
 
 // ******************************************
 
-bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
+bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm)
 {
 	if (glCreateProgram == 0)
 	{
@@ -321,6 +335,12 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	if (gsm.size() && !createGeometryShaderObject(gsm))
+	{
+		printf("Geometry shader compilation failed\n");
+		return false;
+	}
+
 	glLinkProgram(program);
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -375,6 +395,11 @@ bool Shader::createFragmentShaderObject(const std::string& shader)
 	return createShaderObject(GL_FRAGMENT_SHADER, fs, shader);
 }
 
+bool Shader::createGeometryShaderObject(const std::string& shader)
+{
+	return createShaderObject(GL_GEOMETRY_SHADER, gs, shader);
+}
+
 bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code)
 {
 	if (handle != 0)
@@ -432,6 +457,13 @@ void Shader::release()
 		fs = 0;
 	}
 
+	if (gs)
+	{
+		glDeleteShader(gs);
+		assert(glGetError() == GL_NO_ERROR);
+		gs = 0;
+	}
+
 	if (program)
 	{
 		glDeleteProgram(program);
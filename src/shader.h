@@ -39,7 +39,7 @@ public:
 	virtual bool load(const std::string& vsf, const std::string& psf, const char* macros);
 
 	//internal functions
-	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm);
+	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm = "");
 	virtual void release();
 	virtual void enable();
 	virtual void disable();
@@ -130,6 +130,7 @@ protected:
 
 	bool createVertexShaderObject(const std::string& shader);
 	bool createFragmentShaderObject(const std::string& shader);
+	bool createGeometryShaderObject(const std::string& shader);
 	bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
 	void saveShaderInfoLog(GLuint obj);
 	void saveProgramInfoLog(GLuint obj);
@@ -138,6 +139,7 @@ protected:
 
 	GLuint vs;
 	GLuint fs;
+	GLuint gs; //optional
 	GLuint program;
 	std::string log;
 
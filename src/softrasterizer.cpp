@@ -0,0 +1,655 @@
+#include "softrasterizer.h"
+#include "renderer.h"
+#include "scene.h"
+#include "camera.h"
+#include "material.h"
+#include "texture.h"
+#include "parallel.h"
+#include <chrono>
+#include <map>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER)) //the kernels use FMA, like the SH projection
+	#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+	#include <emmintrin.h>
+#endif
+
+#define RECIPROCAL_PI 0.3183098861837697f
+
+static double elapsedMs(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static Vector3 degamma(const Vector3& c) {
+	return Vector3(pow(c.x, 2.2f), pow(c.y, 2.2f), pow(c.z, 2.2f));
+}
+
+//formulas of specular_formulas in the shader atlas
+static float D_GGX(float NoH, float linearRoughness) {
+	float a2 = linearRoughness * linearRoughness;
+	float f = (NoH * NoH) * (a2 - 1.0f) + 1.0f;
+	return a2 / (PI * f * f);
+}
+
+static float F_Schlick1(float VoH, float f0, float f90) {
+	return f0 + (f90 - f0) * pow(1.0f - VoH, 5.0f);
+}
+
+static float GGX(float NdotV, float k) {
+	return NdotV / (NdotV * (1.0f - k) + k);
+}
+
+static Vector3 specularBRDF(float roughness, const Vector3& f0, float NoH, float NoV, float NoL, float LoH) {
+	float D = D_GGX(NoH, roughness * roughness);
+	float f = pow(1.0f - LoH, 5.0f);
+	Vector3 F = f0 + (Vector3(1, 1, 1) - f0) * f;
+	float k = pow(roughness + 1.0f, 2.0f) / 8.0f;
+	float G = GGX(NoL, k) * GGX(NoV, k);
+	return F * (D * G / (4.0f * NoL * NoV + 1e-6f));
+}
+
+static float Fd_Burley(float NoV, float NoL, float LoH, float linearRoughness) {
+	float f90 = 0.5f + 2.0f * linearRoughness * LoH * LoH;
+	return F_Schlick1(NoL, 1.0f, f90) * F_Schlick1(NoV, 1.0f, f90) * RECIPROCAL_PI;
+}
+
+//barycentrics and depth of the eight pixels x..x+7 of a row, returns a bit per pixel inside the triangle
+//and in front of the depth buffer
+static int coverage8(const float edge[3][3], const float tri_z[3], float x, float py, const float depth[8], float w[3][8], float z[8])
+{
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+	__m256 zero = _mm256_setzero_ps();
+	__m256 px = _mm256_add_ps(_mm256_set1_ps(x + 0.5f), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+	__m256 vz = zero;
+	__m256 inside = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+	for (int e = 0; e < 3; ++e) {
+		__m256 we = _mm256_fmadd_ps(_mm256_set1_ps(edge[e][0]), px, _mm256_set1_ps(edge[e][1] * py + edge[e][2]));
+		_mm256_storeu_ps(w[e], we);
+		vz = _mm256_fmadd_ps(we, _mm256_set1_ps(tri_z[e]), vz);
+		inside = _mm256_and_ps(inside, _mm256_cmp_ps(we, zero, _CMP_GE_OQ));
+	}
+	_mm256_storeu_ps(z, vz);
+	inside = _mm256_and_ps(inside, _mm256_cmp_ps(vz, _mm256_loadu_ps(depth), _CMP_LT_OQ));
+	inside = _mm256_and_ps(inside, _mm256_cmp_ps(vz, zero, _CMP_GE_OQ));
+	return _mm256_movemask_ps(inside);
+#elif defined(__SSE2__) || defined(_M_X64)
+	int mask = 0;
+	__m128 zero = _mm_setzero_ps();
+	for (int half = 0; half < 8; half += 4) {
+		__m128 px = _mm_add_ps(_mm_set1_ps(x + half + 0.5f), _mm_setr_ps(0, 1, 2, 3));
+		__m128 vz = zero;
+		__m128 inside = _mm_cmpeq_ps(zero, zero);
+		for (int e = 0; e < 3; ++e) {
+			__m128 we = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edge[e][0]), px), _mm_set1_ps(edge[e][1] * py + edge[e][2]));
+			_mm_storeu_ps(w[e] + half, we);
+			vz = _mm_add_ps(vz, _mm_mul_ps(we, _mm_set1_ps(tri_z[e])));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(we, zero));
+		}
+		_mm_storeu_ps(z + half, vz);
+		inside = _mm_and_ps(inside, _mm_cmplt_ps(vz, _mm_loadu_ps(depth + half)));
+		inside = _mm_and_ps(inside, _mm_cmpge_ps(vz, zero));
+		mask |= _mm_movemask_ps(inside) << half;
+	}
+	return mask;
+#else
+	int mask = 0;
+	for (int i = 0; i < 8; ++i) {
+		float px = x + i + 0.5f;
+		for (int e = 0; e < 3; ++e)
+			w[e][i] = edge[e][0] * px + edge[e][1] * py + edge[e][2];
+		z[i] = w[0][i] * tri_z[0] + w[1][i] * tri_z[1] + w[2][i] * tri_z[2];
+		if (w[0][i] >= 0 && w[1][i] >= 0 && w[2][i] >= 0 && z[i] < depth[i] && z[i] >= 0)
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+//first half of tonemapper.fs for n pixels, the color scaled to the luminance of the curve and clamped
+static void tonemapScale(const float* r, const float* g, const float* b, int n, float scale, float lum_white2, float* out_r, float* out_g, float* out_b)
+{
+	int i = 0;
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+	__m256 vscale = _mm256_set1_ps(scale);
+	__m256 inv_white2 = _mm256_set1_ps(1.0f / lum_white2);
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 min_color = _mm256_set1_ps(0.001f);
+	for (; i + 8 <= n; i += 8) {
+		__m256 vr = _mm256_loadu_ps(r + i), vg = _mm256_loadu_ps(g + i), vb = _mm256_loadu_ps(b + i);
+		__m256 lum = _mm256_fmadd_ps(vr, _mm256_set1_ps(0.2126f), _mm256_fmadd_ps(vg, _mm256_set1_ps(0.7152f), _mm256_mul_ps(vb, _mm256_set1_ps(0.0722f))));
+		__m256 L = _mm256_mul_ps(vscale, lum);
+		__m256 Ld = _mm256_div_ps(_mm256_mul_ps(L, _mm256_fmadd_ps(L, inv_white2, one)), _mm256_add_ps(one, L));
+		__m256 k = _mm256_and_ps(_mm256_cmp_ps(lum, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_div_ps(Ld, lum));
+		_mm256_storeu_ps(out_r + i, _mm256_max_ps(_mm256_mul_ps(vr, k), min_color));
+		_mm256_storeu_ps(out_g + i, _mm256_max_ps(_mm256_mul_ps(vg, k), min_color));
+		_mm256_storeu_ps(out_b + i, _mm256_max_ps(_mm256_mul_ps(vb, k), min_color));
+	}
+#elif defined(__SSE2__) || defined(_M_X64)
+	__m128 vscale = _mm_set1_ps(scale);
+	__m128 inv_white2 = _mm_set1_ps(1.0f / lum_white2);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 min_color = _mm_set1_ps(0.001f);
+	for (; i + 4 <= n; i += 4) {
+		__m128 vr = _mm_loadu_ps(r + i), vg = _mm_loadu_ps(g + i), vb = _mm_loadu_ps(b + i);
+		__m128 lum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vr, _mm_set1_ps(0.2126f)), _mm_mul_ps(vg, _mm_set1_ps(0.7152f))), _mm_mul_ps(vb, _mm_set1_ps(0.0722f)));
+		__m128 L = _mm_mul_ps(vscale, lum);
+		__m128 Ld = _mm_div_ps(_mm_mul_ps(L, _mm_add_ps(one, _mm_mul_ps(L, inv_white2))), _mm_add_ps(one, L));
+		__m128 k = _mm_and_ps(_mm_cmpgt_ps(lum, _mm_setzero_ps()), _mm_div_ps(Ld, lum));
+		_mm_storeu_ps(out_r + i, _mm_max_ps(_mm_mul_ps(vr, k), min_color));
+		_mm_storeu_ps(out_g + i, _mm_max_ps(_mm_mul_ps(vg, k), min_color));
+		_mm_storeu_ps(out_b + i, _mm_max_ps(_mm_mul_ps(vb, k), min_color));
+	}
+#endif
+	for (; i < n; ++i) {
+		float lum = 0.2126f * r[i] + 0.7152f * g[i] + 0.0722f * b[i];
+		float L = scale * lum;
+		float Ld = (L * (1.0f + L / lum_white2)) / (1.0f + L);
+		float k = lum > 0 ? Ld / lum : 0.0f;
+		out_r[i] = std::max(r[i] * k, 0.001f);
+		out_g[i] = std::max(g[i] * k, 0.001f);
+		out_b[i] = std::max(b[i] * k, 0.001f);
+	}
+}
+
+GTR::SoftRasterizer::SoftRasterizer()
+{
+	num_threads = 0;
+	width = height = 0;
+	tiles_x = tiles_y = 0;
+	threads = 1;
+	num_triangles = 0;
+	setup_ms = raster_ms = shade_ms = 0;
+}
+
+void GTR::SoftRasterizer::resize(int width, int height)
+{
+	if (this->width == width && this->height == height)
+		return;
+	this->width = width;
+	this->height = height;
+	tiles_x = (width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+	tiles_y = (height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+
+	int num_pixels = width * height;
+	depth.resize(num_pixels);
+	metalness.resize(num_pixels);
+	roughness.resize(num_pixels);
+	for (int i = 0; i < 3; ++i) {
+		normal[i].resize(num_pixels);
+		albedo[i].resize(num_pixels);
+		emissive[i].resize(num_pixels);
+		hdr[i].resize(num_pixels);
+	}
+	output.resize(num_pixels * 4);
+}
+
+//the textures do not keep their pixels after the upload, so the files are loaded again once
+Image* GTR::SoftRasterizer::getImage(Texture* texture)
+{
+	static std::map<std::string, Image*> cache;
+	if (!texture || texture->filename.size() <= 4)
+		return NULL;
+
+	auto it = cache.find(texture->filename);
+	if (it != cache.end())
+		return it->second;
+
+	Image* image = new Image();
+	if (!image->load(texture->filename.c_str()) || !image->width || !image->height) {
+		delete image;
+		image = NULL;
+	}
+	cache[texture->filename] = image;
+	return image;
+}
+
+//bilinear with repeat, like the GL samplers without the mipmaps
+Vector4 GTR::SoftRasterizer::sampleImage(Image* image, Vector2 uv)
+{
+	if (!image)
+		return Vector4(1, 1, 1, 1);
+
+	float x = (uv.x - floor(uv.x)) * image->width - 0.5f;
+	float y = (uv.y - floor(uv.y)) * image->height - 0.5f;
+	int x0 = (int)floor(x);
+	int y0 = (int)floor(y);
+	float fx = x - x0;
+	float fy = y - y0;
+	int w = image->width;
+	int h = image->height;
+	int channels = image->num_channels;
+
+	float result[4] = { 0, 0, 0, 0 };
+	const float weights[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+	for (int i = 0; i < 4; ++i) {
+		int px = ((x0 + (i & 1)) % w + w) % w;
+		int py = ((y0 + (i >> 1)) % h + h) % h;
+		uint8* pixel = image->data + (py * w + px) * channels;
+		for (int c = 0; c < 4; ++c)
+			result[c] += weights[i] * (c < channels ? pixel[c] : 255);
+	}
+	return Vector4(result[0], result[1], result[2], result[3]) * (1.0f / 255.0f);
+}
+
+int GTR::SoftRasterizer::addMaterial(Material* material, std::vector<Material*>& used)
+{
+	for (int i = 0; i < used.size(); ++i)
+		if (used[i] == material)
+			return i;
+
+	sMaterial mat;
+	mat.color = material->color;
+	mat.emissive = material->emissive_factor;
+	mat.metallic = material->metallic_factor;
+	mat.roughness = material->roughness_factor;
+	mat.alpha_cutoff = material->alpha_mode == MASK ? material->alpha_cutoff : 0;
+	mat.two_sided = material->two_sided;
+	mat.color_image = getImage(material->color_texture.texture);
+	mat.emissive_image = getImage(material->emissive_texture.texture);
+	mat.metallic_roughness_image = getImage(material->metallic_roughness_texture.texture);
+	used.push_back(material);
+	materials.push_back(mat);
+	return materials.size() - 1;
+}
+
+void GTR::SoftRasterizer::setupCall(RenderCall& call, int material, const Matrix44& vp, int thread, std::vector<sVertex>& vertices)
+{
+	Mesh* mesh = call.mesh;
+	bool interleaved = mesh->interleaved.size() > 0;
+	int num_vertices = mesh->getNumVertices();
+	int num_indices = mesh->m_indices.size() ? mesh->m_indices.size() : num_vertices;
+	bool have_normals = interleaved || mesh->normals.size() == num_vertices;
+	bool have_uvs = interleaved || mesh->uvs.size() == num_vertices;
+
+	//every vertex once, the indices reuse them
+	Matrix44 mvp = call.model * vp;
+	vertices.resize(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		sVertex& v = vertices[i];
+		Vector3 pos = interleaved ? mesh->interleaved[i].vertex : mesh->vertices[i];
+		v.clip = mvp * Vector4(pos, 1.0f);
+		Vector3 n = have_normals ? (interleaved ? mesh->interleaved[i].normal : mesh->normals[i]) : Vector3(0, 1, 0);
+		v.normal = call.model.rotateVector(n);
+		v.uv = have_uvs ? (interleaved ? mesh->interleaved[i].uv : mesh->uvs[i]) : Vector2();
+	}
+
+	for (int i = 0; i + 2 < num_indices; i += 3)
+	{
+		sVertex tri[3];
+		for (int j = 0; j < 3; ++j)
+			tri[j] = vertices[mesh->m_indices.size() ? mesh->m_indices[i + j] : i + j];
+
+		//clip against the near plane (z > -w), the rest is done by the bounds of the tiles
+		bool inside[3];
+		int num_inside = 0;
+		for (int j = 0; j < 3; ++j) {
+			inside[j] = tri[j].clip.z > -tri[j].clip.w;
+			num_inside += inside[j];
+		}
+		if (num_inside == 0)
+			continue;
+		if (num_inside == 3) {
+			addTriangle(tri, material, thread);
+			continue;
+		}
+
+		sVertex polygon[4];
+		int count = 0;
+		for (int j = 0; j < 3; ++j)
+		{
+			const sVertex& a = tri[j];
+			const sVertex& b = tri[(j + 1) % 3];
+			if (inside[j])
+				polygon[count++] = a;
+			if (inside[j] != inside[(j + 1) % 3]) {
+				float da = a.clip.z + a.clip.w;
+				float db = b.clip.z + b.clip.w;
+				float t = da / (da - db);
+				sVertex& v = polygon[count++];
+				v.clip = a.clip * (1.0f - t) + b.clip * t;
+				v.normal = a.normal + (b.normal - a.normal) * t;
+				v.uv = a.uv + (b.uv - a.uv) * t;
+			}
+		}
+		addTriangle(polygon, material, thread);
+		if (count == 4) {
+			sVertex second[3] = { polygon[0], polygon[2], polygon[3] };
+			addTriangle(second, material, thread);
+		}
+	}
+}
+
+void GTR::SoftRasterizer::addTriangle(const sVertex* v, int material, int thread)
+{
+	float x[3], y[3];
+	sTriangle tri;
+	for (int i = 0; i < 3; ++i) {
+		float inv_w = 1.0f / v[i].clip.w;
+		x[i] = (v[i].clip.x * inv_w * 0.5f + 0.5f) * width;
+		y[i] = (v[i].clip.y * inv_w * 0.5f + 0.5f) * height;
+		tri.z[i] = v[i].clip.z * inv_w * 0.5f + 0.5f;
+		tri.inv_w[i] = inv_w;
+		tri.normal_w[i] = v[i].normal * inv_w;
+		tri.uv_w[i] = v[i].uv * inv_w;
+	}
+
+	//counter clockwise is the front face, like GL
+	float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	if (area == 0 || (area < 0 && !materials[material].two_sided))
+		return;
+
+	tri.min_x = std::max(0, (int)floor(std::min(x[0], std::min(x[1], x[2]))));
+	tri.min_y = std::max(0, (int)floor(std::min(y[0], std::min(y[1], y[2]))));
+	tri.max_x = std::min(width - 1, (int)ceil(std::max(x[0], std::max(x[1], x[2]))));
+	tri.max_y = std::min(height - 1, (int)ceil(std::max(y[0], std::max(y[1], y[2]))));
+	if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+		return;
+
+	//edge opposite to every vertex, divided by the area so the three add up to 1
+	for (int i = 0; i < 3; ++i) {
+		int j = (i + 1) % 3;
+		int k = (i + 2) % 3;
+		tri.edge[i][0] = -(y[k] - y[j]) / area;
+		tri.edge[i][1] = (x[k] - x[j]) / area;
+		tri.edge[i][2] = ((y[k] - y[j]) * x[j] - (x[k] - x[j]) * y[j]) / area;
+	}
+	tri.material = material;
+
+	std::vector<sTriangle>& triangles = thread_triangles[thread];
+	std::vector<std::vector<int>>& bins = thread_bins[thread];
+	int index = triangles.size();
+	triangles.push_back(tri);
+	for (int ty = tri.min_y / SOFT_TILE_SIZE; ty <= tri.max_y / SOFT_TILE_SIZE; ++ty)
+		for (int tx = tri.min_x / SOFT_TILE_SIZE; tx <= tri.max_x / SOFT_TILE_SIZE; ++tx)
+			bins[ty * tiles_x + tx].push_back(index);
+}
+
+void GTR::SoftRasterizer::rasterizeTile(int tile)
+{
+	int tile_x0 = (tile % tiles_x) * SOFT_TILE_SIZE;
+	int tile_y0 = (tile / tiles_x) * SOFT_TILE_SIZE;
+	int tile_x1 = std::min(tile_x0 + SOFT_TILE_SIZE, width) - 1;
+	int tile_y1 = std::min(tile_y0 + SOFT_TILE_SIZE, height) - 1;
+
+	for (int y = tile_y0; y <= tile_y1; ++y) {
+		std::fill(depth.begin() + y * width + tile_x0, depth.begin() + y * width + tile_x1 + 1, 1.0f);
+		std::fill(albedo[0].begin() + y * width + tile_x0, albedo[0].begin() + y * width + tile_x1 + 1, 0.0f);
+	}
+
+	//in the same order as they were submitted, the thread bins hold consecutive ranges of the calls
+	for (int t = 0; t < threads; ++t)
+	{
+		std::vector<int>& bin = thread_bins[t][tile];
+		std::vector<sTriangle>& triangles = thread_triangles[t];
+		for (int b = 0; b < bin.size(); ++b)
+		{
+			const sTriangle& tri = triangles[bin[b]];
+			const sMaterial& mat = materials[tri.material];
+			int x0 = std::max(tile_x0, tri.min_x);
+			int x1 = std::min(tile_x1, tri.max_x);
+			int y0 = std::max(tile_y0, tri.min_y);
+			int y1 = std::min(tile_y1, tri.max_y);
+
+			for (int y = y0; y <= y1; ++y)
+			{
+				float py = y + 0.5f;
+				for (int x = x0; x <= x1; x += 8)
+				{
+					//eight pixels at once, the pixels past the end of the row get a depth that rejects them
+					int count = std::min(8, x1 - x + 1);
+					float pixel_depth[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+					std::copy(depth.begin() + y * width + x, depth.begin() + y * width + x + count, pixel_depth);
+					float w[3][8];
+					float z[8];
+					int mask = coverage8(tri.edge, tri.z, (float)x, py, pixel_depth, w, z);
+					if (!mask)
+						continue;
+
+					for (int i = 0; i < count; ++i)
+					{
+						int index = y * width + x + i;
+						if (!(mask & (1 << i)))
+							continue;
+
+						float inv_w = w[0][i] * tri.inv_w[0] + w[1][i] * tri.inv_w[1] + w[2][i] * tri.inv_w[2];
+						float pw = 1.0f / inv_w;
+						Vector2 uv = (tri.uv_w[0] * w[0][i] + tri.uv_w[1] * w[1][i] + tri.uv_w[2] * w[2][i]) * pw;
+
+						Vector4 color = sampleImage(mat.color_image, uv);
+						color = Vector4(color.x * mat.color.x, color.y * mat.color.y, color.z * mat.color.z, color.w * mat.color.w);
+						if (color.w < mat.alpha_cutoff)
+							continue;
+
+						Vector3 N = (tri.normal_w[0] * w[0][i] + tri.normal_w[1] * w[1][i] + tri.normal_w[2] * w[2][i]) * pw;
+						N = normalize(N);
+
+						//the metal and roughness only come from the texture, like gbuffers.fs
+						float metal = 0, rough = 0;
+						if (mat.metallic_roughness_image) {
+							Vector4 material = sampleImage(mat.metallic_roughness_image, uv);
+							metal = material.y * mat.metallic;
+							rough = material.z * mat.roughness;
+						}
+						Vector3 emission = mat.emissive;
+						if (mat.emissive_image)
+							emission = emission * sampleImage(mat.emissive_image, uv).xyz();
+
+						depth[index] = z[i];
+						albedo[0][index] = color.x; albedo[1][index] = color.y; albedo[2][index] = color.z;
+						normal[0][index] = N.x; normal[1][index] = N.y; normal[2][index] = N.z;
+						emissive[0][index] = emission.x; emissive[1][index] = emission.y; emissive[2][index] = emission.z;
+						metalness[index] = metal;
+						roughness[index] = rough;
+					}
+				}
+			}
+		}
+	}
+}
+
+//deferred.fs for the directional light and the light volumes of the rest, without shadows. Scalar, see the class comment
+void GTR::SoftRasterizer::shadeTile(int tile, Scene* scene, const Matrix44& inv_vp, Vector3 eye, const IrradianceSampler* irradiance)
+{
+	int tile_x0 = (tile % tiles_x) * SOFT_TILE_SIZE;
+	int tile_y0 = (tile / tiles_x) * SOFT_TILE_SIZE;
+	int tile_x1 = std::min(tile_x0 + SOFT_TILE_SIZE, width);
+	int tile_y1 = std::min(tile_y0 + SOFT_TILE_SIZE, height);
+	Vector3 ambient_light = degamma(scene->ambient_light);
+	Vector3 background = scene->background_color;
+	Vector3 sky = degamma(background);
+
+	for (int y = tile_y0; y < tile_y1; ++y)
+		for (int x = tile_x0; x < tile_x1; ++x)
+		{
+			int index = y * width + x;
+			if (depth[index] >= 1.0f) {
+				hdr[0][index] = background.x; hdr[1][index] = background.y; hdr[2][index] = background.z;
+				continue;
+			}
+
+			Vector4 screen_pos((x + 0.5f) / width * 2.0f - 1.0f, (y + 0.5f) / height * 2.0f - 1.0f, depth[index] * 2.0f - 1.0f, 1.0f);
+			Vector4 proj = inv_vp * screen_pos;
+			Vector3 world_position = proj.xyz() * (1.0f / proj.w);
+
+			Vector3 color = degamma(Vector3(albedo[0][index], albedo[1][index], albedo[2][index]));
+			Vector3 N(normal[0][index], normal[1][index], normal[2][index]);
+			float metal = metalness[index];
+			float rough = roughness[index];
+			Vector3 V = normalize(eye - world_position);
+			Vector3 fresnel = Vector3(0.5f, 0.5f, 0.5f) * (1.0f - metal) + color * metal;
+			Vector3 diffuse_color = color * (1.0f - metal);
+			Vector3 reflection_factor = Vector3(1, 1, 1) * (1.0f - metal) + sky * metal; //mix(color, color * sky, metal)
+
+			Vector3 irr(1, 1, 1);
+			if (irradiance && !irradiance->isEmpty())
+				irr = IrradianceSampler::irradiance(irradiance->sample(world_position + N * 0.1f), N);
+
+			Vector3 result;
+			bool first_pass = true;
+			for (int l = 0; l < light_list.size(); ++l)
+			{
+				const sLight& light = light_list[l];
+				Vector3 L;
+				float factor = 1.0f;
+				if (light.type == 0)
+					L = normalize(light.vector);
+				else {
+					Vector3 to_light = light.position - world_position;
+					float distance = to_light.length();
+					L = to_light * (1.0f / std::max(distance, 1e-6f));
+					float att = std::max((light.max_distance - distance) / light.max_distance, 0.0f);
+					factor = att * att * att;
+					if (light.type == 1 && light.cone_cos > 0) {
+						float spot_cosine = dot(light.front, L * -1.0f);
+						factor *= spot_cosine >= light.cone_cos ? pow(spot_cosine, light.cone_exp) : 0.0f;
+					}
+				}
+
+				Vector3 H = normalize(L + V);
+				float NdotH = clamp(dot(N, H), 0.0f, 1.0f);
+				float NdotV = clamp(dot(N, V), 0.0f, 1.0f);
+				float NdotL = clamp(dot(N, L), 0.0f, 1.0f);
+				float LdotH = clamp(dot(L, H), 0.0f, 1.0f);
+				Vector3 direct = specularBRDF(rough, fresnel, NdotH, NdotV, NdotL, LdotH) +
+					diffuse_color * Fd_Burley(NdotV, NdotL, LdotH, rough * rough);
+				Vector3 light_color = light.color * factor;
+
+				//the full screen pass of the directional light also adds the ambient and the irradiance
+				if (light.type == 0 && first_pass) {
+					result = result + color * (direct * light_color + ambient_light) * irr * reflection_factor;
+					first_pass = false;
+				}
+				else
+					result = result + color * direct * light_color * reflection_factor;
+			}
+			if (first_pass) //no directional light, the ambient is still there
+				result = result + color * ambient_light * irr * reflection_factor;
+
+			result = result + degamma(Vector3(emissive[0][index], emissive[1][index], emissive[2][index]));
+			hdr[0][index] = result.x; hdr[1][index] = result.y; hdr[2][index] = result.z;
+		}
+}
+
+//log average like the auto exposure of the GL path
+float GTR::SoftRasterizer::averageLuminance()
+{
+	int num_pixels = width * height;
+	//chunks of 16 rows added in order, the exposure does not change with the threads
+	double sum = parallel_reduce(0, num_pixels, 16 * width, 0.0, [&](int first, int last) {
+		double sum = 0;
+		for (int i = first; i < last; ++i)
+			sum += log(0.0001f + 0.2126f * hdr[0][i] + 0.7152f * hdr[1][i] + 0.0722f * hdr[2][i]);
+		return sum;
+	}, [](double a, double b) { return a + b; }, threads);
+	return (float)exp(sum / std::max(1, num_pixels));
+}
+
+//tonemapper.fs
+void GTR::SoftRasterizer::tonemapTile(int tile, const sToneMapping& tone, float average_lum)
+{
+	int tile_x0 = (tile % tiles_x) * SOFT_TILE_SIZE;
+	int tile_y0 = (tile / tiles_x) * SOFT_TILE_SIZE;
+	int tile_x1 = std::min(tile_x0 + SOFT_TILE_SIZE, width);
+	int tile_y1 = std::min(tile_y0 + SOFT_TILE_SIZE, height);
+	float lum_white2 = tone.lum_white * tone.lum_white;
+	float scale = tone.scale / average_lum;
+	const float* r = &hdr[0][0];
+	const float* g = &hdr[1][0];
+	const float* b = &hdr[2][0];
+
+	float rgb[3][SOFT_TILE_SIZE];
+	for (int y = tile_y0; y < tile_y1; ++y)
+	{
+		int row = y * width;
+		uint8* out = &output[row * 4];
+		int first = row + tile_x0;
+		tonemapScale(r + first, g + first, b + first, tile_x1 - tile_x0, scale, lum_white2, rgb[0], rgb[1], rgb[2]);
+
+		//the gamma has no SIMD pow, it stays per pixel
+		for (int x = tile_x0; x < tile_x1; ++x)
+		{
+			for (int c = 0; c < 3; ++c)
+				out[x * 4 + c] = (uint8)(std::min((float)pow(rgb[c][x - tile_x0], 1.0f / 2.2f), 1.0f) * 255.0f + 0.5f);
+			out[x * 4 + 3] = 255;
+		}
+	}
+}
+
+void GTR::SoftRasterizer::render(std::vector<RenderCall>& calls, std::vector<LightEntity*>& lights, Scene* scene, Camera* camera,
+	const IrradianceSampler* irradiance, const sToneMapping& tone, int width, int height)
+{
+	resize(width, height);
+	threads = parallelThreads(1 << 30, num_threads);
+	auto start = std::chrono::steady_clock::now();
+
+	//materials and lights once, the images are loaded here and only read by the threads
+	materials.clear();
+	std::vector<Material*> used;
+	std::vector<int> visible;
+	std::vector<int> call_materials;
+	for (int i = 0; i < calls.size(); ++i) {
+		RenderCall& call = calls[i];
+		if (!call.mesh || !call.material || call.material->alpha_mode == BLEND || !call.mesh->getNumVertices())
+			continue;
+		if (!camera->testBoxInFrustum(call.world_bounding.center, call.world_bounding.halfsize))
+			continue;
+		visible.push_back(i);
+		call_materials.push_back(addMaterial(call.material, used));
+	}
+
+	light_list.clear();
+	for (int i = 0; i < lights.size(); ++i) {
+		LightEntity* light = lights[i];
+		sLight l;
+		l.type = light->light_type == DIRECTIONAL ? 0 : (light->light_type == SPOT ? 1 : 2);
+		l.position = light->model * Vector3();
+		l.vector = l.position - light->target;
+		l.front = normalize(light->model.rotateVector(Vector3(0, 0, -1)));
+		l.color = degamma(light->color) * light->intensity;
+		l.max_distance = std::max(light->max_distance, 1e-4f);
+		l.cone_cos = cos(light->cone_angle * DEG2RAD);
+		l.cone_exp = light->cone_exp;
+		light_list.push_back(l);
+	}
+	//the directional goes first, it is the one of the full screen pass
+	std::stable_sort(light_list.begin(), light_list.end(), [](const sLight& a, const sLight& b) { return a.type == 0 && b.type != 0; });
+
+	//setup and binning, every thread takes a consecutive range of calls so the order of the bins is the submission order
+	int num_tiles = tiles_x * tiles_y;
+	thread_triangles.resize(threads);
+	thread_bins.resize(threads);
+	for (int t = 0; t < threads; ++t) {
+		thread_triangles[t].clear();
+		thread_bins[t].resize(num_tiles);
+		for (int i = 0; i < num_tiles; ++i)
+			thread_bins[t][i].clear();
+	}
+	Matrix44 vp = camera->viewprojection_matrix;
+	parallel_for(0, threads, 1, [&](int range) {
+		std::vector<sVertex> vertices;
+		int first = (int)((long long)visible.size() * range / threads);
+		int last = (int)((long long)visible.size() * (range + 1) / threads);
+		for (int i = first; i < last; ++i)
+			setupCall(calls[visible[i]], call_materials[i], vp, range, vertices);
+	}, threads);
+	num_triangles = 0;
+	for (int t = 0; t < threads; ++t)
+		num_triangles += thread_triangles[t].size();
+	setup_ms = elapsedMs(start);
+
+	start = std::chrono::steady_clock::now();
+	parallel_for(0, num_tiles, 1, [&](int tile) { rasterizeTile(tile); }, threads);
+	raster_ms = elapsedMs(start);
+
+	start = std::chrono::steady_clock::now();
+	Matrix44 inv_vp = vp;
+	inv_vp.inverse();
+	Vector3 eye = camera->eye;
+	parallel_for(0, num_tiles, 1, [&](int tile) { shadeTile(tile, scene, inv_vp, eye, irradiance); }, threads);
+	float average_lum = tone.auto_exposure ? averageLuminance() : tone.average_lum;
+	parallel_for(0, num_tiles, 1, [&](int tile) { tonemapTile(tile, tone, std::max(average_lum, 1e-4f)); }, threads);
+	shade_ms = elapsedMs(start);
+}
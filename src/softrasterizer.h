@@ -0,0 +1,122 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+#define SOFT_TILE_SIZE 64
+
+class Camera;
+class Image;
+class Texture;
+
+namespace GTR {
+	class Scene;
+	class Material;
+	class LightEntity;
+	class RenderCall;
+	class IrradianceSampler;
+
+	// Deferred path on the CPU for hosts without a GPU. Consumes the same render calls, bins the triangles
+	// in screen tiles and every thread rasterizes, lights and tonemaps whole tiles, so nothing is shared
+	// between threads after the binning. The G-buffer has one plane per channel so the per tile kernels
+	// (coverage and tonemapping) run over contiguous floats with AVX2+FMA or SSE2, whichever the build enables.
+	// The lighting stays scalar, one pixel and one light at a time: the BRDF needs pow, the spot cone branches
+	// per light and every pixel samples the irradiance probes, so it only scales with the threads.
+	// Same formulas as gbuffers.fs, deferred.fs and tonemapper.fs, without normal maps, shadows, SSAO,
+	// decals and transparent materials; the reflections only see the background color.
+	class SoftRasterizer
+	{
+	public:
+		struct sToneMapping {
+			float average_lum;
+			float lum_white;
+			float scale;
+			bool auto_exposure; //average computed from the frame instead of average_lum
+		};
+
+		int num_threads; //0 uses all the cores
+		int width;
+		int height;
+
+		//G-buffer, one value per pixel and bottom row first like the GL targets
+		std::vector<float> depth; //0..1 like the depth buffer
+		std::vector<float> normal[3];
+		std::vector<float> albedo[3]; //gamma space, like GB0
+		std::vector<float> emissive[3];
+		std::vector<float> metalness;
+		std::vector<float> roughness;
+		std::vector<float> hdr[3];
+		std::vector<uint8> output; //tonemapped RGBA
+
+		//stats of the last frame
+		int num_triangles; //after culling and clipping
+		double setup_ms;
+		double raster_ms;
+		double shade_ms;
+
+		SoftRasterizer();
+
+		void render(std::vector<RenderCall>& calls, std::vector<LightEntity*>& lights, Scene* scene, Camera* camera,
+			const IrradianceSampler* irradiance, const sToneMapping& tone, int width, int height);
+
+	private:
+		struct sVertex {
+			Vector4 clip;
+			Vector3 normal;
+			Vector2 uv;
+		};
+
+		//screen space triangle, the attributes are divided by w for the perspective correct interpolation
+		struct sTriangle {
+			float edge[3][3]; //a * x + b * y + c gives the barycentric of each vertex
+			float z[3];
+			float inv_w[3];
+			Vector3 normal_w[3];
+			Vector2 uv_w[3];
+			int material;
+			int min_x, min_y, max_x, max_y;
+		};
+
+		struct sMaterial {
+			Vector4 color;
+			Vector3 emissive;
+			float metallic;
+			float roughness;
+			float alpha_cutoff;
+			bool two_sided;
+			Image* color_image;
+			Image* emissive_image;
+			Image* metallic_roughness_image;
+		};
+
+		struct sLight {
+			int type; //0 directional, 1 spot, 2 point, like the shaders
+			Vector3 position;
+			Vector3 vector;
+			Vector3 front;
+			Vector3 color; //linear color * intensity
+			float max_distance;
+			float cone_cos;
+			float cone_exp;
+		};
+
+		int tiles_x;
+		int tiles_y;
+		int threads;
+		std::vector<sMaterial> materials;
+		std::vector<sLight> light_list;
+		std::vector<std::vector<sTriangle>> thread_triangles;
+		std::vector<std::vector<std::vector<int>>> thread_bins; //[thread][tile] triangles in submission order
+
+		void resize(int width, int height);
+		int addMaterial(Material* material, std::vector<Material*>& used);
+		void setupCall(RenderCall& call, int material, const Matrix44& vp, int thread, std::vector<sVertex>& vertices);
+		void addTriangle(const sVertex* v, int material, int thread);
+		void rasterizeTile(int tile);
+		void shadeTile(int tile, Scene* scene, const Matrix44& inv_vp, Vector3 eye, const IrradianceSampler* irradiance);
+		void tonemapTile(int tile, const sToneMapping& tone, float average_lum);
+		float averageLuminance();
+
+		static Image* getImage(Texture* texture);
+		static Vector4 sampleImage(Image* image, Vector2 uv);
+	};
+};
@@ -1,4 +1,17 @@
 #include "sphericalharmonics.h"
+#include "parallel.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <iostream>
+
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER)) //gcc and clang need -mfma too, MSVC has no flag for it and /arch:AVX2 implies it
+	#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+	#include <emmintrin.h>
+#endif
 
 //system axis
 Vector3 cubemapFaceNormals[6][3] = {
@@ -40,9 +53,8 @@ float texelSolidAngle(float aU, float aV, float width, float height) {
     return angle;
 }
 
-// give me a cubemap, its size and number of channels
-// and i'll give you spherical harmonics
-SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
+// original per texel projection, only kept to benchmark against it (its vectors cache is not thread safe)
+static SphericalHarmonics computeSHReference( FloatImage images[], bool degamma ) {
 	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
     int size = images[0].width;
     int channels = 3;
@@ -123,3 +135,199 @@ SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
         linear_sh.coeffs[i] = sh.coeffs[i] * (4 * PI / weightAccum);
     return linear_sh;
 }
+
+// weight of every texel for every coefficient: solid angle * forsyth weight * basis * normalization.
+// stored by [face][coeff][texel] so every coefficient is a dot product over contiguous floats
+struct sSHTable {
+	int size;
+	std::vector<float> weights;
+	const float* get(int face, int coeff) const { return &weights[(face * sh_length + coeff) * size * size]; }
+};
+
+static std::map<int, std::unique_ptr<sSHTable>> sh_tables;
+static std::mutex sh_tables_mutex;
+
+// tables are built once per resolution and never modified after, so they can be read from any thread
+static const sSHTable* getSHTable(int size)
+{
+	std::lock_guard<std::mutex> lock(sh_tables_mutex);
+	std::unique_ptr<sSHTable>& table = sh_tables[size];
+	if (table)
+		return table.get();
+
+	table.reset(new sSHTable());
+	table->size = size;
+	table->weights.resize(6 * sh_length * size * size);
+
+	float weightAccum = 0;
+	for (int index = 0; index < 6; ++index)
+		for (int v = 0; v < size; v++)
+			for (int u = 0; u < size; u++)
+			{
+				float fU = (2.0 * u / (size - 1.0)) - 1.0;
+				float fV = (2.0 * v / (size - 1.0)) - 1.0;
+				Vector3 dir = normalize(cubemapFaceNormals[index][0] * fU + cubemapFaceNormals[index][1] * fV + cubemapFaceNormals[index][2]);
+				float weight = texelSolidAngle(u, v, size, size);
+				float dx = dir.x, dy = dir.y, dz = dir.z;
+
+				float basis[sh_length] = {
+					weight * 4 / 17,
+					weight * 8 / 17 * dy,
+					weight * 8 / 17 * dz,
+					weight * 8 / 17 * dx,
+					weight * 15 / 17 * dx * dy,
+					weight * 15 / 17 * dy * dz,
+					weight * 5 / 68 * (3.0f * dz * dz - 1.0f),
+					weight * 15 / 17 * dx * dz,
+					weight * 15 / 68 * (dx * dx - dy * dy)
+				};
+				for (int c = 0; c < sh_length; ++c)
+					table->weights[(index * sh_length + c) * size * size + v * size + u] = basis[c];
+				weightAccum += weight * 3.0f;
+			}
+
+	float normalization = 4 * PI / weightAccum;
+	for (int i = 0; i < table->weights.size(); ++i)
+		table->weights[i] *= normalization;
+	return table.get();
+}
+
+// out += sum of w * (r, g, b)
+static void dot3(const float* w, const float* r, const float* g, const float* b, int n, Vector3& out)
+{
+	int i = 0;
+	float sr = 0, sg = 0, sb = 0;
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+	__m256 ar = _mm256_setzero_ps(), ag = _mm256_setzero_ps(), ab = _mm256_setzero_ps();
+	for (; i + 8 <= n; i += 8) {
+		__m256 vw = _mm256_loadu_ps(w + i);
+		ar = _mm256_fmadd_ps(vw, _mm256_loadu_ps(r + i), ar);
+		ag = _mm256_fmadd_ps(vw, _mm256_loadu_ps(g + i), ag);
+		ab = _mm256_fmadd_ps(vw, _mm256_loadu_ps(b + i), ab);
+	}
+	float tmp[8];
+	_mm256_storeu_ps(tmp, ar); for (int j = 0; j < 8; ++j) sr += tmp[j];
+	_mm256_storeu_ps(tmp, ag); for (int j = 0; j < 8; ++j) sg += tmp[j];
+	_mm256_storeu_ps(tmp, ab); for (int j = 0; j < 8; ++j) sb += tmp[j];
+#elif defined(__SSE2__) || defined(_M_X64)
+	__m128 ar = _mm_setzero_ps(), ag = _mm_setzero_ps(), ab = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4) {
+		__m128 vw = _mm_loadu_ps(w + i);
+		ar = _mm_add_ps(ar, _mm_mul_ps(vw, _mm_loadu_ps(r + i)));
+		ag = _mm_add_ps(ag, _mm_mul_ps(vw, _mm_loadu_ps(g + i)));
+		ab = _mm_add_ps(ab, _mm_mul_ps(vw, _mm_loadu_ps(b + i)));
+	}
+	float tmp[4];
+	_mm_storeu_ps(tmp, ar); sr = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+	_mm_storeu_ps(tmp, ag); sg = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+	_mm_storeu_ps(tmp, ab); sb = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+#endif
+	for (; i < n; ++i) {
+		sr += w[i] * r[i];
+		sg += w[i] * g[i];
+		sb += w[i] * b[i];
+	}
+	out.x += sr;
+	out.y += sg;
+	out.z += sb;
+}
+
+static void projectFace(const sSHTable* table, int face, FloatImage& image, bool degamma, Vector3 coeffs[])
+{
+	int n = table->size * table->size;
+	std::vector<float> channels(n * 3);
+	float* r = &channels[0];
+	float* g = r + n;
+	float* b = g + n;
+
+	//split the pixels in planes, so the weights and colors are read with the same stride
+	int stride = image.num_channels;
+	const float* pixels = image.data;
+	for (int i = 0; i < n; ++i, pixels += stride) {
+		r[i] = pixels[0];
+		g[i] = pixels[1];
+		b[i] = pixels[2];
+	}
+	if (degamma)
+		for (int i = 0; i < n * 3; ++i)
+			r[i] = pow(r[i], 2.2f);
+
+	for (int c = 0; c < sh_length; ++c)
+		dot3(table->get(face, c), r, g, b, n, coeffs[c]);
+}
+
+static SphericalHarmonics projectCubemap(const sSHTable* table, FloatImage images[], bool degamma, bool parallel_faces)
+{
+	Vector3 face_coeffs[6][sh_length];
+	if (parallel_faces)
+		parallel_for(0, 6, 1, [&](int index) { projectFace(table, index, images[index], degamma, face_coeffs[index]); });
+	else
+		for (int index = 0; index < 6; ++index)
+			projectFace(table, index, images[index], degamma, face_coeffs[index]);
+
+	SphericalHarmonics sh;
+	for (int index = 0; index < 6; ++index)
+		for (int c = 0; c < sh_length; ++c)
+			sh.coeffs[c] = sh.coeffs[c] + face_coeffs[index][c];
+	return sh;
+}
+
+// give me a cubemap, its size and number of channels
+// and i'll give you spherical harmonics
+SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
+	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
+	int size = images[0].width;
+	//threads only pay off for big faces, probes are usually 64x64
+	return projectCubemap(getSHTable(size), images, degamma, size >= 128);
+}
+
+void computeSHBatch( FloatImage images[], SphericalHarmonics result[], int count, bool degamma, int num_threads ) {
+	if (count <= 0)
+		return;
+	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
+	const sSHTable* table = getSHTable(images[0].width);
+
+	parallel_for(0, count, 1, [&](int i) {
+		result[i] = projectCubemap(table, &images[i * 6], degamma, false);
+	}, num_threads);
+}
+
+void benchmarkSH( int size, int iterations ) {
+	std::vector<FloatImage> images(iterations * 6);
+	for (int i = 0; i < images.size(); ++i) {
+		images[i].resize(size, size, 3);
+		for (int j = 0; j < size * size * 3; ++j)
+			images[i].data[j] = (rand() % 1000) / 100.0f;
+	}
+
+	std::vector<SphericalHarmonics> reference(iterations), optimized(iterations), batch(iterations);
+	typedef std::chrono::high_resolution_clock clock;
+
+	clock::time_point start = clock::now();
+	for (int i = 0; i < iterations; ++i)
+		reference[i] = computeSHReference(&images[i * 6], false);
+	double reference_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+	getSHTable(size); //table creation is a one time cost, leave it out
+	start = clock::now();
+	for (int i = 0; i < iterations; ++i)
+		optimized[i] = computeSH(&images[i * 6]);
+	double optimized_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+	start = clock::now();
+	computeSHBatch(&images[0], &batch[0], iterations);
+	double batch_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+	float max_error = 0;
+	for (int i = 0; i < iterations; ++i)
+		for (int c = 0; c < sh_length; ++c) {
+			Vector3 d = reference[i].coeffs[c] - batch[i].coeffs[c];
+			max_error = std::max(max_error, std::max(fabsf(d.x), std::max(fabsf(d.y), fabsf(d.z))));
+		}
+
+	std::cout << "SH projection of " << iterations << " cubemaps of " << size << "x" << size << ":" << std::endl;
+	std::cout << " + reference: " << reference_ms << " ms" << std::endl;
+	std::cout << " + tables: " << optimized_ms << " ms" << std::endl;
+	std::cout << " + batch (" << parallelThreads(iterations) << " threads): " << batch_ms << " ms" << std::endl;
+	std::cout << " + max difference: " << max_error << std::endl;
+}
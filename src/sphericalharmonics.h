@@ -10,3 +10,9 @@ struct SphericalHarmonics {
 };
 
 SphericalHarmonics computeSH( FloatImage images[], bool degamma = false);
+
+//projects count cubemaps (6 faces each, consecutive) spread across threads, safe to call from any thread
+void computeSHBatch( FloatImage images[], SphericalHarmonics result[], int count, bool degamma = false, int num_threads = 0);
+
+//times computeSH against the original per texel projection and prints the results
+void benchmarkSH( int size = 64, int iterations = 200);
@@ -1,79 +1,341 @@
 #include "task.h"
 #include <iostream>       // std::cout
 #include <thread>         // std::thread
-#include <chrono>		  //ms
 #include <cassert>
+#include <algorithm>
 
-TaskManager TaskManager::foreground;
-TaskManager TaskManager::background;
+#define JOB_POOL_BLOCK 64
 
-TaskManager::TaskManager()
+struct Job {
+	std::function<void()> func;
+	std::mutex mutex; //protects finished and continuations
+	std::vector<Job*> continuations;
+	std::atomic<int> dependencies; //jobs to finish before this one can run, plus one while it is being added
+	std::atomic<bool> cancelled;
+	std::atomic<unsigned int> generation;
+	bool finished;
+	bool main_thread;
+	eJobPriority priority;
+};
+
+//index of the worker running in this thread, -1 in the others
+static thread_local int current_worker = -1;
+
+JobSystem JobSystem::instance;
+TaskManager TaskManager::foreground(true);
+TaskManager TaskManager::background(false);
+
+JobSystem::JobSystem()
+{
+	running = false;
+	num_queued = 0;
+	num_unfinished = 0;
+	next_queue = 0;
+	main_thread_id = std::this_thread::get_id(); //the statics are built in the main thread
+	int cores = std::max(1, (int)std::thread::hardware_concurrency());
+	for (int i = 0; i < cores; ++i)
+		queues.push_back(new sQueue());
+}
+
+JobSystem::~JobSystem()
 {
-	must_loop = false;
-	_thread = NULL;
+	stop();
 }
 
-void TaskManager::loop()
+void JobSystem::start(int num_workers)
 {
-	using namespace std::chrono_literals;
-	std::cout << "Starting Task Manager ..." << std::endl;
+	assert(workers.empty() && "JobSystem already started");
+	if (num_workers <= 0)
+		num_workers = (int)queues.size() - 1;
+	num_workers = std::max(1, num_workers);
+	while (queues.size() < num_workers) //no worker is running yet
+		queues.push_back(new sQueue());
+	std::cout << "Starting Job System with " << num_workers << " workers" << std::endl;
 
-	while (must_loop)
+	running = true;
+	for (int i = 0; i < num_workers; ++i)
+		workers.push_back(std::thread(&JobSystem::workerLoop, this, i));
+}
+
+void JobSystem::stop()
+{
+	if (workers.empty())
+		return;
 	{
-		if (pending_tasks.empty())
-		{
-			std::this_thread::sleep_for(10ms);
-			continue;
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		running = false;
+	}
+	wake_cond.notify_all();
+	for (int i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	workers.clear();
+}
+
+//jobs are never freed, finished ones go back to the pool
+Job* JobSystem::allocate()
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	if (free_jobs.empty()) {
+		Job* block = new Job[JOB_POOL_BLOCK];
+		for (int i = 0; i < JOB_POOL_BLOCK; ++i) {
+			block[i].generation = 1;
+			free_jobs.push_back(&block[i]);
 		}
+	}
+	Job* job = free_jobs.back();
+	free_jobs.pop_back();
+	return job;
+}
+
+void JobSystem::release(Job* job)
+{
+	job->func = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(job->mutex);
+		job->generation++; //the handles to it are done from now
+	}
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	free_jobs.push_back(job);
+}
+
+JobHandle JobSystem::add(std::function<void()> func, eJobPriority priority, const JobHandle* dependencies, int num_dependencies, bool main_thread)
+{
+	Job* job = allocate();
+	job->func = func;
+	job->priority = priority;
+	job->main_thread = main_thread;
+	job->cancelled = false;
+	job->finished = false;
+	job->continuations.clear();
+	job->dependencies = 1; //so it is not queued before all the dependencies are set
+	if (!main_thread)
+		num_unfinished++;
+
+	JobHandle handle;
+	handle.job = job;
+	handle.generation = job->generation;
 
-		fetchTask();
+	for (int i = 0; i < num_dependencies; ++i)
+	{
+		Job* dependency = dependencies[i].job;
+		if (!dependency)
+			continue;
+		std::lock_guard<std::mutex> lock(dependency->mutex);
+		if (dependency->generation != dependencies[i].generation || dependency->finished)
+			continue;
+		job->dependencies++;
+		dependency->continuations.push_back(job);
 	}
 
-	std::cout << "Ending Task Manager" << std::endl;
+	resolveDependency(job);
+	return handle;
 }
 
-void TaskManager::fetchTask()
+JobHandle JobSystem::then(JobHandle job, std::function<void()> func, eJobPriority priority, bool main_thread)
+{
+	return add(func, priority, &job, 1, main_thread);
+}
+
+void JobSystem::cancel(JobHandle handle)
+{
+	Job* job = handle.job;
+	if (!job)
+		return;
+	std::lock_guard<std::mutex> lock(job->mutex);
+	if (job->generation == handle.generation)
+		job->cancelled = true;
+}
+
+bool JobSystem::isDone(JobHandle handle)
+{
+	return !handle.job || handle.job->generation != handle.generation;
+}
+
+void JobSystem::wait(JobHandle handle, bool main_thread_jobs)
+{
+	//a main thread job could touch GL in the middle of whatever the caller is doing
+	bool in_main_thread = main_thread_jobs && std::this_thread::get_id() == main_thread_id;
+	while (!isDone(handle))
+	{
+		if (runOne())
+			continue;
+		if (in_main_thread && runMainThreadJob())
+			continue;
+		std::this_thread::yield();
+	}
+}
+
+void JobSystem::resolveDependency(Job* job)
+{
+	if (--job->dependencies == 0)
+		schedule(job);
+}
+
+void JobSystem::schedule(Job* job)
+{
+	if (job->main_thread) {
+		std::lock_guard<std::mutex> lock(main_queue.mutex);
+		main_queue.jobs[job->priority].push_back(job);
+		return;
+	}
+
+	//the workers add to their own queue, the other threads spread them
+	int index = current_worker;
+	if (index == -1)
+		index = next_queue++ % std::max(1, (int)workers.size());
+	{
+		std::lock_guard<std::mutex> lock(queues[index]->mutex);
+		queues[index]->jobs[job->priority].push_back(job);
+	}
+	num_queued++;
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex); //so a worker about to sleep does not miss it
+	}
+	wake_cond.notify_one();
+}
+
+//newest of its own queue, if empty the oldest of another one, always by priority
+Job* JobSystem::pop(int worker)
 {
-	Task* task = NULL;
-	try
+	if (num_queued == 0)
+		return NULL;
+	int num_queues = (int)queues.size();
+	for (int priority = 0; priority < JOB_NUM_PRIORITIES; ++priority)
 	{
-		//lock
-		const std::lock_guard<std::mutex> lock(tasks_mutex);
-		if (pending_tasks.empty())
-			return;
-		task = pending_tasks.front();
-		pending_tasks.pop_front();
-		//unlock after finishing scope
+		if (worker != -1) {
+			sQueue* queue = queues[worker];
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			std::deque<Job*>& jobs = queue->jobs[priority];
+			if (jobs.size()) {
+				Job* job = jobs.back();
+				jobs.pop_back();
+				num_queued--;
+				return job;
+			}
+		}
+
+		int start = worker + 1;
+		for (int i = 0; i < num_queues; ++i)
+		{
+			int index = (start + i) % num_queues;
+			if (index == worker)
+				continue;
+			sQueue* queue = queues[index];
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			std::deque<Job*>& jobs = queue->jobs[priority];
+			if (jobs.size()) {
+				Job* job = jobs.front();
+				jobs.pop_front();
+				num_queued--;
+				return job;
+			}
+		}
+	}
+	return NULL;
+}
+
+void JobSystem::execute(Job* job)
+{
+	if (!job->cancelled && job->func)
+		job->func();
+
+	std::vector<Job*> continuations;
+	{
+		std::lock_guard<std::mutex> lock(job->mutex);
+		job->finished = true;
+		continuations.swap(job->continuations);
+	}
+	bool cancelled = job->cancelled;
+	bool main_thread = job->main_thread;
+	release(job);
+
+	for (int i = 0; i < continuations.size(); ++i) {
+		if (cancelled)
+			continuations[i]->cancelled = true;
+		resolveDependency(continuations[i]);
 	}
-	catch (std::logic_error&) {
-		std::cout << "[exception caught]\n";
+	if (!main_thread)
+		num_unfinished--;
+}
+
+bool JobSystem::runOne()
+{
+	Job* job = pop(current_worker);
+	if (!job)
+		return false;
+	execute(job);
+	return true;
+}
+
+bool JobSystem::runMainThreadJob()
+{
+	Job* job = NULL;
+	{
+		std::lock_guard<std::mutex> lock(main_queue.mutex);
+		for (int priority = 0; priority < JOB_NUM_PRIORITIES && !job; ++priority)
+			if (main_queue.jobs[priority].size()) {
+				job = main_queue.jobs[priority].front();
+				main_queue.jobs[priority].pop_front();
+			}
 	}
+	if (!job)
+		return false;
+	execute(job);
+	return true;
+}
+
+int JobSystem::pendingMainThread()
+{
+	std::lock_guard<std::mutex> lock(main_queue.mutex);
+	int count = 0;
+	for (int priority = 0; priority < JOB_NUM_PRIORITIES; ++priority)
+		count += (int)main_queue.jobs[priority].size();
+	return count;
+}
 
-	if (task)
+void JobSystem::workerLoop(int index)
+{
+	current_worker = index;
+	while (running)
 	{
-		task->onExecute();
-		delete task;
-		task = NULL;
+		Job* job = pop(index);
+		if (job) {
+			execute(job);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(wake_mutex);
+		wake_cond.wait(lock, [this] { return num_queued > 0 || !running; });
 	}
+	current_worker = -1;
+}
+
+//*********************
+
+TaskManager::TaskManager(bool main_thread)
+{
+	this->main_thread = main_thread;
 }
 
-void thread_loop_func(TaskManager* manager)
+JobHandle TaskManager::addTask(Task* task, eJobPriority priority)
 {
-	manager->loop();
-	//join?
+	std::shared_ptr<Task> owned(task); //freed with the job, also when it is cancelled
+	return JobSystem::instance.add([owned]() { owned->onExecute(); }, priority, NULL, 0, main_thread);
+}
+
+void TaskManager::fetchTask()
+{
+	if (main_thread)
+		JobSystem::instance.runMainThreadJob();
+	else
+		JobSystem::instance.runOne();
 }
 
 void TaskManager::startThread()
 {
-	assert(!_thread && "TaskManager already in a thread");
-	must_loop = true;
-	_thread = new std::thread(thread_loop_func, this);
+	JobSystem::instance.start();
 }
 
-void TaskManager::addTask(Task* task)
+int TaskManager::pending()
 {
-	//block pending_tasks
-	const std::lock_guard<std::mutex> lock(tasks_mutex);
-	pending_tasks.push_back(task);
-	//release pending_tasks automatically
-}
\ No newline at end of file
+	return main_thread ? JobSystem::instance.pendingMainThread() : JobSystem::instance.pending();
+}
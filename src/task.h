@@ -1,10 +1,84 @@
 #pragma once
 
 #include <vector>
-#include <list>
+#include <deque>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <thread>         // std::thread
 #include <functional>
+#include <memory>
+
+enum eJobPriority {
+	JOB_HIGH = 0,
+	JOB_NORMAL = 1,
+	JOB_LOW = 2,
+	JOB_NUM_PRIORITIES = 3
+};
+
+struct Job;
+
+//a job can be reused once finished, the generation tells if it is still the same one
+struct JobHandle {
+	Job* job;
+	unsigned int generation;
+	JobHandle() { job = NULL; generation = 0; }
+};
+
+// One worker per core, every one with its own deque per priority. A worker takes its newest jobs first
+// and when it has none steals the oldest ones of the others. Idle workers sleep on a condition variable.
+// Jobs can depend on other jobs (they are queued when all of them finish) and the ones marked main_thread
+// are only run by runMainThreadJob, for GL work.
+class JobSystem {
+public:
+	static JobSystem instance;
+
+	JobSystem();
+	~JobSystem();
+
+	void start(int num_workers = 0); //0 is one per core but the main thread, that helps when waiting
+	void stop();
+	int numWorkers() { return (int)workers.size(); }
+
+	JobHandle add(std::function<void()> func, eJobPriority priority = JOB_NORMAL, const JobHandle* dependencies = NULL, int num_dependencies = 0, bool main_thread = false);
+	JobHandle then(JobHandle job, std::function<void()> func, eJobPriority priority = JOB_NORMAL, bool main_thread = false);
+	void cancel(JobHandle job); //skipped if it did not start, the jobs depending on it are cancelled too
+	bool isDone(JobHandle job);
+	void wait(JobHandle job, bool main_thread_jobs = false); //runs other jobs meanwhile, the main thread ones only if asked
+
+	bool runOne(); //runs a worker job in this thread, false if there was none
+	bool runMainThreadJob();
+	int pending() { return num_unfinished; } //worker jobs not finished, waiting ones included
+	int pendingMainThread();
+
+private:
+	struct sQueue {
+		std::mutex mutex;
+		std::deque<Job*> jobs[JOB_NUM_PRIORITIES];
+	};
+
+	std::vector<std::thread> workers;
+	std::vector<sQueue*> queues; //one per possible worker, fixed so the jobs can be added before start
+	sQueue main_queue;
+	std::thread::id main_thread_id;
+	std::atomic<bool> running;
+	std::atomic<int> num_queued;
+	std::atomic<int> num_unfinished;
+	std::atomic<unsigned int> next_queue;
+	std::mutex wake_mutex;
+	std::condition_variable wake_cond;
+
+	std::mutex pool_mutex;
+	std::vector<Job*> free_jobs;
+
+	Job* allocate();
+	void release(Job* job);
+	void schedule(Job* job);
+	void resolveDependency(Job* job);
+	Job* pop(int worker);
+	void execute(Job* job);
+	void workerLoop(int index);
+};
 
 //any task executed in BG should inherit from this one
 class Task {
@@ -16,19 +90,18 @@ public:
 	virtual void onExecute() { if (callback) callback(); }
 };
 
+//old interface, the tasks are jobs now: the background ones run in the workers of the JobSystem and the
+//foreground ones in the main thread, one every fetchTask
 class TaskManager {
 public:
-	std::list<Task*> pending_tasks;
-	std::mutex tasks_mutex;  // protects pending_tasks
-	bool must_loop;
-	std::thread* _thread;
+	bool main_thread;
 
 	static TaskManager foreground;
 	static TaskManager background;
 
-	TaskManager();
-	void addTask(Task* task);
-	void fetchTask();
-	void loop();
-	void startThread();
-};
\ No newline at end of file
+	TaskManager(bool main_thread);
+	JobHandle addTask(Task* task, eJobPriority priority = JOB_NORMAL); //the task is deleted with the job, run or cancelled
+	void fetchTask(); //runs one pending task in this thread
+	void startThread(); //starts the workers
+	int pending();
+};
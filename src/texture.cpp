@@ -5,9 +5,11 @@
 
 #include <iostream> //to output
 #include <cmath>
+#include <memory>
 
 #include "mesh.h"
 #include "shader.h"
+#include "parallel.h"
 #include "extra/picopng.h"
 #include "extra/jpgd.h"
 #include <cassert>
@@ -167,7 +169,6 @@ void Texture::create(unsigned int width, unsigned int height, unsigned int forma
 	upload(format, type, mipmaps, data, internal_format);
 }
 
-/*
 void Texture::create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 {
 	assert(width && height && depth && "texture must have a size");
@@ -193,7 +194,6 @@ void Texture::create3D(unsigned int width, unsigned int height, unsigned int dep
 
 	upload3D(format, type, mipmaps, data, internal_format);
 }
-*/
 
 void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 {
@@ -218,6 +218,42 @@ void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** dat
 	uploadCubemap(format, type, mipmaps, data, internal_format);
 }
 
+void Texture::createCubemapArray(unsigned int size, unsigned int count, unsigned int levels, unsigned int format, unsigned int type, unsigned int internal_format)
+{
+	assert(size && count && levels && "texture must have a size");
+
+	if (this->texture_id != 0)
+		clear();
+
+	this->width = (float)size;
+	this->height = (float)size;
+	this->depth = (float)(count * 6);
+	this->format = format;
+	this->type = type;
+	this->texture_type = GL_TEXTURE_CUBE_MAP_ARRAY;
+	this->mipmaps = levels > 1;
+	if (internal_format == 0)
+		internal_format = type == GL_FLOAT ? GL_RGBA32F : GL_RGBA16F;
+	this->internal_format = internal_format;
+	this->wrapS = GL_CLAMP_TO_EDGE;
+	this->wrapT = GL_CLAMP_TO_EDGE;
+
+	glGenTextures(1, &texture_id);
+	glBindTexture(this->texture_type, texture_id);
+	for (unsigned int i = 0; i < levels; ++i) {
+		unsigned int level_size = (size >> i) ? (size >> i) : 1;
+		glTexImage3D(this->texture_type, i, internal_format, level_size, level_size, count * 6, 0, format, type, NULL);
+	}
+	glTexParameteri(this->texture_type, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error creating texture");
+}
+
 Texture* Texture::Find(const char* filename)
 {
 	assert(filename);
@@ -258,9 +294,15 @@ Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap)
 	temp->setName(filename);
 	temp->loading = true;
 
-	//add action to BG Thread 
-	LoadTextureTask* task = new LoadTextureTask(filename);
-	TaskManager::background.addTask(task);
+	//load in a worker and upload in the main thread after it. Both jobs own the task, so it and its pixels
+	//are freed with the last one, also when they are cancelled
+	std::shared_ptr<LoadTextureTask> task = std::make_shared<LoadTextureTask>(filename);
+	JobHandle loaded = JobSystem::instance.add([task]() { task->onExecute(); });
+	JobSystem::instance.then(loaded, [task]() {
+		UploadTextureTask upload(task->filename.c_str(), task->image);
+		task->image = NULL; //the upload deletes it
+		upload.onExecute();
+	}, JOB_NORMAL, true);
 
 	return temp;
 }
@@ -344,7 +386,6 @@ void Texture::upload( unsigned int format, unsigned int type, bool mipmaps, Uint
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
-/*
 void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format) {
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
@@ -365,7 +406,6 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	glBindTexture(this->texture_type, 0);
 	assert(checkGLErrors() && "Error uploading texture");
 }
-*/
 
 void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint8** data, unsigned int intFormat, int level) {
 	
@@ -752,14 +792,18 @@ bool Image::loadTGA(const char* filename)
 	if (header[5] & (1 << 5)) //flip
 		origin_topleft = true;
     
-	//flip BGR to RGB pixels
-	#pragma omp simd
-    for (GLuint i = 0; i < int(imageSize); i += num_channels)
-    {
-        uint8 temp = data[i];
-        data[i] = data[i + 2];
-        data[i + 2] = temp;
-    }
+	//flip BGR to RGB pixels, in chunks of rows
+	int num_pixels = imageSize / num_channels;
+	parallel_for_chunks(0, num_pixels, 64 * 1024, [&](int first, int last)
+	{
+		#pragma omp simd
+		for (int i = first * num_channels; i < last * num_channels; i += num_channels)
+		{
+			uint8 temp = data[i];
+			data[i] = data[i + 2];
+			data[i + 2] = temp;
+		}
+	});
     
     fclose(file);
 	return true;
@@ -939,17 +983,19 @@ void tImage<T>::flipY()
 {
 	assert(data);
 	int row_size = num_channels * width;
-	T* temp_row = new T[row_size];
-#pragma omp simd
-	for (int y = 0; y < height*0.5; y += 1)
+	//every chunk swaps its own pairs of rows
+	parallel_for_chunks(0, height / 2, 64, [&](int first, int last)
 	{
-		uint8* pos = data + y*row_size;
-		memcpy(temp_row, pos, row_size);
-		uint8* pos2 = data + (height - y - 1)*row_size;
-		memcpy(pos, pos2, row_size);
-		memcpy(pos2, temp_row, row_size);
-	}
-	delete[] temp_row;
+		std::vector<T> temp_row(row_size);
+		for (int y = first; y < last; ++y)
+		{
+			T* pos = data + y*row_size;
+			T* pos2 = data + (height - y - 1)*row_size;
+			memcpy(&temp_row[0], pos, row_size * sizeof(T));
+			memcpy(pos, pos2, row_size * sizeof(T));
+			memcpy(pos2, &temp_row[0], row_size * sizeof(T));
+		}
+	});
 }
 
 struct tImageHeader {
@@ -1025,6 +1071,11 @@ LoadTextureTask::LoadTextureTask(const char* str)
 	image = NULL;
 }
 
+LoadTextureTask::~LoadTextureTask()
+{
+	delete image; //only when the upload did not run
+}
+
 void LoadTextureTask::onExecute()
 {
 	image = new Image();
@@ -1033,10 +1084,6 @@ void LoadTextureTask::onExecute()
 		delete image;
 		image = NULL;
 	}
-
-	//image loaded, ready to go back to main thread
-	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image);
-	TaskManager::foreground.addTask(upload_task);
 }
 
 UploadTextureTask::UploadTextureTask(const char* filename, Image* image)
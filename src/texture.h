@@ -143,13 +143,15 @@ public:
 	void clear();
 
 	void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-	//void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+	void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void createCubemap(unsigned int width, unsigned int height, Uint8** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0);
+	//empty array of count cubemaps (6 * count layers) with levels mips allocated, to be filled by rendering
+	void createCubemapArray(unsigned int size, unsigned int count, unsigned int levels, unsigned int format = GL_RGB, unsigned int type = GL_HALF_FLOAT, unsigned int internal_format = 0);
 
 	void upload(Image* img);
 	void upload(FloatImage* img);
 	void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-	//void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+	void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
 	void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
 
@@ -191,7 +193,7 @@ bool isPowerOfTwo(int n);
 
 //When loading textures asyncrhonously, first we load them from the hard drive in a background thread
 //afterwards we pass the data to the main thread as bg threads cannot access opengl, and main thread
-//uploads to GPU. While loading a fake 1x1 texture is created
+//uploads to GPU (the upload is a job that depends on the load one). While loading a fake 1x1 texture is created
 
 class LoadTextureTask : public Task {
 public:
@@ -199,6 +201,7 @@ public:
 	Image* image;
 
 	LoadTextureTask(const char* filename);
+	~LoadTextureTask();
 	void onExecute();
 };
 